@@ -0,0 +1,187 @@
+#include "AffineKernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define AFFINE_KERNELS_X86 1
+#endif
+
+// -- MONTGOMERY ARITHMETIC (R = 2^32) -------------------------------------------
+// -------------------------------------------------------------------------------
+
+struct Montgomery32 {
+    uint32_t p;
+    uint32_t p_neg_inv; // -p^-1 mod 2^32
+    uint32_t r2;        // R^2 mod p
+
+    explicit Montgomery32(uint32_t p) : p(p) {
+        uint32_t inv = p; // Newton iteration, each step doubles the correct low bits
+        for (int i = 0; i < 5; ++i) inv *= 2 - p * inv;
+        p_neg_inv = 0u - inv;
+        uint64_t r = (static_cast<uint64_t>(1) << 32) % p;
+        r2 = static_cast<uint32_t>(r * r % p);
+    }
+
+    // t * R^-1 mod p, for t < p * R
+    uint32_t reduce(uint64_t t) const {
+        uint32_t m = static_cast<uint32_t>(t) * p_neg_inv;
+        uint64_t u = (t + static_cast<uint64_t>(m) * p) >> 32;
+        return static_cast<uint32_t>(u >= p ? u - p : u);
+    }
+
+    uint32_t to_mont(uint32_t x) const { return reduce(static_cast<uint64_t>(x) * r2); }
+
+    // x * y mod p, with x given in Montgomery form
+    uint32_t mul(uint32_t x_mont, uint32_t y) const { return reduce(static_cast<uint64_t>(x_mont) * y); }
+
+    uint32_t add(uint32_t x, uint32_t y) const {
+        uint32_t s = x + y;
+        return s >= p ? s - p : s;
+    }
+};
+
+// -- SCALAR KERNELS ---------------------------------------------------------------
+// ---------------------------------------------------------------------------------
+
+static void compose_scalar(const Montgomery32& mg, const uint64_t* a1, const uint64_t* b1,
+                           const uint64_t* a2, const uint64_t* b2,
+                           uint64_t* a_out, uint64_t* b_out, size_t begin, size_t n) {
+    for (size_t i = begin; i < n; ++i) {
+        uint32_t a1m = mg.to_mont(static_cast<uint32_t>(a1[i]));
+        uint32_t b = mg.add(mg.mul(a1m, static_cast<uint32_t>(b2[i])), static_cast<uint32_t>(b1[i]));
+        a_out[i] = mg.mul(a1m, static_cast<uint32_t>(a2[i]));
+        b_out[i] = b;
+    }
+}
+
+static void apply_scalar(const Montgomery32& mg, const uint64_t* a, const uint64_t* b, const uint64_t* x,
+                         uint64_t* out, size_t begin, size_t n) {
+    for (size_t i = begin; i < n; ++i) {
+        out[i] = mg.add(mg.mul(mg.to_mont(static_cast<uint32_t>(a[i])), static_cast<uint32_t>(x[i])),
+                        static_cast<uint32_t>(b[i]));
+    }
+}
+
+// Moduli the 32-bit Montgomery kernels cannot take.
+static void compose_generic(const Modulus& mod, const uint64_t* a1, const uint64_t* b1,
+                            const uint64_t* a2, const uint64_t* b2,
+                            uint64_t* a_out, uint64_t* b_out, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t b = mod.add(mod.mul(a1[i], b2[i]), b1[i]);
+        a_out[i] = mod.mul(a1[i], a2[i]);
+        b_out[i] = b;
+    }
+}
+
+static void apply_generic(const Modulus& mod, const uint64_t* a, const uint64_t* b, const uint64_t* x,
+                          uint64_t* out, size_t n) {
+    for (size_t i = 0; i < n; ++i) out[i] = mod.add(mod.mul(a[i], x[i]), b[i]);
+}
+
+static bool fits_montgomery32(uint64_t p) { return (p & 1) && p < (uint64_t(1) << 31); }
+
+// -- AVX2 KERNELS -------------------------------------------------------------------
+// Four residues in 64-bit lanes; they are below 2^31, so _mm256_mul_epu32 gives full products.
+// -----------------------------------------------------------------------------------
+
+#ifdef AFFINE_KERNELS_X86
+
+struct Montgomery32x4 {
+    __m256i p, p_neg_inv, r2;
+};
+
+__attribute__((target("avx2")))
+static inline __m256i load4(const uint64_t* src) {
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src));
+}
+
+__attribute__((target("avx2")))
+static inline void store4(uint64_t* dst, __m256i v) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst), v);
+}
+
+// lanes >= p lose p; inputs are below 2p < 2^32, so the signed 64-bit compare is exact
+__attribute__((target("avx2")))
+static inline __m256i cond_sub(__m256i v, __m256i p) {
+    __m256i below = _mm256_cmpgt_epi64(p, v);
+    return _mm256_sub_epi64(v, _mm256_andnot_si256(below, p));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i reduce4(const Montgomery32x4& mg, __m256i t) {
+    __m256i m = _mm256_mul_epu32(t, mg.p_neg_inv); // only the low 32 bits of m are used below
+    __m256i u = _mm256_srli_epi64(_mm256_add_epi64(t, _mm256_mul_epu32(m, mg.p)), 32);
+    return cond_sub(u, mg.p);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i mul4(const Montgomery32x4& mg, __m256i x_mont, __m256i y) {
+    return reduce4(mg, _mm256_mul_epu32(x_mont, y));
+}
+
+__attribute__((target("avx2")))
+static size_t compose_avx2(const Montgomery32& s, const uint64_t* a1, const uint64_t* b1,
+                           const uint64_t* a2, const uint64_t* b2,
+                           uint64_t* a_out, uint64_t* b_out, size_t n) {
+    const Montgomery32x4 mg{_mm256_set1_epi64x(s.p), _mm256_set1_epi64x(s.p_neg_inv), _mm256_set1_epi64x(s.r2)};
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i a1m = mul4(mg, load4(a1 + i), mg.r2);
+        __m256i a = mul4(mg, a1m, load4(a2 + i));
+        __m256i b = cond_sub(_mm256_add_epi64(mul4(mg, a1m, load4(b2 + i)), load4(b1 + i)), mg.p);
+        store4(a_out + i, a);
+        store4(b_out + i, b);
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t apply_avx2(const Montgomery32& s, const uint64_t* a, const uint64_t* b, const uint64_t* x,
+                         uint64_t* out, size_t n) {
+    const Montgomery32x4 mg{_mm256_set1_epi64x(s.p), _mm256_set1_epi64x(s.p_neg_inv), _mm256_set1_epi64x(s.r2)};
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i am = mul4(mg, load4(a + i), mg.r2);
+        __m256i v = cond_sub(_mm256_add_epi64(mul4(mg, am, load4(x + i)), load4(b + i)), mg.p);
+        store4(out + i, v);
+    }
+    return i;
+}
+
+static bool has_avx2() {
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    return avx2;
+}
+
+#endif // AFFINE_KERNELS_X86
+
+// -- ENTRY POINTS -------------------------------------------------------------------
+// -----------------------------------------------------------------------------------
+
+void compose_affine_batch(const uint64_t* a1, const uint64_t* b1,
+                          const uint64_t* a2, const uint64_t* b2,
+                          uint64_t* a_out, uint64_t* b_out, size_t n, const Modulus& mod) {
+    if (!fits_montgomery32(mod.value())) {
+        compose_generic(mod, a1, b1, a2, b2, a_out, b_out, n);
+        return;
+    }
+    const Montgomery32 mg(static_cast<uint32_t>(mod.value()));
+    size_t done = 0;
+#ifdef AFFINE_KERNELS_X86
+    if (has_avx2()) done = compose_avx2(mg, a1, b1, a2, b2, a_out, b_out, n);
+#endif
+    compose_scalar(mg, a1, b1, a2, b2, a_out, b_out, done, n);
+}
+
+void apply_affine_batch(const uint64_t* a, const uint64_t* b, const uint64_t* x,
+                        uint64_t* out, size_t n, const Modulus& mod) {
+    if (!fits_montgomery32(mod.value())) {
+        apply_generic(mod, a, b, x, out, n);
+        return;
+    }
+    const Montgomery32 mg(static_cast<uint32_t>(mod.value()));
+    size_t done = 0;
+#ifdef AFFINE_KERNELS_X86
+    if (has_avx2()) done = apply_avx2(mg, a, b, x, out, n);
+#endif
+    apply_scalar(mg, a, b, x, out, done, n);
+}
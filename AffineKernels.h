@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include "ModArith.h"
+
+// Batched kernels over affine maps f(x) = a*x + b modulo mod.value().
+// Maps are packed as separate arrays of coefficients (a[i], b[i]); every input must
+// already be reduced into [0, p). For odd p < 2^31 products are reduced with 32-bit
+// Montgomery multiplication, four lanes at a time with AVX2 when the CPU has it; any
+// other modulus goes through the scalar Modulus arithmetic.
+
+// (a_out, b_out)[i] = f1[i] o f2[i], i.e. x -> a1*(a2*x + b2) + b1
+void compose_affine_batch(const uint64_t* a1, const uint64_t* b1,
+                          const uint64_t* a2, const uint64_t* b2,
+                          uint64_t* a_out, uint64_t* b_out, size_t n, const Modulus& mod);
+
+// out[i] = a[i]*x[i] + b[i]
+void apply_affine_batch(const uint64_t* a, const uint64_t* b, const uint64_t* x,
+                        uint64_t* out, size_t n, const Modulus& mod);
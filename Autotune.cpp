@@ -0,0 +1,263 @@
+#include "Autotune.h"
+#include "TreeContrParallel.h"
+#include "ContractionSchedule.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+std::string AUTOTUNE_PROFILE = "autotune_profile.txt";
+
+// Grains swept per engine: BATCH_SIZE counts nodes per task, REPLAY_GRAIN steps per chunk.
+static const std::vector<size_t> CONTRACTION_GRAINS = {4, 8, 15, 32, 64, 128, 256};
+static const std::vector<size_t> REPLAY_GRAINS = {256, 512, 1024, 2048, 4096, 8192};
+
+// Runs timed per setting; the best one counts, so a preempted run does not.
+constexpr int AUTOTUNE_REPS = 3;
+
+// Seconds one calibration may take, and nodes of the subtree it times.
+double AUTOTUNE_BUDGET = 2.0;
+constexpr size_t AUTOTUNE_SAMPLE_SIZE = size_t(1) << 16;
+
+static bool live(Node* child) { return child && !child->isDeleted(); }
+
+// -- SHAPE ----------------------------------------------------------------------------------
+// -------------------------------------------------------------------------------------------
+
+TreeShape measure_shape(Node* root) {
+    TreeShape shape{0, 0, ShapeClass::BALANCED, 0};
+    std::vector<std::pair<Node*, size_t>> stack;
+    if (root) stack.emplace_back(root, 0);
+    while (!stack.empty()) {
+        auto [node, depth] = stack.back();
+        stack.pop_back();
+        ++shape.size;
+        shape.depth = std::max(shape.depth, depth);
+        if (live(node->getLeftChild())) stack.emplace_back(node->getLeftChild(), depth + 1);
+        if (live(node->getRightChild())) stack.emplace_back(node->getRightChild(), depth + 1);
+    }
+    if (shape.size == 0) return shape;
+
+    const size_t log_size = static_cast<size_t>(std::log2(static_cast<double>(shape.size)));
+    if (shape.depth <= 4 * (log_size + 1)) {
+        shape.shape = ShapeClass::BALANCED;
+    } else if (shape.depth * 8 >= shape.size) {
+        shape.shape = ShapeClass::CHAIN;
+    } else {
+        shape.shape = ShapeClass::SKEWED;
+    }
+    shape.size_class = static_cast<int>(log_size / 2);
+    return shape;
+}
+
+const char* engine_name(TunedEngine engine) {
+    return engine == TunedEngine::CONTRACTION ? "contraction" : "replay";
+}
+
+const char* shape_name(ShapeClass shape) {
+    switch (shape) {
+        case ShapeClass::BALANCED: return "balanced";
+        case ShapeClass::SKEWED: return "skewed";
+        default: return "chain";
+    }
+}
+
+template <typename E>
+static bool parse_name(const std::string& name, E& value, const char* (*name_of)(E), int count) {
+    for (int i = 0; i < count; ++i) {
+        if (name == name_of(static_cast<E>(i))) {
+            value = static_cast<E>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+// -- PROFILE --------------------------------------------------------------------------------
+// One setting per line: engine shape size_class threads grain seconds, '#' for comments.
+// -------------------------------------------------------------------------------------------
+
+Autotuner::Autotuner(std::string path) : path(std::move(path)) {
+    std::ifstream in(this->path);
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        std::istringstream fields(line);
+        std::string engine_field, shape_field;
+        int size_class;
+        TuneSetting setting;
+        if (!(fields >> engine_field >> shape_field >> size_class >> setting.threads >> setting.grain >> setting.seconds)) {
+            continue;
+        }
+        TunedEngine engine;
+        ShapeClass shape;
+        if (!parse_name(engine_field, engine, engine_name, 2) || !parse_name(shape_field, shape, shape_name, 3)) continue;
+        if (setting.threads == 0 || setting.grain == 0) continue;
+        settings[{static_cast<int>(engine), static_cast<int>(shape), size_class}] = setting;
+    }
+}
+
+void Autotuner::save() const {
+    std::ofstream out(path);
+    out << "# engine shape size_class threads grain seconds\n";
+    for (const auto& [key, setting] : settings) {
+        out << engine_name(static_cast<TunedEngine>(std::get<0>(key))) << ' '
+            << shape_name(static_cast<ShapeClass>(std::get<1>(key))) << ' ' << std::get<2>(key) << ' '
+            << setting.threads << ' ' << setting.grain << ' ' << setting.seconds << '\n';
+    }
+}
+
+bool Autotuner::calibrated(TunedEngine engine, const TreeShape& shape) const {
+    return settings.count({static_cast<int>(engine), static_cast<int>(shape.shape), shape.size_class}) > 0;
+}
+
+TuneSetting Autotuner::pick(TunedEngine engine, const TreeShape& shape) const {
+    TuneSetting best{THREAD_POOL_SIZE, engine == TunedEngine::CONTRACTION ? BATCH_SIZE : REPLAY_GRAIN, 0};
+    int best_distance = -1;
+    for (const auto& [key, setting] : settings) {
+        if (std::get<0>(key) != static_cast<int>(engine) || std::get<1>(key) != static_cast<int>(shape.shape)) continue;
+        const int distance = std::abs(std::get<2>(key) - shape.size_class);
+        if (best_distance < 0 || distance < best_distance) {
+            best = setting;
+            best_distance = distance;
+        }
+    }
+    return best;
+}
+
+// -- CALIBRATION ----------------------------------------------------------------------------
+// -------------------------------------------------------------------------------------------
+
+// Puts BATCH_SIZE and REPLAY_GRAIN back on every way out of calibrate, a throw included.
+struct SavedGrains {
+    const size_t batch = BATCH_SIZE, replay = REPLAY_GRAIN;
+    ~SavedGrains() {
+        BATCH_SIZE = batch;
+        REPLAY_GRAIN = replay;
+    }
+};
+
+template <typename Run>
+static double best_time(int reps, const Run& run) {
+    double best = 0;
+    for (int rep = 0; rep < reps; ++rep) {
+        const auto start = std::chrono::steady_clock::now();
+        run();
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        if (rep == 0 || elapsed.count() < best) best = elapsed.count();
+    }
+    return best;
+}
+
+// The root of the first subtree of at most limit nodes on the path into the larger child,
+// which keeps the tree's shape class: a chain's subtrees are chains, a balanced tree's
+// balanced.
+static Node* sample_subtree(Node* root, size_t limit) {
+    std::unordered_map<Node*, size_t> size;
+    std::vector<std::pair<Node*, bool>> stack{{root, false}};
+    while (!stack.empty()) {
+        auto [node, expanded] = stack.back();
+        stack.pop_back();
+        if (!expanded) {
+            stack.emplace_back(node, true);
+            if (live(node->getLeftChild())) stack.emplace_back(node->getLeftChild(), false);
+            if (live(node->getRightChild())) stack.emplace_back(node->getRightChild(), false);
+            continue;
+        }
+        size_t& s = size[node];
+        s = 1;
+        if (live(node->getLeftChild())) s += size[node->getLeftChild()];
+        if (live(node->getRightChild())) s += size[node->getRightChild()];
+    }
+    Node* node = root;
+    while (size[node] > limit) {
+        Node* left = live(node->getLeftChild()) ? node->getLeftChild() : nullptr;
+        Node* right = live(node->getRightChild()) ? node->getRightChild() : nullptr;
+        node = !right || (left && size[left] >= size[right]) ? left : right;
+    }
+    return node;
+}
+
+TuneSetting Autotuner::calibrate(TunedEngine engine, Node* root) {
+    const auto start = std::chrono::steady_clock::now();
+    const TreeShape shape = measure_shape(root);
+    Node* sample = sample_subtree(root, AUTOTUNE_SAMPLE_SIZE);
+    const std::vector<size_t>& grains = engine == TunedEngine::CONTRACTION ? CONTRACTION_GRAINS : REPLAY_GRAINS;
+    std::vector<size_t> thread_counts;
+    for (size_t t = 1; t < static_cast<size_t>(MAX_THREADS); t *= 2) thread_counts.push_back(t);
+    thread_counts.push_back(static_cast<size_t>(MAX_THREADS));
+
+    // recorded once: the sweep times the replay, not the recording
+    std::unique_ptr<ContractionSchedule> schedule;
+    if (engine == TunedEngine::REPLAY) schedule.reset(new ContractionSchedule(sample));
+
+    const SavedGrains saved;
+    auto run = [&](ThreadPool& pool, size_t grain) {
+        if (engine == TunedEngine::CONTRACTION) {
+            BATCH_SIZE = grain;
+            Tree copy(Tree().copy_subtree(sample));
+            Node* r = copy.getRoot();
+            while (!r->is_leaf()) {
+                parallelRake(pool, r);
+                parallelCompress(pool, r);
+            }
+        } else {
+            REPLAY_GRAIN = grain;
+            schedule->replay(sample, pool);
+        }
+    };
+
+    // One run at the middle grain on every thread tells what the budget affords: fewer reps
+    // first, then every stride-th grain. The budget also stops the sweep if runs slow down.
+    double probe;
+    {
+        ThreadPool pool(thread_counts.back());
+        probe = best_time(1, [&]() { run(pool, grains[grains.size() / 2]); });
+    }
+    auto spent = [&]() { return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(); };
+    const double affordable = (AUTOTUNE_BUDGET - spent()) / std::max(probe, 1e-6);
+    const size_t pairs = thread_counts.size() * grains.size();
+    int reps = AUTOTUNE_REPS;
+    while (reps > 1 && static_cast<double>(pairs * reps) > affordable) --reps;
+    size_t stride = 1;
+    while (stride < grains.size() && static_cast<double>(thread_counts.size() * ((grains.size() + stride - 1) / stride)) > affordable) {
+        ++stride;
+    }
+
+    TuneSetting best{0, 0, 0};
+    auto over_budget = [&]() { return best.threads != 0 && spent() > AUTOTUNE_BUDGET; };
+    for (size_t threads : thread_counts) {
+        if (over_budget()) break;
+        ThreadPool pool(threads);
+        for (size_t g = stride / 2; g < grains.size(); g += stride) {
+            if (over_budget()) break;
+            const double seconds = best_time(reps, [&]() { run(pool, grains[g]); });
+            if (best.threads == 0 || seconds < best.seconds) best = TuneSetting{threads, grains[g], seconds};
+        }
+    }
+
+    settings[{static_cast<int>(engine), static_cast<int>(shape.shape), shape.size_class}] = best;
+    save();
+    return best;
+}
+
+TuneSetting tuned_setting(Autotuner& tuner, TunedEngine engine, Node* root) {
+    const TreeShape shape = measure_shape(root);
+    return tuner.calibrated(engine, shape) ? tuner.pick(engine, shape) : tuner.calibrate(engine, root);
+}
+
+void apply_setting(TunedEngine engine, const TuneSetting& setting) {
+    if (engine == TunedEngine::CONTRACTION) {
+        THREAD_POOL_SIZE = setting.threads;
+        BATCH_SIZE = setting.grain;
+    } else {
+        REPLAY_GRAIN = setting.grain;
+    }
+}
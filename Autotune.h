@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <string>
+#include <tuple>
+#include "Node.h"
+
+// Thread count and grain for the parallel engines of tree_run, tuned per engine and tree
+// shape. A calibration sweep times (threads, grain) pairs on copies of one tree and keeps
+// the fastest for the tree's engine, shape class and size class; the results go to a
+// profile file, so later runs read them instead of sweeping again.
+//
+// A sweep takes about AUTOTUNE_BUDGET seconds at most: it times a subtree of the tree when
+// the tree is large, and runs fewer repetitions and grains when the runs are slow.
+//
+// CONTRACTION is the parallelRake / parallelCompress loop (THREAD_POOL_SIZE, BATCH_SIZE),
+// REPLAY a ContractionSchedule replay (threads, REPLAY_GRAIN).
+enum class TunedEngine { CONTRACTION, REPLAY };
+
+// From depth against size: BALANCED within 4 log2(size), as full_tree_constructor's and
+// random_tree_constructor's trees are; CHAIN at least size / 8, as
+// most_unbalanced_tree_constructor's; SKEWED between.
+enum class ShapeClass { BALANCED, SKEWED, CHAIN };
+
+extern std::string AUTOTUNE_PROFILE; // "autotune_profile.txt", in the working directory
+extern double AUTOTUNE_BUDGET;       // seconds per calibration, 2 by default
+
+struct TreeShape {
+    size_t size;    // nodes
+    size_t depth;   // edges on the longest root-to-leaf path
+    ShapeClass shape;
+    int size_class; // floor(log2(size)) / 2: sizes within a factor of 4 share settings
+};
+
+struct TuneSetting {
+    size_t threads;
+    size_t grain;
+    double seconds; // best time of one run when calibrated, 0 for the defaults
+};
+
+TreeShape measure_shape(Node* root);
+const char* engine_name(TunedEngine engine);
+const char* shape_name(ShapeClass shape);
+
+class Autotuner {
+public:
+    // Loads the profile at path, if there is one; lines it cannot read are skipped.
+    explicit Autotuner(std::string path = AUTOTUNE_PROFILE);
+
+    // Whether this engine has a setting for exactly this shape and size class.
+    bool calibrated(TunedEngine engine, const TreeShape& shape) const;
+
+    // The setting of the nearest size class with the same engine and shape class, or the
+    // current globals when there is none.
+    TuneSetting pick(TunedEngine engine, const TreeShape& shape) const;
+
+    // Sweeps the thread counts up to MAX_THREADS and the engine's grains on copies of the
+    // tree under root (which is not modified), or of its largest subtree of at most 2^16
+    // nodes, within AUTOTUNE_BUDGET; keeps the fastest and saves the profile. Throws what
+    // the engine throws, e.g. std::invalid_argument from ContractionSchedule for a tree
+    // with operators it cannot record, leaving BATCH_SIZE and REPLAY_GRAIN as they were.
+    TuneSetting calibrate(TunedEngine engine, Node* root);
+
+    void save() const;
+
+private:
+    using Key = std::tuple<int, int, int>; // engine, shape class, size class
+
+    std::string path;
+    std::map<Key, TuneSetting> settings;
+};
+
+// pick() when the tree's shape is calibrated, otherwise calibrate().
+TuneSetting tuned_setting(Autotuner& tuner, TunedEngine engine, Node* root);
+
+// Sets THREAD_POOL_SIZE and BATCH_SIZE for CONTRACTION, REPLAY_GRAIN for REPLAY (whose
+// thread count goes to the pool the caller builds).
+void apply_setting(TunedEngine engine, const TuneSetting& setting);
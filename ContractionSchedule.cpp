@@ -0,0 +1,319 @@
+#include "ContractionSchedule.h"
+#include "ModArith.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+size_t REPLAY_GRAIN = 2048;
+
+// Caps the blocks of the final division.
+constexpr size_t MAX_REPLAY_TASKS = 64;
+
+static const char OPERATORS[] = "+-*/";
+
+static bool live(Node* child) { return child && !child->isDeleted(); }
+
+// -- RECORDING ------------------------------------------------------------------------------
+// The rounds of parallelmain's loop, played on the shape: a node is a value (a leaf), an
+// operator with two children or a function with one, as the strings say in the real run.
+// -------------------------------------------------------------------------------------------
+
+ContractionSchedule::ContractionSchedule(Node* root) {
+    if (!root) throw std::invalid_argument("ContractionSchedule needs a root");
+
+    std::vector<int> left, right, parent;
+    std::vector<uint8_t> op;
+    std::vector<std::pair<Node*, int>> stack{{root, -1}}; // node, 2 * parent + side
+    while (!stack.empty()) {
+        auto [node, slot] = stack.back();
+        stack.pop_back();
+        const int v = static_cast<int>(left.size());
+        left.push_back(-1);
+        right.push_back(-1);
+        parent.push_back(slot < 0 ? -1 : slot / 2);
+        if (slot >= 0) (slot % 2 == 0 ? left : right)[slot / 2] = v;
+
+        if (node->is_leaf()) {
+            if (node->is_op()) throw std::invalid_argument("Invalid tree: a leaf node cannot be an operator.");
+            op.push_back(0);
+            leaves.push_back(v);
+            continue;
+        }
+        const std::string& s = node->getString();
+        const char* found = s.size() == 1 ? std::find(OPERATORS, OPERATORS + 4, s[0]) : OPERATORS + 4;
+        if (found == OPERATORS + 4) throw std::invalid_argument("Unsupported operator: " + s);
+        if (!live(node->getLeftChild()) || !live(node->getRightChild())) {
+            throw std::invalid_argument("ContractionSchedule needs every operator to have two children");
+        }
+        op.push_back(static_cast<uint8_t>(found - OPERATORS));
+        stack.push_back({node->getRightChild(), 2 * v + 1});
+        stack.push_back({node->getLeftChild(), 2 * v});
+    }
+    node_count = left.size();
+
+    enum State : uint8_t { VALUE, OPERATOR, FUNCTION };
+    std::vector<uint8_t> state(node_count, OPERATOR);
+    for (int v : leaves) state[v] = VALUE;
+    auto is_leaf = [&](int v) { return left[v] < 0 && right[v] < 0; };
+    auto only_child = [&](int v) { return left[v] >= 0 ? left[v] : right[v]; };
+    auto remove_child = [&](int v, int child) { (left[v] == child ? left : right)[v] = -1; };
+
+    std::vector<int> work;
+    while (!is_leaf(root_id)) {
+        ++rounds;
+
+        // rake, as collect_rakeable_nodes finds the nodes
+        Level rake{evals.size(), 0, functions.size(), 0, applications.size(), 0, compositions.size(), compositions.size()};
+        work.assign(1, root_id);
+        while (!work.empty()) {
+            const int v = work.back();
+            work.pop_back();
+            if (state[v] == VALUE) continue;
+            const int l = left[v], r = right[v];
+            if (l >= 0 && r >= 0) {
+                const bool l_leaf = is_leaf(l), r_leaf = is_leaf(r);
+                if (l_leaf && r_leaf) {
+                    evals.push_back({v, l, r, static_cast<uint8_t>(2 * op[v] + 1)});
+                    continue;
+                }
+                if (l_leaf != r_leaf) {
+                    functions.push_back({v, l_leaf ? l : r, static_cast<uint8_t>(2 * op[v] + (l_leaf ? 1 : 0))});
+                    work.push_back(l_leaf ? r : l);
+                    continue;
+                }
+            }
+            if (state[v] == FUNCTION && is_leaf(only_child(v))) {
+                applications.push_back({v, only_child(v)});
+                continue;
+            }
+            if (r >= 0) work.push_back(r);
+            if (l >= 0) work.push_back(l);
+        }
+        rake.eval_end = evals.size();
+        rake.function_end = functions.size();
+        rake.application_end = applications.size();
+        levels.push_back(rake);
+
+        for (size_t i = rake.eval_begin; i < rake.eval_end; ++i) {
+            state[evals[i].node] = VALUE;
+            left[evals[i].node] = right[evals[i].node] = -1;
+        }
+        for (size_t i = rake.function_begin; i < rake.function_end; ++i) {
+            state[functions[i].node] = FUNCTION;
+            remove_child(functions[i].node, functions[i].leaf);
+        }
+        for (size_t i = rake.application_begin; i < rake.application_end; ++i) {
+            state[applications[i].node] = VALUE;
+            remove_child(applications[i].node, applications[i].child);
+        }
+
+        // compress, as collectUnaryFuncChains finds the chains; nothing below a chain
+        std::vector<std::vector<int>> chains;
+        work.assign(1, root_id);
+        while (!work.empty()) {
+            const int v = work.back();
+            work.pop_back();
+            const bool chain_root = state[v] == FUNCTION && state[only_child(v)] == FUNCTION &&
+                                    (parent[v] < 0 || state[parent[v]] != FUNCTION);
+            if (!chain_root) {
+                if (right[v] >= 0) work.push_back(right[v]);
+                if (left[v] >= 0) work.push_back(left[v]);
+                continue;
+            }
+            chains.emplace_back();
+            for (int u = v; state[u] == FUNCTION; u = only_child(u)) chains.back().push_back(u);
+        }
+
+        // pairs of neighbours per step, as parallelComposeChains
+        bool remaining = !chains.empty();
+        while (remaining) {
+            remaining = false;
+            const size_t begin = compositions.size();
+            for (std::vector<int>& chain : chains) {
+                if (chain.size() <= 1) continue;
+                std::vector<int> next_round;
+                for (size_t i = 0; i + 1 < chain.size(); i += 2) {
+                    compositions.push_back({chain[i], chain[i + 1], -1});
+                    next_round.push_back(chain[i]);
+                }
+                if (chain.size() % 2 == 1) next_round.push_back(chain.back());
+                chain = std::move(next_round);
+                remaining = remaining || chain.size() > 1;
+            }
+            for (size_t i = begin; i < compositions.size(); ++i) {
+                const int first = compositions[i].first, second = compositions[i].second;
+                const int grandchild = only_child(second);
+                compositions[i].child = grandchild;
+                (left[first] == second ? left : right)[first] = grandchild;
+                parent[grandchild] = first;
+            }
+            levels.push_back({evals.size(), evals.size(), functions.size(), functions.size(),
+                              applications.size(), applications.size(), begin, compositions.size()});
+        }
+    }
+}
+
+// -- REPLAY ---------------------------------------------------------------------------------
+// -------------------------------------------------------------------------------------------
+
+// Runs body(i) for i in [begin, end): inline when small, otherwise as one range in group,
+// which the caller waits for. Groups rather than pool.wait(), so replays of different
+// trees can share a pool.
+template <typename Body>
+static void run_steps(ThreadPool::TaskGroup& group, size_t begin, size_t end, const Body& body) {
+    if (end - begin < 2 * REPLAY_GRAIN) {
+        for (size_t i = begin; i < end; ++i) body(i);
+        return;
+    }
+    group.parallel_for(begin, end, REPLAY_GRAIN, [&body](size_t lo, size_t hi) {
+        for (size_t i = lo; i < hi; ++i) body(i);
+    });
+}
+
+// The forward pass: every node evaluated or applied gets its fraction num / den and every
+// function its matrix in fn.
+void ContractionSchedule::forward(const std::vector<uint64_t>& leaf_values, ThreadPool& pool,
+                                  std::vector<uint64_t>& num, std::vector<uint64_t>& den, std::vector<Mobius>& fn) const {
+    if (leaf_values.size() != leaves.size()) throw std::invalid_argument("replay expects one value per leaf");
+    const Modulus& mod = eval_modulus();
+
+    // template t gives num * by_num[t] + den * by_den[t] for a leaf num / den
+    Mobius by_num[8], by_den[8];
+    for (int t = 0; t < 8; ++t) {
+        const std::string op(1, OPERATORS[t / 2]);
+        by_num[t] = operator_function(op, t % 2 == 1, 1, 0, mod);
+        by_den[t] = operator_function(op, t % 2 == 1, 0, 1, mod);
+    }
+    auto instantiate = [&](uint8_t t, uint64_t num, uint64_t den) {
+        const Mobius &p = by_num[t], &q = by_den[t];
+        return Mobius{mod.add(mod.mul(p.a, num), mod.mul(q.a, den)), mod.add(mod.mul(p.b, num), mod.mul(q.b, den)),
+                      mod.add(mod.mul(p.c, num), mod.mul(q.c, den)), mod.add(mod.mul(p.d, num), mod.mul(q.d, den))};
+    };
+
+    num.assign(node_count, 0);
+    den.assign(node_count, 1);
+    fn.assign(node_count, Mobius{});
+    for (size_t k = 0; k < leaves.size(); ++k) num[leaves[k]] = leaf_values[k] % mod.value();
+
+    // named, so that queued tasks can refer to them until the level is waited for
+    auto eval = [&](size_t i) {
+        const Eval& e = evals[i];
+        uint64_t n = num[e.right], d = den[e.right];
+        mobius_apply_fraction(instantiate(e.op, num[e.left], den[e.left]), n, d, mod);
+        num[e.node] = n;
+        den[e.node] = d;
+    };
+    auto make_function = [&](size_t i) {
+        const Function& f = functions[i];
+        fn[f.node] = instantiate(f.op, num[f.leaf], den[f.leaf]);
+    };
+    auto apply = [&](size_t i) {
+        const Application& a = applications[i];
+        uint64_t n = num[a.child], d = den[a.child];
+        mobius_apply_fraction(fn[a.node], n, d, mod);
+        num[a.node] = n;
+        den[a.node] = d;
+    };
+    auto compose = [&](size_t i) {
+        const Composition& c = compositions[i];
+        fn[c.first] = mobius_compose(fn[c.first], fn[c.second], mod);
+    };
+
+    ThreadPool::TaskGroup group(pool);
+    for (const Level& level : levels) {
+        run_steps(group, level.eval_begin, level.eval_end, eval);
+        run_steps(group, level.function_begin, level.function_end, make_function);
+        run_steps(group, level.application_begin, level.application_end, apply);
+        run_steps(group, level.composition_begin, level.composition_end, compose);
+        group.wait();
+    }
+}
+
+uint64_t ContractionSchedule::replay(const std::vector<uint64_t>& leaf_values, ThreadPool& pool) const {
+    std::vector<uint64_t> num, den;
+    std::vector<Mobius> fn;
+    forward(leaf_values, pool, num, den, fn);
+    const Modulus& mod = eval_modulus();
+    return mod.mul(num[root_id], mod_inv(den[root_id], mod));
+}
+
+// Leaf strings of a tree in preorder, as residues.
+static std::vector<uint64_t> preorder_leaf_values(Node* root) {
+    const Modulus& mod = eval_modulus();
+    std::vector<uint64_t> values;
+    std::vector<Node*> stack;
+    if (root) stack.push_back(root);
+    while (!stack.empty()) {
+        Node* node = stack.back();
+        stack.pop_back();
+        if (node->is_leaf()) {
+            values.push_back(parse_residue(node->getString(), mod));
+            continue;
+        }
+        if (live(node->getRightChild())) stack.push_back(node->getRightChild());
+        if (live(node->getLeftChild())) stack.push_back(node->getLeftChild());
+    }
+    return values;
+}
+
+uint64_t ContractionSchedule::replay(Node* root, ThreadPool& pool) const {
+    return replay(preorder_leaf_values(root), pool);
+}
+
+// -- EXPAND ---------------------------------------------------------------------------------
+// The forward pass leaves out only the nodes compress spliced out of chains. A spliced node
+// `second` kept its function and the grandchild it pointed to, so going back through the
+// composition levels in reverse, second = fn[second](grandchild) with the grandchild already
+// known: it is valued later in the forward pass or spliced at a later level.
+// -------------------------------------------------------------------------------------------
+
+std::vector<uint64_t> ContractionSchedule::replay_all(const std::vector<uint64_t>& leaf_values, ThreadPool& pool) const {
+    std::vector<uint64_t> num, den;
+    std::vector<Mobius> fn;
+    forward(leaf_values, pool, num, den, fn);
+    const Modulus& mod = eval_modulus();
+
+    auto expand = [&](size_t i) {
+        const Composition& c = compositions[i];
+        uint64_t n = num[c.child], d = den[c.child];
+        mobius_apply_fraction(fn[c.second], n, d, mod);
+        num[c.second] = n;
+        den[c.second] = d;
+    };
+    ThreadPool::TaskGroup group(pool);
+    for (size_t l = levels.size(); l-- > 0;) {
+        run_steps(group, levels[l].composition_begin, levels[l].composition_end, expand);
+        group.wait();
+    }
+
+    // num / den per block, one inversion each
+    auto divide = [&](size_t lo, size_t hi) {
+        batch_inverse(den.data() + lo, hi - lo, mod);
+        for (size_t v = lo; v < hi; ++v) num[v] = mod.mul(num[v], den[v]);
+    };
+    const size_t blocks = std::max<size_t>(1, std::min(node_count / REPLAY_GRAIN, MAX_REPLAY_TASKS));
+    if (blocks == 1) {
+        divide(0, node_count);
+        return num;
+    }
+    for (size_t b = 0; b < blocks; ++b) {
+        group.run([&, b]() { divide(node_count * b / blocks, node_count * (b + 1) / blocks); });
+    }
+    group.wait(); // rethrows a zero denominator
+    return num;
+}
+
+std::vector<uint64_t> ContractionSchedule::replay_all(Node* root, ThreadPool& pool) const {
+    std::vector<uint64_t> values = replay_all(preorder_leaf_values(root), pool);
+    std::vector<Node*> stack{root};
+    for (size_t v = 0; !stack.empty(); ++v) {
+        Node* node = stack.back();
+        stack.pop_back();
+        node->setEval(static_cast<double>(values[v]));
+        if (live(node->getRightChild())) stack.push_back(node->getRightChild());
+        if (live(node->getLeftChild())) stack.push_back(node->getLeftChild());
+    }
+    return values;
+}
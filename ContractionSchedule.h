@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "Node.h"
+#include "ThreadPool.h"
+#include "ModArith.h"
+
+// Steps per chunk in replay; smaller levels run on the calling thread. Set by the
+// autotuner (Autotune.h).
+extern size_t REPLAY_GRAIN;
+
+// The rake/compress rounds of parallelRake and parallelCompress depend only on the shape
+// of the tree and its operators, so they can be recorded once and replayed for any leaf
+// values. The constructor runs the same discovery (collect_rakeable_nodes,
+// collectUnaryFuncChains) on the shape alone and keeps, per round:
+//   - the nodes evaluated from two leaves,
+//   - the nodes that become functions of their non-leaf child,
+//   - the functions applied to a leaf child,
+//   - and, per compress step, the pairs of chain functions composed.
+//
+// replay() runs these steps level by level over flat arrays indexed by preorder id. Values
+// are fractions and functions Möbius matrices, as in randomised.h's ContractionValues, so
+// every step is the same few multiply-adds whatever the operator and nothing is divided
+// until the root is read. Steps of a level are independent and split over the pool.
+// replay_all adds the expand phase, which runs the compress levels backwards to value the
+// nodes spliced out of chains, so every subtree's value comes out of the same schedule.
+//
+// Leaves are numbered in preorder. Like ContractionValues, a division by zero that a later
+// operator cancels (0 * (1/0)) is not reported.
+class ContractionSchedule {
+public:
+    // Records the run for the tree under root, which is not modified. Throws
+    // std::invalid_argument unless every internal node is a +, -, * or / with two children.
+    explicit ContractionSchedule(Node* root);
+
+    size_t leaf_count() const { return leaves.size(); }
+    size_t round_count() const { return rounds; }
+    size_t step_count() const { return evals.size() + functions.size() + applications.size() + compositions.size(); }
+
+    // The root's value modulo eval_modulus() for leaf k holding leaf_values[k].
+    // Throws std::domain_error when the root's denominator vanishes.
+    uint64_t replay(const std::vector<uint64_t>& leaf_values, ThreadPool& pool) const;
+
+    // The same with the leaf strings of a tree of the recorded shape, in preorder.
+    uint64_t replay(Node* root, ThreadPool& pool) const;
+
+    // The value of every subtree, indexed by the preorder id of its root. Throws
+    // std::domain_error if any subtree divides by zero, as the serial evaluation would.
+    std::vector<uint64_t> replay_all(const std::vector<uint64_t>& leaf_values, ThreadPool& pool) const;
+
+    // The same for a tree of the recorded shape, also storing each value in its node's eval
+    // cache as evaluate_cached does.
+    std::vector<uint64_t> replay_all(Node* root, ThreadPool& pool) const;
+
+private:
+    // Operator templates: the function of the other child for each (operator, leaf side) is
+    // linear in the leaf's fraction, so a template is two Möbius matrices, for num and den.
+    struct Eval {        // node = op(left, right), both leaves
+        int node, left, right;
+        uint8_t op;
+    };
+    struct Function {    // node becomes x -> op(leaf, x) or op(x, leaf)
+        int node, leaf;
+        uint8_t op;      // template index, with the leaf side
+    };
+    struct Application { // node = fn[node](child), child a leaf
+        int node, child;
+    };
+    struct Composition { // fn[first] = fn[first] o fn[second]; second's child was child
+        int first, second, child;
+    };
+    struct Level {       // half-open ranges into the step arrays
+        size_t eval_begin, eval_end;
+        size_t function_begin, function_end;
+        size_t application_begin, application_end;
+        size_t composition_begin, composition_end;
+    };
+
+    void forward(const std::vector<uint64_t>& leaf_values, ThreadPool& pool, std::vector<uint64_t>& num,
+                 std::vector<uint64_t>& den, std::vector<Mobius>& fn) const;
+
+    size_t node_count = 0;
+    size_t rounds = 0;
+    std::vector<int> leaves; // preorder ids of the leaves, in order
+    std::vector<Eval> evals;
+    std::vector<Function> functions;
+    std::vector<Application> applications;
+    std::vector<Composition> compositions;
+    std::vector<Level> levels;
+    int root_id = 0;
+};
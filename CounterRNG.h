@@ -0,0 +1,44 @@
+#ifndef COUNTER_RNG_H
+#define COUNTER_RNG_H
+
+#include <cstdint>
+#include <array>
+
+// Stateless counter-based random numbers (Philox-4x32-10, Salmon et al. 2011).
+// A draw is a pure function of (seed, round, id, stream): no state to set up per
+// thread, no syscall, and the same run gives the same bits whatever the number of
+// threads or the order in which nodes are visited.
+
+using Philox4x32 = std::array<uint32_t, 4>;
+
+inline void philox_round(Philox4x32& ctr, uint32_t k0, uint32_t k1) {
+    const uint64_t p0 = static_cast<uint64_t>(0xD2511F53u) * ctr[0];
+    const uint64_t p1 = static_cast<uint64_t>(0xCD9E8D57u) * ctr[2];
+    const uint32_t hi0 = static_cast<uint32_t>(p0 >> 32), lo0 = static_cast<uint32_t>(p0);
+    const uint32_t hi1 = static_cast<uint32_t>(p1 >> 32), lo1 = static_cast<uint32_t>(p1);
+    ctr = {hi1 ^ ctr[1] ^ k0, lo1, hi0 ^ ctr[3] ^ k1, lo0};
+}
+
+inline Philox4x32 philox4x32(Philox4x32 ctr, uint64_t key) {
+    uint32_t k0 = static_cast<uint32_t>(key);
+    uint32_t k1 = static_cast<uint32_t>(key >> 32);
+    for (int i = 0; i < 10; ++i) {
+        philox_round(ctr, k0, k1);
+        k0 += 0x9E3779B9u;
+        k1 += 0xBB67AE85u;
+    }
+    return ctr;
+}
+
+// 64 random bits for node `id` in contraction round `round`.
+// `stream` separates independent uses (coin flips, sampling, ...) of the same round.
+inline uint64_t counter_random(uint64_t seed, uint32_t round, uint32_t id, uint32_t stream = 0) {
+    Philox4x32 out = philox4x32({id, round, stream, 0u}, seed);
+    return (static_cast<uint64_t>(out[0]) << 32) | out[1];
+}
+
+inline bool counter_coin(uint64_t seed, uint32_t round, uint32_t id, uint32_t stream = 0) {
+    return counter_random(seed, round, id, stream) >> 63;
+}
+
+#endif // COUNTER_RNG_H
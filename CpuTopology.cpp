@@ -0,0 +1,201 @@
+#include "CpuTopology.h"
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <thread>
+#include <tuple>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+Affinity WORKER_AFFINITY = Affinity::NONE;
+std::string SYSFS_ROOT = "/sys/devices/system";
+
+// Highest NUMA node probed under SYSFS_ROOT/node.
+constexpr int MAX_NUMA_NODES = 64;
+
+static bool read_int(const std::string& path, int& value) {
+    std::ifstream in(path);
+    return static_cast<bool>(in >> value);
+}
+
+std::vector<int> parse_cpu_list(const std::string& list) {
+    std::vector<int> cpus;
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t comma = list.find(',', pos);
+        if (comma == std::string::npos) comma = list.size();
+        const std::string range = list.substr(pos, comma - pos);
+        pos = comma + 1;
+        if (range.empty() || range == "\n") continue;
+        try {
+            const size_t dash = range.find('-');
+            const int first = std::stoi(range.substr(0, dash));
+            const int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+            for (int c = first; c <= last; ++c) cpus.push_back(c);
+        } catch (...) {
+            // not a range: skip it
+        }
+    }
+    return cpus;
+}
+
+static std::vector<int> read_cpu_list(const std::string& path) {
+    std::ifstream in(path);
+    std::string list;
+    std::getline(in, list);
+    return parse_cpu_list(list);
+}
+
+static std::vector<CpuSlot> read_topology(bool allowed_only) {
+    std::vector<int> cpus = read_cpu_list(SYSFS_ROOT + "/cpu/online");
+    if (cpus.empty()) {
+        for (unsigned c = 0; c < std::max(1u, std::thread::hardware_concurrency()); ++c) cpus.push_back(static_cast<int>(c));
+    }
+#if defined(__linux__)
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (allowed_only && sched_getaffinity(0, sizeof allowed, &allowed) == 0) {
+        cpus.erase(std::remove_if(cpus.begin(), cpus.end(),
+                                  [&](int c) { return c >= CPU_SETSIZE || !CPU_ISSET(c, &allowed); }),
+                   cpus.end());
+    }
+#endif
+
+    std::map<int, int> node_of;
+    for (int node = 0; node < MAX_NUMA_NODES; ++node) {
+        for (int c : read_cpu_list(SYSFS_ROOT + "/node/node" + std::to_string(node) + "/cpulist")) node_of[c] = node;
+    }
+
+    std::vector<CpuSlot> slots;
+    for (int c : cpus) {
+        const std::string dir = SYSFS_ROOT + "/cpu/cpu" + std::to_string(c) + "/topology/";
+        CpuSlot slot{c, 0, c, 0};
+        read_int(dir + "physical_package_id", slot.package);
+        read_int(dir + "core_id", slot.core);
+        auto it = node_of.find(c);
+        if (it != node_of.end()) slot.node = it->second;
+        slots.push_back(slot);
+    }
+    return slots;
+}
+
+static std::vector<CpuSlot>& topology() {
+    static std::vector<CpuSlot> slots = read_topology(true);
+    return slots;
+}
+
+const std::vector<CpuSlot>& cpu_topology() {
+    return topology();
+}
+
+void reload_cpu_topology(bool allowed_only) {
+    topology() = read_topology(allowed_only);
+}
+
+size_t numa_node_count() {
+    int highest = 0;
+    for (const CpuSlot& slot : cpu_topology()) highest = std::max(highest, slot.node);
+    return static_cast<size_t>(highest) + 1;
+}
+
+int numa_node_of_cpu(int cpu) {
+    for (const CpuSlot& slot : cpu_topology()) {
+        if (slot.cpu == cpu) return slot.node;
+    }
+    return -1;
+}
+
+std::vector<int> worker_cpus(Affinity policy, size_t count) {
+    const std::vector<CpuSlot>& slots = cpu_topology();
+    if (policy == Affinity::NONE || slots.empty()) return std::vector<int>(count, -1);
+
+    // compact order: by node and package, then the first thread of every core, then the
+    // second, ...
+    std::map<std::tuple<int, int, int>, int> thread_of_core;
+    std::vector<std::tuple<int, int, int, int, int>> order; // node, package, smt, core, cpu
+    std::vector<CpuSlot> sorted = slots;
+    std::sort(sorted.begin(), sorted.end(), [](const CpuSlot& a, const CpuSlot& b) { return a.cpu < b.cpu; });
+    for (const CpuSlot& s : sorted) {
+        const int smt = thread_of_core[{s.node, s.package, s.core}]++;
+        order.emplace_back(s.node, s.package, smt, s.core, s.cpu);
+    }
+    std::sort(order.begin(), order.end());
+
+    std::vector<int> compact;
+    for (const auto& entry : order) compact.push_back(std::get<4>(entry));
+
+    std::vector<int> placement;
+    if (policy == Affinity::COMPACT) {
+        placement = compact;
+    } else {
+        // SCATTER: take the next CPU of each node in turn
+        std::map<int, std::vector<int>> per_node;
+        for (const auto& entry : order) per_node[std::get<0>(entry)].push_back(std::get<4>(entry));
+        for (size_t k = 0; placement.size() < compact.size(); ++k) {
+            for (const auto& node : per_node) {
+                if (k < node.second.size()) placement.push_back(node.second[k]);
+            }
+        }
+    }
+
+    std::vector<int> cpus(count);
+    for (size_t i = 0; i < count; ++i) cpus[i] = placement[i % placement.size()];
+    return cpus;
+}
+
+bool pin_current_thread(int cpu) {
+    if (cpu < 0) return false;
+#if defined(__linux__)
+    if (cpu >= CPU_SETSIZE) return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof set, &set) == 0;
+#else
+    return false;
+#endif
+}
+
+std::vector<size_t> page_nodes(const void* data, size_t bytes) {
+#if defined(__linux__) && defined(SYS_move_pages)
+    const long page = sysconf(_SC_PAGESIZE);
+    if (!data || bytes == 0 || page <= 0) return {};
+    const uintptr_t first = reinterpret_cast<uintptr_t>(data) & ~static_cast<uintptr_t>(page - 1);
+    const uintptr_t last = reinterpret_cast<uintptr_t>(data) + bytes;
+    std::vector<void*> pages;
+    for (uintptr_t p = first; p < last; p += page) pages.push_back(reinterpret_cast<void*>(p));
+    std::vector<int> status(pages.size(), -1);
+    // with no target nodes, move_pages only reports where each page is
+    if (syscall(SYS_move_pages, 0, pages.size(), pages.data(), nullptr, status.data(), 0) != 0) return {};
+    std::vector<size_t> per_node(numa_node_count(), 0);
+    for (int node : status) {
+        if (node < 0) continue; // not touched yet
+        if (static_cast<size_t>(node) >= per_node.size()) per_node.resize(node + 1, 0);
+        ++per_node[node];
+    }
+    return per_node;
+#else
+    (void)data;
+    (void)bytes;
+    return {};
+#endif
+}
+
+std::string describe_placement(const std::vector<int>& cpus) {
+    std::string s;
+    for (size_t i = 0; i < cpus.size(); ++i) {
+        if (i > 0) s += ", ";
+        if (cpus[i] < 0) {
+            s += "unpinned";
+            continue;
+        }
+        s += "cpu " + std::to_string(cpus[i]) + " (node " + std::to_string(numa_node_of_cpu(cpus[i])) + ")";
+    }
+    return s;
+}
@@ -0,0 +1,53 @@
+#ifndef CPU_TOPOLOGY_H
+#define CPU_TOPOLOGY_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Where the worker threads of ThreadPool and WorkerTeam run. The topology is read from
+// sysfs (no libnuma): the CPUs this process may use, with their package, core and NUMA
+// node. NONE leaves placement to the scheduler; COMPACT fills one node before the next,
+// distinct cores before SMT siblings; SCATTER deals the workers round-robin over the
+// nodes. Pools read WORKER_AFFINITY when they are built.
+enum class Affinity { NONE, COMPACT, SCATTER };
+
+extern Affinity WORKER_AFFINITY;
+extern std::string SYSFS_ROOT; // "/sys/devices/system"
+
+struct CpuSlot {
+    int cpu;
+    int package;
+    int core;
+    int node;
+};
+
+// The allowed CPUs, read on first use. Without sysfs every CPU is its own core on node 0.
+const std::vector<CpuSlot>& cpu_topology();
+size_t numa_node_count();
+
+// Reads the topology under SYSFS_ROOT again, e.g. a copy of another machine's tree; with
+// allowed_only false the CPUs outside this process's affinity mask are kept. Call it
+// while no pool or team is being built.
+void reload_cpu_topology(bool allowed_only = true);
+
+// "0-3,8,10-11" as in the cpulist and online files; malformed ranges are skipped.
+std::vector<int> parse_cpu_list(const std::string& list);
+
+// The CPU for each of count workers under policy, -1 for NONE; wraps around when there
+// are more workers than CPUs.
+std::vector<int> worker_cpus(Affinity policy, size_t count);
+
+// Pins the calling thread; false if cpu < 0 or the system refuses.
+bool pin_current_thread(int cpu);
+
+int numa_node_of_cpu(int cpu);
+
+// Pages of [data, data + bytes) per NUMA node, as the kernel reports them (move_pages
+// without moving), to see where first touch put an array. Empty when unavailable.
+std::vector<size_t> page_nodes(const void* data, size_t bytes);
+
+// "cpu 0 (node 0), cpu 2 (node 1), ..." for a placement.
+std::string describe_placement(const std::vector<int>& cpus);
+
+#endif // CPU_TOPOLOGY_H
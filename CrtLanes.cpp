@@ -0,0 +1,145 @@
+#include "CrtLanes.h"
+#include "EvalCore.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRT_LANES_X86 1
+#endif
+
+// -- LANE CONSTANTS ---------------------------------------------------------------
+// Montgomery constants per lane for R = 2^32, the Garner coefficients and lane moduli.
+// ---------------------------------------------------------------------------------
+
+struct CrtConstants {
+    alignas(32) uint64_t p[CRT_LANES];
+    alignas(32) uint64_t p_neg_inv[CRT_LANES]; // -p^-1 mod 2^32
+    alignas(32) uint64_t r2[CRT_LANES];        // 2^64 mod p
+    uint64_t garner_inv[CRT_LANES];            // (p_0 * ... * p_{i-1})^-1 mod p_i
+    Modulus mod[CRT_LANES];
+
+    CrtConstants() {
+        for (size_t i = 0; i < CRT_LANES; ++i) {
+            const uint64_t q = CRT_PRIMES[i];
+            uint32_t inv = static_cast<uint32_t>(q); // Newton iteration, as in Montgomery32
+            for (int k = 0; k < 5; ++k) inv *= 2 - static_cast<uint32_t>(q) * inv;
+            p[i] = q;
+            p_neg_inv[i] = 0u - inv;
+            uint64_t r = (uint64_t(1) << 32) % q;
+            r2[i] = r * r % q;
+
+            mod[i] = Modulus(q);
+            uint64_t prefix = 1;
+            for (size_t j = 0; j < i; ++j) prefix = mod[i].mul(prefix, CRT_PRIMES[j] % q);
+            garner_inv[i] = mod_inv(prefix, mod[i]);
+        }
+    }
+};
+
+static const CrtConstants& constants() {
+    static const CrtConstants c;
+    return c;
+}
+
+// -- LANE ARITHMETIC ----------------------------------------------------------------
+// -----------------------------------------------------------------------------------
+
+#ifdef CRT_LANES_X86
+
+// Lanes with value >= p lose p; inputs are below 2p < 2^32, so the signed compare is exact.
+__attribute__((target("avx2")))
+static inline __m256i cond_sub(__m256i v, __m256i p) {
+    __m256i below = _mm256_cmpgt_epi64(p, v);
+    return _mm256_sub_epi64(v, _mm256_andnot_si256(below, p));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i reduce4(__m256i t, __m256i p, __m256i p_neg_inv) {
+    __m256i m = _mm256_mul_epu32(t, p_neg_inv);
+    __m256i u = _mm256_srli_epi64(_mm256_add_epi64(t, _mm256_mul_epu32(m, p)), 32);
+    return cond_sub(u, p);
+}
+
+// x*y = REDC(REDC(x*y) * R^2), each lane modulo its own prime
+__attribute__((target("avx2")))
+static void mul_avx2(const CrtLanes& x, const CrtLanes& y, CrtLanes& out) {
+    const CrtConstants& c = constants();
+    const __m256i p = _mm256_load_si256(reinterpret_cast<const __m256i*>(c.p));
+    const __m256i p_neg_inv = _mm256_load_si256(reinterpret_cast<const __m256i*>(c.p_neg_inv));
+    const __m256i r2 = _mm256_load_si256(reinterpret_cast<const __m256i*>(c.r2));
+    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(x.v));
+    __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(y.v));
+    __m256i t = reduce4(_mm256_mul_epu32(a, b), p, p_neg_inv);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out.v), reduce4(_mm256_mul_epu32(t, r2), p, p_neg_inv));
+}
+
+static bool has_avx2() {
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    return avx2;
+}
+
+#endif // CRT_LANES_X86
+
+CrtLanes crt_leaf(const std::string& s) {
+    const int64_t v = std::stoll(s);
+    CrtLanes r;
+    for (size_t i = 0; i < CRT_LANES; ++i) {
+        int64_t m = v % static_cast<int64_t>(CRT_PRIMES[i]);
+        r.v[i] = m < 0 ? m + CRT_PRIMES[i] : m;
+    }
+    return r;
+}
+
+CrtLanes crt_mul(const CrtLanes& x, const CrtLanes& y) {
+    CrtLanes r;
+#ifdef CRT_LANES_X86
+    if (has_avx2()) {
+        mul_avx2(x, y, r);
+        return r;
+    }
+#endif
+    for (size_t i = 0; i < CRT_LANES; ++i) r.v[i] = x.v[i] * y.v[i] % CRT_PRIMES[i]; // products < 2^62
+    return r;
+}
+
+CrtLanes crt_div(const CrtLanes& x, const CrtLanes& y) {
+    CrtLanes r;
+    for (size_t i = 0; i < CRT_LANES; ++i) {
+        const Modulus& mod = constants().mod[i];
+        r.v[i] = mod.mul(x.v[i], mod_inv(y.v[i], mod));
+    }
+    return r;
+}
+
+// -- EVALUATION AND RECONSTRUCTION ----------------------------------------------------
+// -------------------------------------------------------------------------------------
+
+CrtLanes evaluate_crt(Node* root) {
+    return EvalCore<CrtDomain>().evaluate(root);
+}
+
+__int128 crt_value(const CrtLanes& x) {
+    const CrtConstants& c = constants();
+    // mixed radix: value = x0 + t1*p0 + t2*p0*p1 + t3*p0*p1*p2, each t_i < p_i
+    u128 value = x.v[0], radix = 1;
+    for (size_t i = 1; i < CRT_LANES; ++i) {
+        const uint64_t q = CRT_PRIMES[i];
+        radix *= CRT_PRIMES[i - 1];
+        uint64_t have = static_cast<uint64_t>(value % q);
+        uint64_t t = (x.v[i] + q - have) % q * c.garner_inv[i] % q;
+        value += static_cast<u128>(t) * radix;
+    }
+    const u128 m = radix * CRT_PRIMES[CRT_LANES - 1];
+    return value > m / 2 ? -static_cast<__int128>(m - value) : static_cast<__int128>(value);
+}
+
+std::string crt_to_string(__int128 value) {
+    if (value == 0) return "0";
+    const bool negative = value < 0;
+    u128 mag = negative ? -static_cast<u128>(value) : static_cast<u128>(value);
+    std::string digits;
+    while (mag != 0) {
+        digits.insert(digits.begin(), static_cast<char>('0' + static_cast<int>(mag % 10)));
+        mag /= 10;
+    }
+    return negative ? "-" + digits : digits;
+}
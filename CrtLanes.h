@@ -0,0 +1,84 @@
+#ifndef CRT_LANES_H
+#define CRT_LANES_H
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include "Node.h"
+#include "ModArith.h"
+
+// Evaluation modulo several word-sized primes at once, one prime per lane, with the exact
+// integer recovered by the Chinese remainder theorem. With + - * only, the lanes determine
+// the integer value of the tree (leaves truncated, as in the residue engines) whenever it
+// lies within +-M/2, M = the product of the primes (about 2^124). With division, or beyond
+// that range, they are still four independent residues to check another engine against.
+
+constexpr size_t CRT_LANES = 4;
+
+// Odd and below 2^31, so lane products reduce with 32-bit Montgomery multiplication.
+constexpr std::array<uint64_t, CRT_LANES> CRT_PRIMES = {2147483647, 2147483629, 2147483587, 2147483579};
+
+// One value as its residues, lane i modulo CRT_PRIMES[i].
+struct CrtLanes {
+    uint64_t v[CRT_LANES] = {};
+
+    bool operator==(const CrtLanes& o) const {
+        for (size_t i = 0; i < CRT_LANES; ++i) if (v[i] != o.v[i]) return false;
+        return true;
+    }
+    bool operator!=(const CrtLanes& o) const { return !(*this == o); }
+};
+
+CrtLanes crt_leaf(const std::string& s);
+CrtLanes crt_mul(const CrtLanes& x, const CrtLanes& y); // four lanes at once with AVX2 when available
+CrtLanes crt_div(const CrtLanes& x, const CrtLanes& y); // throws std::domain_error if a lane of y is 0
+
+// Value domain for EvalCore.
+struct CrtDomain {
+    using value_type = CrtLanes;
+
+    value_type leaf(const std::string& s) const { return crt_leaf(s); }
+    value_type add(const CrtLanes& x, const CrtLanes& y) const {
+        CrtLanes r;
+        for (size_t i = 0; i < CRT_LANES; ++i) {
+            uint64_t s = x.v[i] + y.v[i];
+            r.v[i] = s >= CRT_PRIMES[i] ? s - CRT_PRIMES[i] : s;
+        }
+        return r;
+    }
+    value_type sub(const CrtLanes& x, const CrtLanes& y) const {
+        CrtLanes r;
+        for (size_t i = 0; i < CRT_LANES; ++i) r.v[i] = x.v[i] >= y.v[i] ? x.v[i] - y.v[i] : x.v[i] + CRT_PRIMES[i] - y.v[i];
+        return r;
+    }
+    value_type mul(const CrtLanes& x, const CrtLanes& y) const { return crt_mul(x, y); }
+    value_type div(const CrtLanes& x, const CrtLanes& y) const { return crt_div(x, y); }
+};
+
+// One recursive pass over the subtree, all lanes together.
+CrtLanes evaluate_crt(Node* root);
+
+// The integer in (-M/2, M/2] with these residues (Garner's algorithm).
+__int128 crt_value(const CrtLanes& x);
+std::string crt_to_string(__int128 value);
+
+// Runs an engine that evaluates under eval_modulus() once per lane and collects the lanes,
+// e.g. a contraction of a fresh copy of the tree. The previous modulus is restored.
+template <typename F>
+CrtLanes crt_evaluate_per_lane(F&& evaluate_mod) {
+    const uint64_t saved = eval_modulus().value();
+    CrtLanes r;
+    try {
+        for (size_t i = 0; i < CRT_LANES; ++i) {
+            set_eval_modulus(CRT_PRIMES[i]);
+            r.v[i] = evaluate_mod();
+        }
+    } catch (...) {
+        set_eval_modulus(saved);
+        throw;
+    }
+    set_eval_modulus(saved);
+    return r;
+}
+
+#endif // CRT_LANES_H
@@ -0,0 +1,133 @@
+#ifndef EVAL_CORE_H
+#define EVAL_CORE_H
+
+#include <string>
+#include <limits>
+#include <stdexcept>
+#include <cstdint>
+#include "Node.h"
+#include "ModArith.h"
+
+// One evaluation core shared by the serial, divide-and-conquer and contraction engines,
+// templated on a value domain and on the set of operators the trees may contain. Every
+// instantiation compiles to its own kernel: the domain arithmetic is inlined, operators
+// are told apart by one character, and operators outside the set are compiled out.
+
+// Operator sets
+constexpr unsigned OP_ADD = 1, OP_SUB = 2, OP_MUL = 4, OP_DIV = 8;
+constexpr unsigned RING_OPS = OP_ADD | OP_SUB | OP_MUL; // trees from tree_constructor2
+constexpr unsigned ALL_OPS = RING_OPS | OP_DIV;          // trees from tree_constructor
+
+// -- VALUE DOMAINS ----------------------------------------------------------------------
+// A domain gives value_type, leaf(string) and add, sub, mul, div on value_type.
+// ---------------------------------------------------------------------------------------
+
+// Doubles reduced with fmod after every operator, the semantics of Tree::evaluate.
+// Division by zero gives infinity.
+struct DoubleDomain {
+    using value_type = double;
+    Modulus mod = eval_modulus();
+
+    value_type leaf(const std::string& s) const { return std::stod(s); }
+    value_type add(double a, double b) const { return mod.fmod(a + b); }
+    value_type sub(double a, double b) const { return mod.fmod(a - b); }
+    value_type mul(double a, double b) const { return mod.fmod(a * b); }
+    value_type div(double a, double b) const {
+        return b != 0 ? mod.fmod(a / b) : std::numeric_limits<double>::infinity();
+    }
+};
+
+// Residues modulo M, a StaticModulus<P> or a runtime Modulus. Leaves are truncated to
+// integers; division multiplies by the modular inverse and throws without one.
+template <typename M = Modulus>
+struct ResidueDomain {
+    using value_type = uint64_t;
+    M mod = M();
+
+    value_type leaf(const std::string& s) const { return parse_residue(s, mod); }
+    value_type add(uint64_t a, uint64_t b) const { return mod.add(a, b); }
+    value_type sub(uint64_t a, uint64_t b) const { return mod.sub(a, b); }
+    value_type mul(uint64_t a, uint64_t b) const { return mod.mul(a, b); }
+    value_type div(uint64_t a, uint64_t b) const { return mod.mul(a, mod_inv(b, mod)); }
+};
+
+// Residues modulo a compile-time P < 2^16 such as LARGE_PRIME, stored in 16 bits.
+// Products fit in 32 bits, and arrays of values take a quarter of the space.
+template <uint16_t P>
+struct Residue16Domain {
+    using value_type = uint16_t;
+
+    value_type leaf(const std::string& s) const { return static_cast<uint16_t>(StaticModulus<P>::reduce(std::stoll(s))); }
+    value_type add(uint16_t a, uint16_t b) const {
+        uint32_t s = uint32_t(a) + b;
+        return static_cast<uint16_t>(s >= P ? s - P : s);
+    }
+    value_type sub(uint16_t a, uint16_t b) const { return static_cast<uint16_t>(a >= b ? a - b : a + P - b); }
+    value_type mul(uint16_t a, uint16_t b) const { return static_cast<uint16_t>(uint32_t(a) * b % P); }
+    value_type div(uint16_t a, uint16_t b) const { return mul(a, static_cast<uint16_t>(mod_inv(b, StaticModulus<P>{}))); }
+};
+
+// -- CORE --------------------------------------------------------------------------------
+// ----------------------------------------------------------------------------------------
+
+// The operator character of an internal node, 0 for anything else.
+inline char op_code(Node* node) {
+    const std::string& s = node->getString();
+    return s.size() == 1 ? s[0] : 0;
+}
+
+template <typename Domain, unsigned Ops = ALL_OPS>
+class EvalCore {
+public:
+    using value_type = typename Domain::value_type;
+
+    explicit EvalCore(Domain domain = Domain()) : domain(domain) {}
+
+    const Domain& get_domain() const { return domain; }
+
+    value_type leaf(Node* node) const { return domain.leaf(node->getString()); }
+
+    value_type apply(char op, value_type l, value_type r) const {
+        switch (op) {
+        case '+': if constexpr ((Ops & OP_ADD) != 0) return domain.add(l, r); break;
+        case '-': if constexpr ((Ops & OP_SUB) != 0) return domain.sub(l, r); break;
+        case '*': if constexpr ((Ops & OP_MUL) != 0) return domain.mul(l, r); break;
+        case '/': if constexpr ((Ops & OP_DIV) != 0) return domain.div(l, r); break;
+        }
+        throw std::runtime_error("Unsupported operator: " + std::string(1, op));
+    }
+
+    value_type apply(Node* node, value_type l, value_type r) const { return apply(op_code(node), l, r); }
+
+    // Recursive evaluation of the subtree rooted at node.
+    value_type evaluate(Node* node) const {
+        if (node->is_leaf()) return leaf(node);
+        value_type l = evaluate(node->getLeftChild());
+        value_type r = evaluate(node->getRightChild());
+        return apply(node, l, r);
+    }
+
+    // The same, reusing and filling the eval cache of the nodes. value_type must convert
+    // to double exactly, which holds for residues below 2^53.
+    value_type evaluate_cached(Node* node) const {
+        if (node->hasValue()) return static_cast<value_type>(node->getEval());
+        value_type result = node->is_leaf() ? leaf(node)
+                                            : apply(node, evaluate_cached(node->getLeftChild()),
+                                                    evaluate_cached(node->getRightChild()));
+        node->setEval(static_cast<double>(result));
+        return result;
+    }
+
+private:
+    Domain domain;
+};
+
+// Calls f with the residue domain for eval_modulus(): 16-bit compile-time arithmetic when
+// it is LARGE_PRIME, the runtime Modulus otherwise.
+template <typename F>
+auto with_residue_domain(F&& f) {
+    if (eval_modulus().value() == LARGE_PRIME) return f(Residue16Domain<LARGE_PRIME>());
+    return f(ResidueDomain<Modulus>{eval_modulus()});
+}
+
+#endif // EVAL_CORE_H
@@ -0,0 +1,136 @@
+#include "HashCons.h"
+#include "ParallelPrimitives.h"
+
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
+
+// Levels smaller than this are hashed on the calling thread.
+constexpr size_t PARALLEL_LEVEL_MIN = 4096;
+constexpr size_t HASH_SHARDS = 64;
+
+static bool live(Node* child) { return child && !child->isDeleted(); }
+
+std::vector<Node*> preorder_nodes(Node* root) {
+    std::vector<Node*> result;
+    std::vector<Node*> stack;
+    if (root) stack.push_back(root);
+    while (!stack.empty()) {
+        Node* current = stack.back();
+        stack.pop_back();
+        current->setId(static_cast<int>(result.size()));
+        result.push_back(current);
+        if (live(current->getRightChild())) stack.push_back(current->getRightChild());
+        if (live(current->getLeftChild())) stack.push_back(current->getLeftChild());
+    }
+    return result;
+}
+
+// Ids grouped by height (leaves at 0), so each level only depends on the levels below.
+static std::vector<std::vector<int>> levels_by_height(const std::vector<Node*>& nodes) {
+    std::vector<int> height(nodes.size(), 0);
+    std::vector<std::vector<int>> levels;
+    for (size_t v = nodes.size(); v-- > 0;) {
+        Node* node = nodes[v];
+        if (live(node->getLeftChild())) height[v] = std::max(height[v], height[node->getLeftChild()->getId()] + 1);
+        if (live(node->getRightChild())) height[v] = std::max(height[v], height[node->getRightChild()->getId()] + 1);
+        if (levels.size() <= static_cast<size_t>(height[v])) levels.resize(height[v] + 1);
+        levels[height[v]].push_back(static_cast<int>(v));
+    }
+    return levels;
+}
+
+// Runs body(i) for every index of the level, in parallel when the level is large.
+template <typename Body>
+static void for_level(const std::vector<int>& level, const Body& body) {
+    if (level.size() < PARALLEL_LEVEL_MIN) {
+        for (size_t i = 0; i < level.size(); ++i) body(i);
+        return;
+    }
+    parallel_chunks(level.size(), [&](size_t, size_t start, size_t end) {
+        for (size_t i = start; i < end; ++i) body(i);
+    });
+}
+
+static int child_id(Node* child) { return live(child) ? child->getId() : -1; }
+
+std::vector<uint64_t> subtree_hashes(const std::vector<Node*>& nodes) {
+    std::vector<uint64_t> hash(nodes.size());
+    for (const std::vector<int>& level : levels_by_height(nodes)) {
+        for_level(level, [&](size_t i) {
+            Node* node = nodes[level[i]];
+            const int l = child_id(node->getLeftChild()), r = child_id(node->getRightChild());
+            hash[level[i]] = merkle_hash(node->getString(), l < 0 ? 0 : hash[l], r < 0 ? 0 : hash[r]);
+        });
+    }
+    return hash;
+}
+
+HashConsStats hash_cons(Tree& tree) {
+    std::vector<Node*> nodes = preorder_nodes(tree.getRoot());
+    const size_t n = nodes.size();
+    std::vector<uint64_t> hash(n);
+    std::vector<int> canon(n); // id of the node that stands for this subtree
+
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        std::unordered_map<uint64_t, std::vector<int>> by_hash; // canonical ids, usually one
+    };
+    std::vector<Shard> shards(HASH_SHARDS);
+
+    // bottom-up: a node's children already have their canonical ids when it is hashed
+    for (const std::vector<int>& level : levels_by_height(nodes)) {
+        for_level(level, [&](size_t i) {
+            const int v = level[i];
+            Node* node = nodes[v];
+            const int l = child_id(node->getLeftChild()), r = child_id(node->getRightChild());
+            const int cl = l < 0 ? -1 : canon[l], cr = r < 0 ? -1 : canon[r];
+            const uint64_t h = merkle_hash(node->getString(), l < 0 ? 0 : hash[l], r < 0 ? 0 : hash[r]);
+            hash[v] = h;
+
+            Shard& shard = shards[h % HASH_SHARDS];
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            std::vector<int>& candidates = shard.by_hash[h];
+            for (int c : candidates) {
+                Node* other = nodes[c];
+                const int ol = child_id(other->getLeftChild()), orr = child_id(other->getRightChild());
+                if ((ol < 0 ? -1 : canon[ol]) == cl && (orr < 0 ? -1 : canon[orr]) == cr &&
+                    other->getString() == node->getString()) {
+                    canon[v] = c;
+                    return;
+                }
+            }
+            canon[v] = v;
+            candidates.push_back(v);
+        });
+    }
+
+    // point the survivors at canonical children and count their parents
+    HashConsStats stats;
+    stats.nodes_before = n;
+    std::vector<int> parents(n, 0);
+    parents[0] = 1; // the tree holds the root
+    for (size_t v = 0; v < n; ++v) {
+        if (canon[v] != static_cast<int>(v)) continue;
+        ++stats.nodes_after;
+        Node* node = nodes[v];
+        const int l = child_id(node->getLeftChild()), r = child_id(node->getRightChild());
+        if (l >= 0) {
+            node->setLeftChild(nodes[canon[l]]);
+            ++parents[canon[l]];
+        }
+        if (r >= 0) {
+            node->setRightChild(nodes[canon[r]]);
+            ++parents[canon[r]];
+        }
+    }
+    for (size_t v = 0; v < n; ++v) {
+        if (canon[v] != static_cast<int>(v)) {
+            delete nodes[v]; // its children are survivors or freed here too
+            continue;
+        }
+        while (nodes[v]->refCount() > parents[v]) nodes[v]->release();
+        while (nodes[v]->refCount() < parents[v]) nodes[v]->retain();
+    }
+    return stats;
+}
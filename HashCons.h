@@ -0,0 +1,48 @@
+#ifndef HASH_CONS_H
+#define HASH_CONS_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "Tree.h"
+
+// Structural (Merkle) hashing of subtrees, and hash-consing a tree into a DAG in which
+// every distinct subexpression (shape, operators and leaf strings) exists once.
+
+// Hash of a node from its string and the hashes of its children (0 for none).
+// Identical subtrees hash alike; the order of the children matters.
+inline uint64_t merkle_hash(const std::string& s, uint64_t left, uint64_t right) {
+    auto mix = [](uint64_t z) { // splitmix64 finaliser
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    };
+    uint64_t h = std::hash<std::string>()(s);
+    h = mix(h ^ (left + 0x9E3779B97F4A7C15ULL));
+    return mix(h ^ (right + 0x632BE59BD9B4E019ULL));
+}
+
+// The nodes under root in preorder, numbered by setId as list_nodes does.
+std::vector<Node*> preorder_nodes(Node* root);
+
+// Merkle hash of every subtree, indexed by id, for nodes as numbered by preorder_nodes.
+// Computed bottom-up one height at a time, large levels in parallel on default_team().
+std::vector<uint64_t> subtree_hashes(const std::vector<Node*>& nodes);
+
+struct HashConsStats {
+    size_t nodes_before = 0;
+    size_t nodes_after = 0; // distinct subexpressions
+};
+
+// Merges identical subtrees of the tree into shared nodes, in place, and frees the
+// copies. Shared nodes count their parents (Node::refCount) so that Tree::delete_subtree
+// frees each once. Hashes are confirmed by comparing strings and children, so collisions
+// cannot merge different subtrees.
+//
+// The caching evaluators (EvalCore::evaluate_cached, evaluate_serial, divide-and-conquer's
+// evaluate) then evaluate each distinct subexpression once. Parent pointers, and so
+// Node::clearEval, are meaningless on a DAG, and the engines that rewrite the tree
+// (contraction, IncrementalTree) or evaluate subtrees concurrently need a tree.
+HashConsStats hash_cons(Tree& tree);
+
+#endif // HASH_CONS_H
@@ -0,0 +1,253 @@
+#include "IncrementalTree.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+
+// Work per pool task in updateLeaves, in leaves to mark and in paths to recompose.
+constexpr size_t UPDATE_GRAIN = 1024;
+constexpr size_t PATH_GRAIN = 256;
+constexpr size_t MAX_UPDATE_TASKS = 64;
+
+static bool live(Node* child) { return child && !child->isDeleted(); }
+
+// Runs task(t) for t in [0, tasks) on the pool and waits; a single task runs inline.
+template <typename Task>
+static void run_tasks(ThreadPool& pool, size_t tasks, const Task& task) {
+    if (tasks == 1) {
+        task(0);
+        return;
+    }
+    ThreadPool::TaskGroup group(pool);
+    group.parallel_for(0, tasks, 1, [&task](size_t lo, size_t hi) {
+        for (size_t t = lo; t < hi; ++t) task(t);
+    });
+    group.wait();
+}
+
+IncrementalTree::IncrementalTree(Node* root) : mod(eval_modulus()) {
+    if (!root) throw std::invalid_argument("IncrementalTree needs a root");
+
+    // preorder, left before right, with parent ids
+    std::vector<std::pair<Node*, int>> stack{{root, -1}};
+    while (!stack.empty()) {
+        auto [current, up] = stack.back();
+        stack.pop_back();
+        const int id = static_cast<int>(nodes.size());
+        current->setId(id);
+        nodes.push_back(current);
+        parent.push_back(up);
+
+        Node* left = current->getLeftChild();
+        Node* right = current->getRightChild();
+        if (live(left) != live(right)) throw std::invalid_argument("IncrementalTree needs every operator to have two children");
+        if (live(right)) stack.push_back({right, id});
+        if (live(left)) stack.push_back({left, id});
+    }
+
+    // subtree sizes and values, children before parents
+    const int n = static_cast<int>(nodes.size());
+    std::vector<int> size(n, 1), heavy_child(n, -1);
+    std::vector<Fraction> subtree_value(n);
+    light_child.assign(n, -1);
+    leaf_value.assign(n, Fraction{});
+    for (int v = n - 1; v >= 0; --v) {
+        Node* node = nodes[v];
+        if (node->is_leaf()) {
+            leaf_value[v] = {parse_residue(node->getString(), mod), 1};
+            subtree_value[v] = leaf_value[v];
+            continue;
+        }
+        const int l = node->getLeftChild()->getId(), r = node->getRightChild()->getId();
+        size[v] = 1 + size[l] + size[r];
+        heavy_child[v] = size[l] >= size[r] ? l : r;
+        light_child[v] = size[l] >= size[r] ? r : l;
+
+        // op(left, right) as the function of right with left known
+        Mobius f = operator_function(node->getString(), true, subtree_value[l].num, subtree_value[l].den, mod);
+        subtree_value[v] = subtree_value[r];
+        mobius_apply_fraction(f, subtree_value[v].num, subtree_value[v].den, mod);
+    }
+
+    // heavy paths, topped by the root and by every light child
+    path_of.assign(n, -1);
+    segment_of.assign(n, -1);
+    std::vector<std::vector<int>> members;
+    for (int v = 0; v < n; ++v) {
+        if (parent[v] >= 0 && light_child[parent[v]] != v) continue;
+        const int p = static_cast<int>(paths.size());
+        members.emplace_back();
+        int u = v;
+        for (; heavy_child[u] >= 0; u = heavy_child[u]) {
+            path_of[u] = p;
+            members.back().push_back(u);
+        }
+        path_of[u] = p;
+        const int depth = parent[v] < 0 ? 0 : paths[path_of[parent[v]]].depth + 1;
+        paths.push_back({v, u, -1, depth, subtree_value[v]});
+    }
+    path_marked.reset(new std::atomic<bool>[paths.size()]());
+    changed_children.resize(paths.size());
+
+    // one composition tree per path, weighted by the light subtrees hanging off it
+    for (size_t p = 0; p < paths.size(); ++p) {
+        const std::vector<int>& path_nodes = members[p];
+        if (path_nodes.empty()) continue;
+        std::vector<uint64_t> prefix(path_nodes.size() + 1, 0);
+        for (size_t i = 0; i < path_nodes.size(); ++i) prefix[i + 1] = prefix[i] + 1 + size[light_child[path_nodes[i]]];
+        paths[p].root_segment = build_segments(path_nodes, prefix, 0, static_cast<int>(path_nodes.size()));
+    }
+}
+
+int IncrementalTree::build_segments(const std::vector<int>& path_nodes, const std::vector<uint64_t>& prefix, int lo, int hi) {
+    if (hi - lo == 1) {
+        const int v = path_nodes[lo];
+        segment_of[v] = static_cast<int>(segments.size());
+        segments.push_back({node_function(v), -1, -1, -1});
+        return segment_of[v];
+    }
+
+    // split where the prefix weight crosses half, keeping both sides non-empty
+    const uint64_t half = prefix[lo] + (prefix[hi] - prefix[lo]) / 2;
+    int mid = static_cast<int>(std::upper_bound(prefix.begin() + lo + 1, prefix.begin() + hi, half) - prefix.begin());
+    mid = std::min(std::max(mid, lo + 1), hi - 1);
+
+    const int left = build_segments(path_nodes, prefix, lo, mid);
+    const int right = build_segments(path_nodes, prefix, mid, hi);
+    const int s = static_cast<int>(segments.size());
+    segments.push_back({mobius_compose(segments[left].fn, segments[right].fn, mod), left, right, -1});
+    segments[left].parent = s;
+    segments[right].parent = s;
+    return s;
+}
+
+// x -> op(x, light) or op(light, x), x being the value of the heavy child
+Mobius IncrementalTree::node_function(int v) const {
+    const int l = light_child[v];
+    const Fraction& light = paths[path_of[l]].top_value;
+    const bool light_on_left = nodes[v]->getLeftChild() == nodes[l];
+    return operator_function(nodes[v]->getString(), light_on_left, light.num, light.den, mod);
+}
+
+void IncrementalTree::refresh_path(int p) {
+    Path& path = paths[p];
+    Fraction x = leaf_value[path.bottom];
+    if (path.root_segment >= 0) mobius_apply_fraction(segments[path.root_segment].fn, x.num, x.den, mod);
+    path.top_value = x;
+}
+
+uint64_t IncrementalTree::value() const {
+    const Fraction& root = paths[path_of[0]].top_value;
+    return mod.mul(root.num, mod_inv(root.den, mod));
+}
+
+int IncrementalTree::checked_leaf(Node* leaf) const {
+    const int id = leaf ? leaf->getId() : -1;
+    if (id < 0 || id >= static_cast<int>(nodes.size()) || nodes[id] != leaf || light_child[id] >= 0) {
+        throw std::invalid_argument("updateLeaf expects a leaf of this tree");
+    }
+    return id;
+}
+
+void IncrementalTree::updateLeaf(Node* leaf, const std::string& value) {
+    const int id = checked_leaf(leaf);
+    leaf_value[id] = {parse_residue(value, mod), 1};
+    leaf->setString(value);
+    leaf->clearEval();
+
+    // up through the paths: a new top value changes one function on the path above
+    for (int p = path_of[id];;) {
+        refresh_path(p);
+        const int w = parent[paths[p].top];
+        if (w < 0) break;
+        int s = segment_of[w];
+        segments[s].fn = node_function(w);
+        for (s = segments[s].parent; s >= 0; s = segments[s].parent) {
+            segments[s].fn = mobius_compose(segments[segments[s].left].fn, segments[segments[s].right].fn, mod);
+        }
+        p = path_of[w];
+    }
+}
+
+// Refreshes the functions of the nodes the changed child paths hang off, then every
+// segment above them once. Segments are created children first, so ascending ids are a
+// bottom-up order.
+void IncrementalTree::recompose_path(int p, const std::vector<int>& children) {
+    thread_local std::vector<int> dirty;
+    dirty.clear();
+    for (int c : children) {
+        const int w = parent[paths[c].top];
+        int s = segment_of[w];
+        segments[s].fn = node_function(w);
+        for (s = segments[s].parent; s >= 0; s = segments[s].parent) dirty.push_back(s);
+    }
+    std::sort(dirty.begin(), dirty.end());
+    dirty.erase(std::unique(dirty.begin(), dirty.end()), dirty.end());
+    for (int s : dirty) {
+        segments[s].fn = mobius_compose(segments[segments[s].left].fn, segments[segments[s].right].fn, mod);
+    }
+    refresh_path(p);
+}
+
+void IncrementalTree::updateLeaves(const std::vector<std::pair<Node*, std::string>>& updates, ThreadPool& pool) {
+    // check and parse the whole batch before changing anything, so a bad entry throws
+    // with the tree as it was
+    std::vector<int> leaves;
+    std::vector<uint64_t> residues;
+    leaves.reserve(updates.size());
+    residues.reserve(updates.size());
+    for (const auto& [leaf, value] : updates) {
+        leaves.push_back(checked_leaf(leaf));
+        residues.push_back(parse_residue(value, mod));
+    }
+
+    // then the leaf values, serially: Node caches are not thread safe
+    for (size_t i = 0; i < updates.size(); ++i) {
+        leaf_value[leaves[i]] = {residues[i], 1};
+        updates[i].first->setString(updates[i].second);
+        updates[i].first->clearEval();
+    }
+
+    // mark the union of the root paths; a walk that finds its path marked stops there
+    const size_t tasks = std::max<size_t>(1, std::min<size_t>(leaves.size() / UPDATE_GRAIN, MAX_UPDATE_TASKS));
+    std::vector<std::vector<int>> found(tasks);
+    run_tasks(pool, tasks, [&](size_t t) {
+        const size_t begin = leaves.size() * t / tasks, end = leaves.size() * (t + 1) / tasks;
+        for (size_t i = begin; i < end; ++i) {
+            for (int p = path_of[leaves[i]]; p >= 0;) {
+                if (path_marked[p].exchange(true, std::memory_order_relaxed)) break;
+                found[t].push_back(p);
+                const int w = parent[paths[p].top];
+                p = w < 0 ? -1 : path_of[w];
+            }
+        }
+    });
+
+    // bucket the marked paths by depth and hang each off the path above it
+    std::vector<std::vector<int>> by_depth;
+    for (const std::vector<int>& part : found) {
+        for (int p : part) {
+            const size_t d = paths[p].depth;
+            if (by_depth.size() <= d) by_depth.resize(d + 1);
+            by_depth[d].push_back(p);
+            if (d > 0) changed_children[path_of[parent[paths[p].top]]].push_back(p);
+        }
+    }
+
+    // deepest paths first: a path's light children are final before it is recomposed
+    for (size_t d = by_depth.size(); d-- > 0;) {
+        const std::vector<int>& level = by_depth[d];
+        const size_t level_tasks = std::max<size_t>(1, std::min<size_t>(level.size() / PATH_GRAIN, MAX_UPDATE_TASKS));
+        run_tasks(pool, level_tasks, [&](size_t t) {
+            const size_t begin = level.size() * t / level_tasks, end = level.size() * (t + 1) / level_tasks;
+            for (size_t i = begin; i < end; ++i) recompose_path(level[i], changed_children[level[i]]);
+        });
+    }
+
+    for (const std::vector<int>& level : by_depth) {
+        for (int p : level) {
+            path_marked[p].store(false, std::memory_order_relaxed);
+            changed_children[p].clear();
+        }
+    }
+}
@@ -0,0 +1,78 @@
+#ifndef INCREMENTAL_TREE_H
+#define INCREMENTAL_TREE_H
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <utility>
+#include "Node.h"
+#include "ModArith.h"
+#include "ThreadPool.h"
+
+// Root value under eval_modulus() that follows single-leaf updates in O(log n).
+//
+// The tree is split into heavy paths (each node continues into its larger child). Along a
+// path every internal node is the Möbius function x -> op(x, light) or op(light, x) of its
+// heavy child, with the light child's value fixed; the top of a path is the composition of
+// those functions applied to the leaf at its bottom. Each path keeps its functions in a
+// binary tree of compositions split at the weighted middle, weight 1 + size of the light
+// subtree, so the depths along any leaf-to-root walk telescope to O(log n) in total.
+// Values are kept as fractions num / den, so only reading the root divides. As with the
+// randomised engines' ContractionValues, a division by zero below the root can cancel
+// (v / (x / 0) reads as 0) where the recursive engines throw.
+class IncrementalTree {
+public:
+    // O(n). Assigns node ids in preorder, as list_nodes does. Throws like the residue
+    // engines on operators they do not support.
+    explicit IncrementalTree(Node* root);
+
+    // Root value; throws std::domain_error when it divides by zero.
+    uint64_t value() const;
+
+    // Sets the leaf's string, clears the Node caches it invalidates and refreshes the root.
+    void updateLeaf(Node* leaf, const std::string& value);
+
+    // Applies many updates at once (a repeated leaf takes its last value). The heavy paths
+    // above the updated leaves are marked in parallel, each walk stopping where it meets
+    // one already marked, and only those paths are recomposed, deepest first, one level of
+    // light depth per round on the pool. Costs O(affected paths' segments), not O(n).
+    void updateLeaves(const std::vector<std::pair<Node*, std::string>>& updates, ThreadPool& pool);
+
+private:
+    struct Fraction {
+        uint64_t num = 0, den = 1;
+    };
+    struct Segment {
+        Mobius fn;          // composition of the path functions below this segment, top first
+        int left = -1, right = -1, parent = -1;
+    };
+    struct Path {
+        int top, bottom;    // node ids; bottom is a leaf
+        int root_segment;   // -1 when the path is a single leaf
+        int depth;          // light edges between the top and the root
+        Fraction top_value;
+    };
+
+    int build_segments(const std::vector<int>& path_nodes, const std::vector<uint64_t>& prefix, int lo, int hi);
+    Mobius node_function(int v) const;
+    void refresh_path(int path);
+    int checked_leaf(Node* leaf) const;
+    void recompose_path(int path, const std::vector<int>& changed_children);
+
+    Modulus mod;
+    std::vector<Node*> nodes;       // by id
+    std::vector<int> parent;        // by id, -1 at the root
+    std::vector<int> light_child;   // by id, -1 for leaves
+    std::vector<int> path_of;       // by id
+    std::vector<int> segment_of;    // by id, the segment holding an internal node's function
+    std::vector<Fraction> leaf_value;
+    std::vector<Segment> segments;
+    std::vector<Path> paths;
+
+    // batch update scratch, clean between calls
+    std::unique_ptr<std::atomic<bool>[]> path_marked;
+    std::vector<std::vector<int>> changed_children; // by path, the marked paths hanging off it
+};
+
+#endif // INCREMENTAL_TREE_H
@@ -0,0 +1,212 @@
+#ifndef MOD_ARITH_H
+#define MOD_ARITH_H
+
+#include <cstdint>
+#include <cmath>
+#include <string>
+#include <stdexcept>
+#include <vector>
+
+// Modular arithmetic shared by every evaluation engine.
+// Residues are uint64_t values in [0, p). Moduli go up to 2^63.
+
+constexpr uint64_t LARGE_PRIME = 6101;
+
+using u128 = unsigned __int128;
+
+// Modulus known at compile time: % by a constant compiles to a multiply and a shift.
+template <uint64_t P>
+struct StaticModulus {
+    static_assert(P > 1 && P < (uint64_t(1) << 63), "modulus out of range");
+
+    static constexpr uint64_t value() { return P; }
+
+    static uint64_t reduce(int64_t v) {
+        int64_t r = v % static_cast<int64_t>(P);
+        return r < 0 ? r + P : r;
+    }
+    static uint64_t add(uint64_t a, uint64_t b) {
+        uint64_t s = a + b;
+        return s >= P ? s - P : s;
+    }
+    static uint64_t sub(uint64_t a, uint64_t b) { return a >= b ? a - b : a + P - b; }
+    static uint64_t mul(uint64_t a, uint64_t b) {
+        if constexpr (P <= UINT32_MAX) return a * b % P;
+        else return static_cast<uint64_t>(static_cast<u128>(a) * b % P);
+    }
+};
+
+// Modulus chosen at run time. Below 2^32 products fit in 64 bits and are reduced with
+// Barrett reduction by m = floor((2^64 - 1) / p); larger odd moduli use Montgomery
+// multiplication with R = 2^64, and larger even ones fall back to 128-bit division.
+class Modulus {
+public:
+    explicit Modulus(uint64_t p = LARGE_PRIME) : p(p) {
+        if (p < 2 || p >= (uint64_t(1) << 63)) throw std::invalid_argument("Modulus must be in [2, 2^63)");
+        m = UINT64_MAX / p;
+        uint64_t inv = p; // Newton iteration, each step doubles the correct low bits
+        for (int i = 0; i < 6; ++i) inv *= 2 - p * inv;
+        p_neg_inv = 0 - inv;
+        uint64_t r = (0 - p) % p; // 2^64 mod p
+        r2 = static_cast<uint64_t>(static_cast<u128>(r) * r % p);
+        p_double = static_cast<double>(p);
+        inv_double = 1.0 / p_double;
+    }
+
+    uint64_t value() const { return p; }
+
+    uint64_t reduce(int64_t v) const {
+        int64_t r = v % static_cast<int64_t>(p);
+        return r < 0 ? r + p : r;
+    }
+    uint64_t add(uint64_t a, uint64_t b) const {
+        uint64_t s = a + b;
+        return s >= p ? s - p : s;
+    }
+    uint64_t sub(uint64_t a, uint64_t b) const { return a >= b ? a - b : a + p - b; }
+    uint64_t mul(uint64_t a, uint64_t b) const {
+        if (p <= UINT32_MAX) return barrett(a * b);
+        if (p & 1) return montgomery(static_cast<u128>(montgomery(static_cast<u128>(a) * b)) * r2);
+        return static_cast<uint64_t>(static_cast<u128>(a) * b % p);
+    }
+
+    // std::fmod(x, p) for the double-valued engines. x - trunc(x / p) * p is exact while
+    // |x| and p stay below 2^52, so it agrees with std::fmod without its slow loop.
+    double fmod(double x) const {
+        if (!(std::fabs(x) < 0x1p52) || p >= (uint64_t(1) << 52)) return std::fmod(x, p_double);
+        double r = x - std::trunc(x * inv_double) * p_double;
+        // x * (1/p) may round to the neighbouring quotient
+        if (x >= 0) {
+            if (r < 0) r += p_double;
+            else if (r >= p_double) r -= p_double;
+        } else {
+            if (r > 0) r -= p_double;
+            else if (r <= -p_double) r += p_double;
+        }
+        return r;
+    }
+
+private:
+    uint64_t barrett(uint64_t x) const {
+        uint64_t q = static_cast<uint64_t>(static_cast<u128>(x) * m >> 64);
+        uint64_t r = x - q * p;
+        return r >= p ? r - p : r;
+    }
+
+    // t * 2^-64 mod p, for t < p * 2^64
+    uint64_t montgomery(u128 t) const {
+        uint64_t k = static_cast<uint64_t>(t) * p_neg_inv;
+        u128 u = (t + static_cast<u128>(k) * p) >> 64;
+        return static_cast<uint64_t>(u >= p ? u - p : u);
+    }
+
+    uint64_t p, m, p_neg_inv, r2;
+    double p_double, inv_double;
+};
+
+// The modulus every engine evaluates under. Change it between evaluations, not during one.
+inline Modulus& eval_modulus_storage() {
+    static Modulus modulus(LARGE_PRIME);
+    return modulus;
+}
+inline const Modulus& eval_modulus() { return eval_modulus_storage(); }
+inline void set_eval_modulus(uint64_t p) { eval_modulus_storage() = Modulus(p); }
+
+// Residue of a node string such as "523.123456" or "17": the integer part, reduced.
+template <typename M>
+uint64_t parse_residue(const std::string& s, const M& mod) {
+    return mod.reduce(std::stoll(s));
+}
+
+// a^-1 mod p by the extended Euclidean algorithm, so composite moduli work too.
+// Throws std::domain_error when a shares a factor with p, in particular when a == 0.
+template <typename M>
+uint64_t mod_inv(uint64_t a, const M& mod) {
+    const uint64_t p = mod.value();
+    __int128 r0 = p, r1 = a % p, t0 = 0, t1 = 1;
+    while (r1 != 0) {
+        __int128 q = r0 / r1;
+        __int128 r2 = r0 - q * r1, t2 = t0 - q * t1;
+        r0 = r1; r1 = r2;
+        t0 = t1; t1 = t2;
+    }
+    if (r0 != 1) throw std::domain_error("Division by a residue with no inverse modulo " + std::to_string(p));
+    return static_cast<uint64_t>(t0 < 0 ? t0 + p : t0);
+}
+
+// Inverts values[0..n) in place with Montgomery's trick: one mod_inv and 3(n-1)
+// multiplications instead of n inversions. Throws like mod_inv if any value has no inverse.
+template <typename M>
+void batch_inverse(uint64_t* values, size_t n, const M& mod) {
+    if (n == 0) return;
+    std::vector<uint64_t> prefix(n);
+    prefix[0] = values[0];
+    for (size_t i = 1; i < n; ++i) prefix[i] = mod.mul(prefix[i - 1], values[i]);
+
+    uint64_t inv = mod_inv(prefix[n - 1], mod); // inverse of the whole product
+    for (size_t i = n - 1; i > 0; --i) {
+        uint64_t v = values[i];
+        values[i] = mod.mul(inv, prefix[i - 1]);
+        inv = mod.mul(inv, v);
+    }
+    values[0] = inv;
+}
+
+// -- MÖBIUS FUNCTIONS -----------------------------------------------------------------
+// x -> (a*x + b) / (c*x + d). Contraction turns every node with one known operand into
+// one of these, and they are closed under composition. They are kept as the coefficient
+// matrix, so composing never divides; only applying one to a value needs an inverse.
+// Affine maps are the case c = 0, d = 1.
+// -------------------------------------------------------------------------------------
+
+struct Mobius {
+    uint64_t a = 1, b = 0, c = 0, d = 1;
+
+    bool is_affine() const { return c == 0 && d == 1; }
+};
+
+// f o g, i.e. the matrix product f * g
+template <typename M>
+Mobius mobius_compose(const Mobius& f, const Mobius& g, const M& mod) {
+    return {mod.add(mod.mul(f.a, g.a), mod.mul(f.b, g.c)), mod.add(mod.mul(f.a, g.b), mod.mul(f.b, g.d)),
+            mod.add(mod.mul(f.c, g.a), mod.mul(f.d, g.c)), mod.add(mod.mul(f.c, g.b), mod.mul(f.d, g.d))};
+}
+
+// f(x); throws std::domain_error when c*x + d has no inverse
+template <typename M>
+uint64_t mobius_apply(const Mobius& f, uint64_t x, const M& mod) {
+    uint64_t num = mod.add(mod.mul(f.a, x), f.b);
+    if (f.is_affine()) return num;
+    return mod.mul(num, mod_inv(mod.add(mod.mul(f.c, x), f.d), mod));
+}
+
+// f(num / den), kept as a fraction so nothing is divided
+template <typename M>
+void mobius_apply_fraction(const Mobius& f, uint64_t& num, uint64_t& den, const M& mod) {
+    uint64_t n = mod.add(mod.mul(f.a, num), mod.mul(f.b, den));
+    den = mod.add(mod.mul(f.c, num), mod.mul(f.d, den));
+    num = n;
+}
+
+// Divides through by d when c == 0, so maps like x / 5 become affine again.
+template <typename M>
+Mobius mobius_normalise(const Mobius& f, const M& mod) {
+    if (f.c != 0 || f.d == 1) return f;
+    uint64_t inv = mod_inv(f.d, mod);
+    return {mod.mul(f.a, inv), mod.mul(f.b, inv), 0, 1};
+}
+
+// The function y -> op(v, y) (leaf_on_left) or y -> op(y, v), where the known operand v is
+// given as the fraction num / den, so no inverse is needed to build it.
+template <typename M>
+Mobius operator_function(const std::string& op, bool leaf_on_left, uint64_t num, uint64_t den, const M& mod) {
+    if (op == "+") return {den, num, 0, den};                                    // v + y, y + v
+    if (op == "-") return leaf_on_left ? Mobius{mod.sub(0, den), num, 0, den}    // v - y
+                                       : Mobius{den, mod.sub(0, num), 0, den};   // y - v
+    if (op == "*") return {num, 0, 0, den};                                      // v * y
+    if (op == "/") return leaf_on_left ? Mobius{0, num, den, 0}                  // v / y
+                                       : Mobius{den, 0, 0, num};                 // y / v
+    throw std::runtime_error("Unsupported operator in modular evaluation: " + op);
+}
+
+#endif // MOD_ARITH_H
@@ -2,9 +2,12 @@
 
 Node::Node(const std::string& x) : x(x) {}
 
-Node::Node(const std::string& x, Node* left, Node* right) : x(x), left(left), right(right) {}
+Node::Node(const std::string& x, Node* left, Node* right) : x(x), left(left), right(right) {
+    if (left) left->setParent(this);
+    if (right) right->setParent(this);
+}
 
-std::string Node::getString() { return x; }
+const std::string& Node::getString() const { return x; }
 Node* Node::getLeftChild() { return left; }
 //void Node::setLeftChild(Node* child) { left = child; }
 Node* Node::getRightChild() { return right; }
@@ -15,6 +18,8 @@ Node* Node::getParent() { return parent; }
 //}
 Sex Node::getSex() const { return sex; }
 void Node::setSex(Sex s) { sex = s; }
+int Node::getId() const { return id; }
+void Node::setId(int i) { id = i; }
 
 bool Node::isMarked() const { return marked; }
 void Node::mark() { marked = true; }
@@ -31,6 +36,16 @@ void Node::setEval(double val) {
 double Node::getEval() const { return eval; }
 bool Node::hasValue() const { return is_value_set; }
 
+// Caches are filled bottom-up, so the ancestors of a node without a value have none
+// either and the walk stops at the first of them; each cleared entry was set once.
+void Node::clearEval() {
+    for (Node* n = this; n && n->is_value_set; n = n->parent) n->is_value_set = false;
+}
+
+void Node::retain() { ++refs; }
+int Node::release() { return --refs; }
+int Node::refCount() const { return refs; }
+
 // leal addition
 bool Node::is_leaf() const {return (!left || left->isDeleted()) && (!right || right->isDeleted());}
 
@@ -57,6 +72,11 @@ void Node::setParent(Node* p) {
     parent = p;
 }
 
+void Node::shareChildren(Node* l, Node* r) {
+    left = l;
+    right = r;
+}
+
 void Node::setString(const std::string& val) {
     x = val;
 }
@@ -92,7 +112,7 @@ bool Node::eval_function(double x) {
 }
 
 bool Node::is_function() {
-    static std::regex func_pattern(R"(^(-?\d*\.?\d+),(-?\d*\.?\d+)$)");
+    static std::regex func_pattern(R"(^(-?\d*\.?\d+),(-?\d*\.?\d+)(,(-?\d*\.?\d+),(-?\d*\.?\d+))?$)");
     std::smatch matches;
     std::string str = this->getString(); // store in a local lvalue
     return std::regex_match(str, matches, func_pattern);
@@ -20,13 +20,15 @@ class Node {
     double eval = 0.0;
     bool is_value_set = false;
     Sex sex = Sex::UNASSIGNED;
+    int id = -1; // preorder index assigned by list_nodes, keys the counter-based RNG
+    int refs = 1; // parents holding the node; above 1 only for nodes shared by hash_cons
 
 public:
     Node(const std::string& x);
     Node(const std::string& x, Node* left, Node* right);
     ~Node() = default;
 
-    std::string getString();
+    const std::string& getString() const;
     Node* getLeftChild();
     //void setLeftChild(Node* child);
     Node* getRightChild();
@@ -35,6 +37,8 @@ public:
     //void setParent(Node* parent);
     Sex getSex() const;
     void setSex(Sex s);
+    int getId() const;
+    void setId(int i);
 
     bool isMarked() const;
     void mark();
@@ -47,6 +51,12 @@ public:
     void setEval(double val);
     double getEval() const;
     bool hasValue() const;
+    void clearEval(); // also clears every ancestor that has a cached value
+
+    // reference counting for shared (DAG) nodes
+    void retain();
+    int release(); // returns the references left
+    int refCount() const;
 
     bool is_leaf() const;
     bool is_op() const;
@@ -59,6 +69,9 @@ public:
     void setLeftChild(Node*);
     void setRightChild(Node*);
     void setParent(Node*);
+    // Points at the children without making this node their parent, for a copy that
+    // shares them with the node it copies (VersionedTree).
+    void shareChildren(Node* left, Node* right);
     void setString(const std::string& val);
 
     // linear function: a*x + b -> a,b
@@ -0,0 +1,126 @@
+#ifndef PARALLEL_PRIMITIVES_H
+#define PARALLEL_PRIMITIVES_H
+
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include "WorkerTeam.h"
+
+// Building blocks shared by the round-based algorithms in randomised.cpp.
+// They all run on default_team(), so no thread is created per round.
+
+inline size_t num_chunks() {
+    return default_team().size();
+}
+
+// Runs worker(shard, start, end) over [0, n) on the default team, one block per member.
+// shard is the calling member in [0, num_chunks()), e.g. for a ShardedCounter.
+// Returning from it is the barrier between two phases of a round.
+template <typename Worker>
+void parallel_chunks(size_t n, Worker worker) {
+    default_team().parallel_for(n, worker);
+}
+
+// One counter per thread, each on its own cache line. Threads add to their own shard
+// without synchronisation and the shards are summed once, after the phase is over.
+class ShardedCounter {
+    struct alignas(64) Shard { long long value = 0; };
+    std::vector<Shard> shards;
+
+public:
+    explicit ShardedCounter(size_t n = num_chunks()) : shards(n) {}
+
+    void add(size_t shard, long long delta) { shards[shard].value += delta; }
+
+    long long sum() const {
+        long long total = 0;
+        for (const Shard& s : shards) total += s.value;
+        return total;
+    }
+};
+
+// Replaces counts by their exclusive prefix sums and returns the total.
+inline size_t exclusive_scan(std::vector<size_t>& counts) {
+    size_t total = 0;
+    for (size_t& c : counts) {
+        size_t count = c;
+        c = total;
+        total += count;
+    }
+    return total;
+}
+
+// Stable parallel stream compaction: keeps the items for which keep(item) holds.
+// Every member counts the survivors of its block, member 0 scans the per-block counts
+// into output offsets, and the blocks then scatter independently. The three phases run
+// in one dispatch of the team, separated by barriers. Returns the new size.
+template <typename T, typename Pred>
+size_t parallel_compact(std::vector<T>& items, Pred keep) {
+    WorkerTeam& team = default_team();
+    const size_t n = items.size();
+    const size_t block = (n + team.size() - 1) / team.size();
+    std::vector<size_t> offsets(team.size(), 0);
+    std::vector<uint8_t> kept(n);
+    std::vector<T> out;
+
+    team.run([&](size_t tid) {
+        const size_t start = std::min(n, tid * block);
+        const size_t end = std::min(n, start + block);
+
+        size_t count = 0;
+        for (size_t i = start; i < end; ++i) {
+            kept[i] = keep(items[i]);
+            count += kept[i];
+        }
+        offsets[tid] = count;
+        team.barrier(tid);
+
+        if (tid == 0) out.resize(exclusive_scan(offsets));
+        team.barrier(tid);
+
+        size_t pos = offsets[tid];
+        for (size_t i = start; i < end; ++i) {
+            if (kept[i]) out[pos++] = items[i];
+        }
+    });
+
+    items = std::move(out);
+    return items.size();
+}
+
+// A fixed-size array whose pages are first written by the team members that will use
+// them: allocation does not touch it, and first_touch fills it through parallel_chunks,
+// so under the STATIC schedule each member's block lands on that member's NUMA node.
+template <typename T>
+class FirstTouchArray {
+    static_assert(std::is_trivially_copyable_v<T> && std::is_trivially_destructible_v<T>,
+                  "FirstTouchArray holds plain values");
+
+    struct Release {
+        void operator()(T* p) const { ::operator delete(p); }
+    };
+    std::unique_ptr<T, Release> items;
+    size_t count = 0;
+
+public:
+    void first_touch(size_t n, const T& value) {
+        items.reset(static_cast<T*>(::operator new(std::max<size_t>(n, 1) * sizeof(T))));
+        count = n;
+        T* p = items.get();
+        parallel_chunks(n, [p, &value](size_t, size_t start, size_t end) {
+            for (size_t i = start; i < end; ++i) new (p + i) T(value);
+        });
+    }
+
+    size_t size() const { return count; }
+    T* data() { return items.get(); }
+    const T* data() const { return items.get(); }
+    T& operator[](size_t i) { return items.get()[i]; }
+    const T& operator[](size_t i) const { return items.get()[i]; }
+};
+
+#endif // PARALLEL_PRIMITIVES_H
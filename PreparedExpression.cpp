@@ -0,0 +1,279 @@
+#include "PreparedExpression.h"
+#include "EvalCore.h"
+#include "ParallelPrimitives.h"
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PREPARED_X86 1
+#endif
+
+LaneIsa PREPARED_MAX_ISA = LaneIsa::AVX512;
+
+static bool live(Node* child) { return child && !child->isDeleted(); }
+
+static bool known_op(const std::string& s) {
+    return s == "+" || s == "-" || s == "*" || s == "/";
+}
+
+PreparedExpression::PreparedExpression(Node* root) : mod(eval_modulus()) {
+    if (!root) throw std::invalid_argument("PreparedExpression needs a root");
+
+    // preorder, with child indices and parameter numbers
+    struct Item {
+        Node* node;
+        int left = -1, right = -1;
+        int param = -1;
+        int label = 0; // registers needed (Sethi–Ullman)
+    };
+    std::vector<Item> items;
+    std::vector<std::pair<Node*, int>> stack{{root, -1}}; // node, slot in its parent to fill
+    while (!stack.empty()) {
+        auto [node, slot] = stack.back();
+        stack.pop_back();
+        const int v = static_cast<int>(items.size());
+        if (slot >= 0) {
+            Item& up = items[slot / 2];
+            (slot % 2 == 0 ? up.left : up.right) = v;
+        }
+        items.push_back({node});
+
+        if (node->is_leaf()) {
+            if (node->is_op()) throw std::invalid_argument("Invalid tree: a leaf node cannot be an operator.");
+            items[v].param = static_cast<int>(leaf_count++);
+            initial.push_back(std::stod(node->getString()));
+            continue;
+        }
+        if (!known_op(node->getString())) throw std::invalid_argument("Unsupported operator: " + node->getString());
+        if (!live(node->getLeftChild()) || !live(node->getRightChild())) {
+            throw std::invalid_argument("PreparedExpression needs every operator to have two children");
+        }
+        stack.push_back({node->getRightChild(), 2 * v + 1});
+        stack.push_back({node->getLeftChild(), 2 * v});
+    }
+
+    for (size_t v = items.size(); v-- > 0;) {
+        Item& item = items[v];
+        if (item.param >= 0) continue;
+        const int l = items[item.left].label, r = items[item.right].label;
+        item.label = std::max(1, l == r ? l + 1 : std::max(l, r));
+    }
+
+    // emit in postorder, the child with the larger label first
+    std::vector<int> operand(items.size());
+    std::vector<int> free_registers;
+    std::vector<std::pair<int, bool>> work{{0, false}}; // item, children done
+    while (!work.empty()) {
+        auto [v, expanded] = work.back();
+        work.pop_back();
+        const Item& item = items[v];
+        if (item.param >= 0) {
+            operand[v] = ~item.param;
+            continue;
+        }
+        if (!expanded) {
+            const bool right_first = items[item.right].label > items[item.left].label;
+            work.push_back({v, true});
+            work.push_back({right_first ? item.left : item.right, false});
+            work.push_back({right_first ? item.right : item.left, false});
+            continue;
+        }
+        const int a = operand[item.left], b = operand[item.right];
+        if (a >= 0) free_registers.push_back(a);
+        if (b >= 0) free_registers.push_back(b);
+        int dst;
+        if (free_registers.empty()) {
+            dst = static_cast<int>(registers++);
+        } else {
+            dst = free_registers.back();
+            free_registers.pop_back();
+        }
+        program.push_back({item.node->getString()[0], dst, a, b});
+        operand[v] = dst;
+    }
+    result = operand[0];
+}
+
+// -- LANE KERNELS -------------------------------------------------------------------
+// dst[i] = op(x[i], y[i]) for i < lanes, reduced as DoubleDomain does. dst may be x or y.
+// The vector kernels use fmod's x - trunc(x / p) * p while |x| < 2^52, like
+// Modulus::fmod, and hand the other lanes (huge, infinite, NaN) to Modulus::fmod.
+// -----------------------------------------------------------------------------------
+
+using LaneKernel = void (*)(char op, const double* x, const double* y, double* dst, size_t lanes, const Modulus& mod);
+
+static void lanes_scalar(char op, const double* x, const double* y, double* dst, size_t lanes, const Modulus& mod) {
+    DoubleDomain domain;
+    domain.mod = mod;
+    const EvalCore<DoubleDomain> core(domain);
+    for (size_t i = 0; i < lanes; ++i) dst[i] = core.apply(op, x[i], y[i]);
+}
+
+#ifdef PREPARED_X86
+
+template <char Op>
+__attribute__((target("avx512f")))
+static void lanes_avx512(const double* x, const double* y, double* dst, size_t lanes, const Modulus& mod) {
+    const double pd = static_cast<double>(mod.value());
+    const __m512d p = _mm512_set1_pd(pd), minus_p = _mm512_set1_pd(-pd), inv = _mm512_set1_pd(1.0 / pd);
+    const __m512d limit = _mm512_set1_pd(0x1p52), zero = _mm512_setzero_pd();
+    const __m512i magnitude = _mm512_set1_epi64(0x7FFFFFFFFFFFFFFFLL);
+    const __m512d inf = _mm512_set1_pd(std::numeric_limits<double>::infinity());
+    size_t i = 0;
+    for (; i + 8 <= lanes; i += 8) {
+        const __m512d a = _mm512_loadu_pd(x + i), b = _mm512_loadu_pd(y + i);
+        __m512d raw;
+        if constexpr (Op == '+') raw = _mm512_add_pd(a, b);
+        if constexpr (Op == '-') raw = _mm512_sub_pd(a, b);
+        if constexpr (Op == '*') raw = _mm512_mul_pd(a, b);
+        if constexpr (Op == '/') raw = _mm512_div_pd(a, b);
+
+        __mmask8 slow = _mm512_cmp_pd_mask(
+            _mm512_castsi512_pd(_mm512_and_si512(_mm512_castpd_si512(raw), magnitude)), limit, _CMP_NLT_UQ);
+        const __m512d t =
+            _mm512_maskz_roundscale_pd(0xFF, _mm512_mul_pd(raw, inv), _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+        __m512d r = _mm512_sub_pd(raw, _mm512_mul_pd(t, p));
+        // x * (1/p) may round to the neighbouring quotient
+        const __mmask8 nonneg = _mm512_cmp_pd_mask(raw, zero, _CMP_GE_OQ);
+        const __mmask8 add_p = (nonneg & _mm512_cmp_pd_mask(r, zero, _CMP_LT_OQ)) |
+                               (~nonneg & _mm512_cmp_pd_mask(r, minus_p, _CMP_LE_OQ));
+        const __mmask8 sub_p = (nonneg & _mm512_cmp_pd_mask(r, p, _CMP_GE_OQ)) |
+                               (~nonneg & _mm512_cmp_pd_mask(r, zero, _CMP_GT_OQ));
+        r = _mm512_mask_add_pd(r, add_p, r, p);
+        r = _mm512_mask_sub_pd(r, sub_p, r, p);
+        if constexpr (Op == '/') {
+            const __mmask8 by_zero = _mm512_cmp_pd_mask(b, zero, _CMP_EQ_OQ);
+            r = _mm512_mask_blend_pd(by_zero, r, inf);
+            slow &= ~by_zero;
+        }
+        _mm512_storeu_pd(dst + i, r);
+
+        if (slow) {
+            double raw_lanes[8];
+            _mm512_storeu_pd(raw_lanes, raw);
+            for (int j = 0; j < 8; ++j) {
+                if (slow >> j & 1) dst[i + j] = mod.fmod(raw_lanes[j]);
+            }
+        }
+    }
+    lanes_scalar(Op, x + i, y + i, dst + i, lanes - i, mod);
+}
+
+template <char Op>
+__attribute__((target("avx2")))
+static void lanes_avx2(const double* x, const double* y, double* dst, size_t lanes, const Modulus& mod) {
+    const double pd = static_cast<double>(mod.value());
+    const __m256d p = _mm256_set1_pd(pd), minus_p = _mm256_set1_pd(-pd), inv = _mm256_set1_pd(1.0 / pd);
+    const __m256d limit = _mm256_set1_pd(0x1p52), zero = _mm256_setzero_pd(), sign = _mm256_set1_pd(-0.0);
+    const __m256d inf = _mm256_set1_pd(std::numeric_limits<double>::infinity());
+    size_t i = 0;
+    for (; i + 4 <= lanes; i += 4) {
+        const __m256d a = _mm256_loadu_pd(x + i), b = _mm256_loadu_pd(y + i);
+        __m256d raw;
+        if constexpr (Op == '+') raw = _mm256_add_pd(a, b);
+        if constexpr (Op == '-') raw = _mm256_sub_pd(a, b);
+        if constexpr (Op == '*') raw = _mm256_mul_pd(a, b);
+        if constexpr (Op == '/') raw = _mm256_div_pd(a, b);
+
+        int slow = _mm256_movemask_pd(_mm256_cmp_pd(_mm256_andnot_pd(sign, raw), limit, _CMP_NLT_UQ));
+        const __m256d t = _mm256_round_pd(_mm256_mul_pd(raw, inv), _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+        __m256d r = _mm256_sub_pd(raw, _mm256_mul_pd(t, p));
+        const __m256d nonneg = _mm256_cmp_pd(raw, zero, _CMP_GE_OQ);
+        const __m256d add_p = _mm256_or_pd(_mm256_and_pd(nonneg, _mm256_cmp_pd(r, zero, _CMP_LT_OQ)),
+                                           _mm256_andnot_pd(nonneg, _mm256_cmp_pd(r, minus_p, _CMP_LE_OQ)));
+        const __m256d sub_p = _mm256_or_pd(_mm256_and_pd(nonneg, _mm256_cmp_pd(r, p, _CMP_GE_OQ)),
+                                           _mm256_andnot_pd(nonneg, _mm256_cmp_pd(r, zero, _CMP_GT_OQ)));
+        r = _mm256_add_pd(r, _mm256_and_pd(add_p, p));
+        r = _mm256_sub_pd(r, _mm256_and_pd(sub_p, p));
+        if constexpr (Op == '/') {
+            const __m256d by_zero = _mm256_cmp_pd(b, zero, _CMP_EQ_OQ);
+            r = _mm256_blendv_pd(r, inf, by_zero);
+            slow &= ~_mm256_movemask_pd(by_zero);
+        }
+        _mm256_storeu_pd(dst + i, r);
+
+        if (slow) {
+            double raw_lanes[4];
+            _mm256_storeu_pd(raw_lanes, raw);
+            for (int j = 0; j < 4; ++j) {
+                if (slow >> j & 1) dst[i + j] = mod.fmod(raw_lanes[j]);
+            }
+        }
+    }
+    lanes_scalar(Op, x + i, y + i, dst + i, lanes - i, mod);
+}
+
+static void lanes_avx512_dispatch(char op, const double* x, const double* y, double* dst, size_t lanes, const Modulus& mod) {
+    switch (op) {
+    case '+': lanes_avx512<'+'>(x, y, dst, lanes, mod); break;
+    case '-': lanes_avx512<'-'>(x, y, dst, lanes, mod); break;
+    case '*': lanes_avx512<'*'>(x, y, dst, lanes, mod); break;
+    default: lanes_avx512<'/'>(x, y, dst, lanes, mod); break;
+    }
+}
+
+static void lanes_avx2_dispatch(char op, const double* x, const double* y, double* dst, size_t lanes, const Modulus& mod) {
+    switch (op) {
+    case '+': lanes_avx2<'+'>(x, y, dst, lanes, mod); break;
+    case '-': lanes_avx2<'-'>(x, y, dst, lanes, mod); break;
+    case '*': lanes_avx2<'*'>(x, y, dst, lanes, mod); break;
+    default: lanes_avx2<'/'>(x, y, dst, lanes, mod); break;
+    }
+}
+
+#endif // PREPARED_X86
+
+// The reduction trick needs p < 2^52, as in Modulus::fmod.
+static LaneKernel lane_kernel(const Modulus& mod) {
+#ifdef PREPARED_X86
+    static const bool avx512 = __builtin_cpu_supports("avx512f");
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    if (mod.value() < (uint64_t(1) << 52)) {
+        if (avx512 && PREPARED_MAX_ISA >= LaneIsa::AVX512) return lanes_avx512_dispatch;
+        if (avx2 && PREPARED_MAX_ISA >= LaneIsa::AVX2) return lanes_avx2_dispatch;
+    }
+#endif
+    return lanes_scalar;
+}
+
+// -- EVALUATION ---------------------------------------------------------------------
+// -----------------------------------------------------------------------------------
+
+// Instances base .. base + lanes, with leaf k of instance i at params[k * stride + i].
+// Registers are PREPARED_BLOCK doubles apart in regs.
+void PreparedExpression::run_block(const double* params, size_t stride, size_t base, size_t lanes,
+                                   double* regs, double* out) const {
+    const LaneKernel kernel = lane_kernel(mod);
+    auto source = [&](int operand) -> const double* {
+        return operand >= 0 ? regs + static_cast<size_t>(operand) * PREPARED_BLOCK
+                            : params + static_cast<size_t>(~operand) * stride + base;
+    };
+    for (const Instruction& ins : program) {
+        kernel(ins.op, source(ins.a), source(ins.b), regs + static_cast<size_t>(ins.dst) * PREPARED_BLOCK, lanes, mod);
+    }
+    std::copy(source(result), source(result) + lanes, out);
+}
+
+double PreparedExpression::evaluate(const double* params) const {
+    std::vector<double> regs(registers * PREPARED_BLOCK);
+    double value;
+    run_block(params, 1, 0, 1, regs.data(), &value);
+    return value;
+}
+
+void PreparedExpression::evaluate_batch(const double* params, size_t count, double* out) const {
+    const size_t blocks = (count + PREPARED_BLOCK - 1) / PREPARED_BLOCK;
+    auto work = [&](size_t, size_t start, size_t end) {
+        std::vector<double> regs(registers * PREPARED_BLOCK);
+        for (size_t block = start; block < end; ++block) {
+            const size_t base = block * PREPARED_BLOCK;
+            run_block(params, count, base, std::min(PREPARED_BLOCK, count - base), regs.data(), out + base);
+        }
+    };
+    if (blocks <= 1) work(0, 0, blocks);
+    else parallel_chunks(blocks, work);
+}
@@ -0,0 +1,66 @@
+#ifndef PREPARED_EXPRESSION_H
+#define PREPARED_EXPRESSION_H
+
+#include <cstddef>
+#include <vector>
+#include "Node.h"
+#include "ModArith.h"
+
+// A tree compiled once into a straight-line program whose leaves are numbered parameters,
+// for evaluating the same shape under many leaf assignments with Tree::evaluate's
+// semantics (doubles reduced with fmod by eval_modulus(), as read at construction).
+//
+// Parameters are the leaves in preorder, i.e. left to right. Internal nodes become
+// instructions over a few registers: the child needing more registers is evaluated first
+// (Sethi–Ullman), so a tree of n leaves needs at most log2(n) + 1 of them.
+//
+// evaluate_batch runs the program over blocks of PREPARED_BLOCK instances: every
+// instruction is applied to a whole block, 8 lanes per instruction with AVX-512 or 4 with
+// AVX2 when the CPU has them, and the blocks are split over default_team().
+constexpr size_t PREPARED_BLOCK = 64;
+
+// The widest lane kernel evaluate_batch may pick; the CPU still has to support it. Lower it
+// to compare the kernels on one machine.
+enum class LaneIsa { SCALAR, AVX2, AVX512 };
+extern LaneIsa PREPARED_MAX_ISA; // AVX512
+
+class PreparedExpression {
+public:
+    // Throws std::invalid_argument for an empty tree, a leaf holding an operator or an
+    // operator it does not know.
+    explicit PreparedExpression(Node* root);
+
+    size_t parameter_count() const { return leaf_count; }
+    size_t register_count() const { return registers; }
+    size_t instruction_count() const { return program.size(); }
+
+    // The leaf values of the tree it was built from, as std::stod reads them.
+    const std::vector<double>& tree_parameters() const { return initial; }
+
+    // One assignment, params[k] being leaf k.
+    double evaluate(const double* params) const;
+
+    // count assignments stored column-major: leaf k of instance i is params[k * count + i].
+    // Writes the value of instance i to out[i].
+    void evaluate_batch(const double* params, size_t count, double* out) const;
+
+private:
+    // An operand is a register r >= 0 or the parameter ~operand.
+    struct Instruction {
+        char op;
+        int dst;
+        int a;
+        int b;
+    };
+
+    void run_block(const double* params, size_t stride, size_t base, size_t lanes, double* regs, double* out) const;
+
+    std::vector<Instruction> program;
+    int result = 0; // operand holding the value
+    size_t leaf_count = 0;
+    size_t registers = 0;
+    std::vector<double> initial;
+    Modulus mod;
+};
+
+#endif // PREPARED_EXPRESSION_H
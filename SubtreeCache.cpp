@@ -0,0 +1,168 @@
+#include "SubtreeCache.h"
+#include "HashCons.h"
+#include "EvalCore.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+
+size_t SUBTREE_CACHE_MIN_SIZE = 64;
+
+static bool live(Node* child) { return child && !child->isDeleted(); }
+
+// Merkle hashes as in HashCons.h, with the tag standing in for missing children so that
+// it reaches every hash. Children have larger preorder ids than their parent, so one pass
+// from the back sees them first.
+std::vector<SubtreeKey> subtree_keys(const std::vector<Node*>& nodes, CachedDomain domain) {
+    const uint64_t tag = eval_modulus().value() * 2 + (domain == CachedDomain::RESIDUE ? 1 : 0);
+    std::vector<SubtreeKey> keys(nodes.size());
+    for (size_t v = nodes.size(); v-- > 0;) {
+        Node* node = nodes[v];
+        uint64_t left = tag, right = tag;
+        keys[v].size = 1;
+        if (live(node->getLeftChild())) {
+            const SubtreeKey& child = keys[node->getLeftChild()->getId()];
+            left = child.hash;
+            keys[v].size += child.size;
+        }
+        if (live(node->getRightChild())) {
+            const SubtreeKey& child = keys[node->getRightChild()->getId()];
+            right = child.hash;
+            keys[v].size += child.size;
+        }
+        keys[v].hash = merkle_hash(node->getString(), left, right);
+    }
+    return keys;
+}
+
+SubtreeCache::SubtreeCache(size_t capacity, size_t shard_count)
+    : shards(std::max<size_t>(1, std::min(shard_count, capacity))), total_capacity(capacity) {
+    if (capacity == 0) throw std::invalid_argument("SubtreeCache needs a capacity");
+    for (size_t s = 0; s < shards.size(); ++s) {
+        shards[s].limit = capacity / shards.size() + (s < capacity % shards.size() ? 1 : 0);
+        shards[s].ring.reserve(shards[s].limit);
+    }
+}
+
+bool SubtreeCache::lookup(const SubtreeKey& key, uint64_t& value) {
+    Shard& shard = shard_for(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(key.hash);
+    if (it == shard.index.end() || shard.ring[it->second].key.size != key.size) {
+        ++shard.stats.misses;
+        return false;
+    }
+    Entry& entry = shard.ring[it->second];
+    entry.referenced = true;
+    value = entry.value;
+    ++shard.stats.hits;
+    return true;
+}
+
+void SubtreeCache::insert(const SubtreeKey& key, uint64_t value) {
+    Shard& shard = shard_for(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(key.hash);
+    if (it != shard.index.end()) {
+        shard.ring[it->second] = {key, value, true};
+        return;
+    }
+    ++shard.stats.insertions;
+    if (shard.ring.size() < shard.limit) {
+        shard.index.emplace(key.hash, shard.ring.size());
+        shard.ring.push_back({key, value, false});
+        return;
+    }
+
+    // CLOCK: give every referenced entry a second chance
+    while (shard.ring[shard.hand].referenced) {
+        shard.ring[shard.hand].referenced = false;
+        shard.hand = (shard.hand + 1) % shard.limit;
+    }
+    Entry& victim = shard.ring[shard.hand];
+    shard.index.erase(victim.key.hash);
+    shard.index.emplace(key.hash, shard.hand);
+    victim = {key, value, false};
+    shard.hand = (shard.hand + 1) % shard.limit;
+    ++shard.stats.evictions;
+}
+
+void SubtreeCache::clear() {
+    for (Shard& shard : shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.ring.clear();
+        shard.index.clear();
+        shard.hand = 0;
+        shard.stats = Stats();
+    }
+}
+
+SubtreeCache::Stats SubtreeCache::stats() const {
+    Stats total;
+    for (const Shard& shard : shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        total.hits += shard.stats.hits;
+        total.misses += shard.stats.misses;
+        total.insertions += shard.stats.insertions;
+        total.evictions += shard.stats.evictions;
+        total.entries += shard.ring.size();
+    }
+    return total;
+}
+
+bool SubtreeCache::lookup(const SubtreeKey& key, double& value) {
+    uint64_t bits;
+    if (!lookup(key, bits)) return false;
+    std::memcpy(&value, &bits, sizeof value);
+    return true;
+}
+
+void SubtreeCache::insert(const SubtreeKey& key, double value) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof bits);
+    insert(key, bits);
+}
+
+SubtreeCache& subtree_cache() {
+    static SubtreeCache cache(SUBTREE_CACHE_CAPACITY);
+    return cache;
+}
+
+// -- CACHED WALK ------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------
+
+template <typename Core>
+static typename Core::value_type evaluate_with(const Core& core, const std::vector<SubtreeKey>& keys,
+                                               SubtreeCache& cache, Node* node) {
+    if (node->is_leaf() && node->is_op()) {
+        throw std::runtime_error("Invalid tree: a leaf node cannot be an operator.");
+    }
+    if (node->is_leaf()) return core.leaf(node);
+
+    const SubtreeKey& key = keys[node->getId()];
+    const bool large = key.size >= SUBTREE_CACHE_MIN_SIZE;
+    using value_type = typename Core::value_type;
+    using stored_type = std::conditional_t<std::is_floating_point_v<value_type>, double, uint64_t>;
+    stored_type stored;
+    if (large && cache.lookup(key, stored)) return static_cast<value_type>(stored);
+
+    value_type result = core.apply(node, evaluate_with(core, keys, cache, node->getLeftChild()),
+                                   evaluate_with(core, keys, cache, node->getRightChild()));
+    if (large) cache.insert(key, static_cast<stored_type>(result));
+    return result;
+}
+
+double evaluate_through_cache(Node* root, SubtreeCache& cache) {
+    if (!root) return 0.0;
+    const std::vector<SubtreeKey> keys = subtree_keys(preorder_nodes(root), CachedDomain::DOUBLE);
+    return evaluate_with(EvalCore<DoubleDomain>(), keys, cache, root);
+}
+
+uint64_t evaluate_residue_through_cache(Node* root, SubtreeCache& cache) {
+    if (!root) return 0;
+    const std::vector<SubtreeKey> keys = subtree_keys(preorder_nodes(root), CachedDomain::RESIDUE);
+    return with_residue_domain([&](auto domain) {
+        return static_cast<uint64_t>(evaluate_with(EvalCore<decltype(domain)>(domain), keys, cache, root));
+    });
+}
@@ -0,0 +1,112 @@
+#ifndef SUBTREE_CACHE_H
+#define SUBTREE_CACHE_H
+
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "Tree.h"
+
+// A bounded cache of subtree values shared by every evaluation in the process, so that a
+// subexpression seen in an earlier request is not evaluated again.
+//
+// Subtrees are keyed by a Merkle hash (merkle_hash in HashCons.h: shape, operators and
+// leaf strings) seeded with the value domain and the evaluation modulus, and checked
+// against their size.
+// Two different subtrees with the same 64-bit hash and size would share an entry; with
+// hashes spread by splitmix that is as unlikely as a collision in any 64-bit table.
+//
+// Only subtrees of SUBTREE_CACHE_MIN_SIZE nodes or more are looked up and stored: below
+// that, evaluating is cheaper than a locked lookup.
+extern size_t SUBTREE_CACHE_MIN_SIZE;
+constexpr size_t SUBTREE_CACHE_CAPACITY = 1 << 16; // entries in subtree_cache()
+
+// What a cached value means: Tree::evaluate's doubles, or residues as the residue
+// engines and the contraction compute them. Both depend on eval_modulus().
+enum class CachedDomain { DOUBLE, RESIDUE };
+
+struct SubtreeKey {
+    uint64_t hash = 0;
+    uint64_t size = 0; // nodes in the subtree
+};
+
+// Every subtree's key, indexed by id, for nodes as numbered by preorder_nodes.
+std::vector<SubtreeKey> subtree_keys(const std::vector<Node*>& nodes, CachedDomain domain);
+
+// Sharded by key, each shard a fixed ring of entries evicted by CLOCK: a hit sets the
+// entry's reference bit, and the hand clears set bits until it finds an entry to replace.
+// Thread safe. Values are doubles or residues, stored as 64 bits either way.
+class SubtreeCache {
+public:
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t insertions = 0;
+        uint64_t evictions = 0;
+        size_t entries = 0;
+    };
+
+    explicit SubtreeCache(size_t capacity, size_t shard_count = 64);
+
+    SubtreeCache(const SubtreeCache&) = delete;
+    SubtreeCache& operator=(const SubtreeCache&) = delete;
+
+    bool lookup(const SubtreeKey& key, double& value);
+    bool lookup(const SubtreeKey& key, uint64_t& value);
+    void insert(const SubtreeKey& key, double value);
+    void insert(const SubtreeKey& key, uint64_t value);
+    void clear(); // entries and counters
+
+    Stats stats() const;
+    size_t capacity() const { return total_capacity; }
+
+private:
+    struct Entry {
+        SubtreeKey key;
+        uint64_t value;
+        bool referenced;
+    };
+    struct alignas(64) Shard {
+        mutable std::mutex mutex;
+        std::vector<Entry> ring;
+        std::unordered_map<uint64_t, size_t> index; // hash -> position in ring
+        size_t limit = 0;
+        size_t hand = 0;
+        Stats stats;
+    };
+
+    Shard& shard_for(const SubtreeKey& key) { return shards[(key.hash >> 32) % shards.size()]; }
+
+    std::vector<Shard> shards;
+    size_t total_capacity;
+};
+
+// The process-wide cache the evaluators below use by default.
+SubtreeCache& subtree_cache();
+
+// Ids of the largest subtrees under nodes[0] found in the cache, with their values, in
+// preorder. A subtree occupies the ids [v, v + size), so nodes inside a found subtree are
+// skipped without a lookup. T is double or uint64_t, as the values were stored.
+template <typename T>
+std::vector<std::pair<int, T>> cached_subtrees(const std::vector<SubtreeKey>& keys, SubtreeCache& cache) {
+    std::vector<std::pair<int, T>> found;
+    for (size_t v = 0; v < keys.size();) {
+        T value;
+        if (keys[v].size >= SUBTREE_CACHE_MIN_SIZE && cache.lookup(keys[v], value)) {
+            found.push_back({static_cast<int>(v), value});
+            v += keys[v].size;
+        } else {
+            ++v;
+        }
+    }
+    return found;
+}
+
+// Tree::evaluate and the residue evaluation (as evaluate_serial in seqmain) through the
+// cache: a subtree found there is not walked, and every large subtree evaluated is stored.
+// They renumber the nodes with preorder_nodes, so root must head a tree, not a DAG.
+double evaluate_through_cache(Node* root, SubtreeCache& cache = subtree_cache());
+uint64_t evaluate_residue_through_cache(Node* root, SubtreeCache& cache = subtree_cache());
+
+#endif // SUBTREE_CACHE_H
@@ -1,85 +1,221 @@
 #include "ThreadPool.h"
 
-ThreadPool::ThreadPool(size_t num_threads) : stop(false), active_tasks(0) {
-    //std::cout << "[ThreadPool] Constructed with " << num_threads << " threads." << std::endl;
+#include <algorithm>
+
+#if defined(__linux__)
+#include <climits>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#include <chrono>
+#endif
+
+// Most tasks a worker moves from the injection queue to its own deque at a time (the rest
+// of a burst stays for the others).
+constexpr size_t INJECTION_BATCH = 32;
+
+// Empty polls wait() spins through (pause, then yield) before it parks.
+constexpr int WAIT_SPINS = 128;
+constexpr int WAIT_YIELDS = 64;
+
+// The pool and index of the worker running on this thread, if any.
+struct WorkerSlot {
+    const void* pool = nullptr;
+    size_t index = 0;
+};
+static thread_local WorkerSlot current_worker;
+
+// The pool and latch of the task running on this thread; tasks it enqueues there join it.
+struct RunningTask {
+    const void* pool = nullptr;
+    void* latch = nullptr;
+};
+static thread_local RunningTask current_task;
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#else
+    std::this_thread::yield();
+#endif
+}
+
+// -- LATCH ----------------------------------------------------------------------------------
+// A waiter sets the parked bit and sleeps on the word; the count_down that takes the word
+// from 1 task and parked (3) to none wakes it. If the word changes before the waiter gets
+// to sleep, the futex wait returns at once and the waiter re-checks.
+// -------------------------------------------------------------------------------------------
+
+void ThreadPool::Latch::count_down() {
+    if (word.fetch_sub(2) != 3) return;
+#if defined(__linux__)
+    // keyed by address only, so this is safe even if the waiter has already moved on
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+#endif
+}
+
+void ThreadPool::Latch::park() {
+    uint32_t w = word.load();
+    if (w < 2) return;
+    if ((w & 1) == 0 && !word.compare_exchange_strong(w, w | 1)) return;
+#if defined(__linux__)
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT_PRIVATE, w | 1, nullptr, nullptr, 0);
+#else
+    std::this_thread::sleep_for(std::chrono::microseconds(50));
+#endif
+}
+
+void ThreadPool::Latch::settle() {
+    uint32_t parked_and_done = 1;
+    word.compare_exchange_strong(parked_and_done, 0);
+}
+
+void ThreadPool::Latch::fail(std::exception_ptr e) {
+    if (!failed.exchange(true)) error = std::move(e);
+}
+
+void ThreadPool::Latch::rethrow() {
+    if (!failed.load()) return;
+    std::exception_ptr e = std::move(error);
+    error = nullptr;
+    failed.store(false);
+    std::rethrow_exception(e);
+}
+
+// -- POOL -----------------------------------------------------------------------------------
+// -------------------------------------------------------------------------------------------
+
+ThreadPool::ThreadPool(size_t num_threads, Affinity affinity)
+    : cpus(worker_cpus(affinity, num_threads)), sleepers(0), pending(0), stop(false) {
+    for (size_t i = 0; i < num_threads; ++i) deques.emplace_back(new WorkDeque<Task>());
     for (size_t i = 0; i < num_threads; ++i) {
-        workers.emplace_back([this, i]() {
-            while (true) {
-                std::function<void()> task;
-                {
-                    std::unique_lock<std::mutex> lock(queue_mutex);
-                    //debug
-                    //std::cout << "[worker " << i << "] Waiting for task..." << std::endl;
-                    condition.wait(lock, [this]() {
-                        return stop || !tasks.empty();
-                    });
-                    if (stop && tasks.empty()) {
-                        //debug
-                        //std::cout << "[worker " << i << "] Exiting." << std::endl;
-                        return; // Exit thread
-                    }
-
-                    task = std::move(tasks.front());
-                    tasks.pop();
-                    //debug
-                    //std::cout << "[worker " << i << "] Dequeued task. Queue size: " << tasks.size() << std::endl;
-                }
-
-                //debug
-                //std::cout << "[worker " << i << "] Starting task. Active tasks: " << active_tasks.load() << std::endl;
-
-                try {
-                    task();
-                } catch (...) {
-                    //debug
-                    //std::cout << "[worker " << i << "] Task threw exception!" << std::endl;
-                    // Handle exceptions inside task gracefully
-                    active_tasks--;
-                    {
-                        std::lock_guard<std::mutex> lock(done_mutex);
-                        cv_done.notify_all();
-                    }
-                    throw; // rethrow if you want to propagate or handle otherwise
-                }
-                //debug
-                //std::cout << "[worker " << i << "] Finished task. Active tasks: " << active_tasks.load() - 1 << std::endl;
-
-                // Task finished successfully
-                active_tasks--;
-                {
-                    std::lock_guard<std::mutex> lock(done_mutex);
-                    if (active_tasks == 0 && tasks.empty()) {
-                        //debug
-                        //std::cout << "[worker " << i << "] All tasks done. Notifying waiters." << std::endl;
-                        cv_done.notify_all();
-                    }
-                }
-            }
-        });
+        workers.emplace_back([this, i]() { worker_loop(i); });
     }
 }
 
 ThreadPool::~ThreadPool() {
-    //std::cout << "[ThreadPool] Destructor called." << std::endl;
-    //std::cout << "[~ThreadPool] Stopping thread pool." << std::endl;
-    stop = true;
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        stop = true;
+    }
     condition.notify_all();
     for (std::thread& worker : workers) {
         if (worker.joinable()) {
             worker.join();
-            //std::cout << "[~ThreadPool] Joined one worker thread." << std::endl;
         }
     }
-    //std::cout << "[~ThreadPool] All worker threads joined." << std::endl;
+    for (Task* task : injected) delete task;
+}
+
+void ThreadPool::push(Task* task, Latch* latch) {
+    // counted before it is visible, so wait() cannot miss it
+    if (!latch) latch = current_task.pool == this ? static_cast<Latch*>(current_task.latch) : &phase;
+    task->latch = latch;
+    task->latch->add();
+    pending++;
+    if (current_worker.pool == this) {
+        deques[current_worker.index]->push(task);
+    } else {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        injected.push_back(task);
+    }
+    // a worker going to sleep either sees pending > 0 or is counted in sleepers
+    if (sleepers.load() > 0) {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        condition.notify_one();
+    }
+}
+
+ThreadPool::Task* ThreadPool::find_task(size_t self, uint64_t& seed) {
+    // self == deques.size() for a thread that is not one of the workers
+    WorkDeque<Task>* own = self < deques.size() ? deques[self].get() : nullptr;
+    if (own) {
+        if (Task* task = own->take()) return task;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(queue_mutex, std::try_to_lock);
+        if (lock.owns_lock() && !injected.empty()) {
+            Task* task = injected.front();
+            injected.pop_front();
+            const size_t share = own ? std::min(INJECTION_BATCH, injected.size() / deques.size()) : 0;
+            for (size_t k = 0; k < share; ++k) {
+                own->push(injected.front());
+                injected.pop_front();
+            }
+            return task;
+        }
+    }
+
+    // xorshift for the first victim, so thieves spread out
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    const size_t n = deques.size();
+    if (n == 0) return nullptr;
+    for (size_t k = 0, v = seed % n; k < n; ++k, v = (v + 1 == n ? 0 : v + 1)) {
+        if (v == self) continue;
+        if (Task* task = deques[v]->steal()) return task;
+    }
+    return nullptr;
+}
+
+void ThreadPool::run(Task* task) {
+    pending--;
+    std::unique_ptr<Task> owned(task);
+    const RunningTask outer = current_task;
+    current_task = {this, owned->latch};
+    try {
+        (*owned)();
+    } catch (...) {
+        owned->latch->fail(std::current_exception()); // for the waiter
+    }
+    current_task = outer;
+    owned->latch->count_down();
+}
+
+void ThreadPool::worker_loop(size_t self) {
+    pin_current_thread(cpus[self]);
+    current_worker = {this, self};
+    uint64_t seed = 0x9E3779B97F4A7C15ull * (self + 1);
+    while (true) {
+        if (Task* task = find_task(self, seed)) {
+            run(task);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        sleepers++;
+        condition.wait(lock, [this]() { return stop || pending.load() > 0; });
+        sleepers--;
+        if (stop && pending.load() <= 0) return; // Exit thread
+    }
+}
+
+// Runs queued tasks while there are any, then spins, yields and finally parks until the
+// latch opens.
+void ThreadPool::help_until(Latch& latch) {
+    const size_t self = current_worker.pool == this ? current_worker.index : deques.size();
+    uint64_t seed = reinterpret_cast<uintptr_t>(&latch) | 1;
+    int idle = 0;
+    while (!latch.done()) {
+        if (Task* task = find_task(self, seed)) {
+            run(task);
+            idle = 0;
+        } else if (idle < WAIT_SPINS) {
+            cpu_relax();
+            ++idle;
+        } else if (idle < WAIT_SPINS + WAIT_YIELDS) {
+            std::this_thread::yield();
+            ++idle;
+        } else {
+            latch.park();
+        }
+    }
+    latch.settle();
 }
 
 void ThreadPool::wait() {
-    std::unique_lock<std::mutex> lock(done_mutex);
-    //std::cout << "[wait] Waiting for all tasks to finish. Active tasks: " << active_tasks.load() << ", Queue size: " << tasks.size() << std::endl;
-    cv_done.wait(lock, [this]() {
-        bool done = (active_tasks == 0 && tasks.empty());
-        //std::cout << "[wait] Checking done condition: " << done << std::endl;
-        return done;
-    });
-    //std::cout << "[wait] All tasks finished." << std::endl;
+    help_until(phase);
+    phase.rethrow();
 }
@@ -2,45 +2,250 @@
 
 #include <vector>
 #include <thread>
-#include <queue>
+#include <deque>
+#include <memory>
 #include <mutex>
 #include <condition_variable>
 #include <functional>
 #include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <algorithm>
+#include <exception>
+#include <optional>
 #include <iostream>
+#include "CpuTopology.h"
+#include "WorkDeque.h"
 
+// Tasks enqueued from a worker go to that worker's own deque, tasks from any other thread
+// to a shared injection queue. An idle worker takes from its own deque (newest first),
+// then from the injection queue, then steals the oldest task of another worker.
+//
+// Every task counts down a latch: its TaskGroup's, its Future's, or else the pool's
+// current phase, which wait() closes. Tasks enqueued by a running task join its latch.
+// A waiting thread runs queued tasks itself, then spins briefly and only then parks, so
+// a short round does not pay for a wake-up. What a task throws is kept by its latch and
+// rethrown by whoever waits on it (the first exception, if several tasks throw).
+//
+// Workers are pinned following affinity (see CpuTopology.h) as they start.
 class ThreadPool {
 public:
-    ThreadPool(size_t num_threads);
+    ThreadPool(size_t num_threads, Affinity affinity = WORKER_AFFINITY);
     ~ThreadPool();
 
+    size_t size() const { return workers.size(); }
+    // The CPU of each worker, -1 where unpinned.
+    const std::vector<int>& placement() const { return cpus; }
+
+    template<class T>
+    class Future;
+    class TaskGroup;
+
     template<class F>
     void enqueue(F&& f);
 
+    // Runs f() on the pool; the future's get() returns its result.
+    template<class F>
+    auto submit(F&& f) -> Future<std::invoke_result_t<std::decay_t<F>&>>;
+
+    // Runs fn(lo, hi) over [begin, end) cut into chunks of grain: one shared range that at
+    // most one task per worker claims chunks from, so a round costs O(threads) tasks
+    // whatever its size. Like enqueue it returns at once; wait() covers it. fn is moved
+    // into the range, so it may capture by reference whatever outlives the wait().
+    template<class F>
+    void parallel_for(size_t begin, size_t end, size_t grain, F&& fn);
+
+    // Blocks until every task enqueued so far outside groups and futures, and every task
+    // those enqueue, has run, running queued tasks meanwhile. Rethrows what one of them
+    // threw. Not for use inside the pool's own tasks; a TaskGroup is.
     void wait();
 
 private:
+    // Counts outstanding tasks and keeps the first exception one of them threw. The count
+    // and a parked flag share one futex word (count << 1 | parked): the last count_down
+    // wakes a parked waiter without touching the latch again, so the waiter may destroy
+    // it as soon as done() holds.
+    class Latch {
+    public:
+        void add() { word.fetch_add(2); }
+        void count_down();
+        bool done() const { return word.load(std::memory_order_acquire) < 2; }
+        void park();    // returns at once if done(), and possibly spuriously
+        void settle();  // by the waiter, once done(): clears the parked flag
+        void fail(std::exception_ptr error);
+        void rethrow(); // once done(): rethrows the kept exception, if any, and forgets it
+
+    private:
+        alignas(64) std::atomic<uint32_t> word{0};
+        std::atomic<bool> failed{false};
+        std::exception_ptr error;
+    };
+
+    // A type-erased void() callable kept inline when it is small, as the lambdas the
+    // engines enqueue are, so a task is a single allocation.
+    class Task {
+    public:
+        template<class F, class D = std::decay_t<F>>
+        explicit Task(F&& f) {
+            if constexpr (sizeof(D) <= INLINE_SIZE && alignof(D) <= alignof(std::max_align_t)) {
+                target = new (storage) D(std::forward<F>(f));
+                destroy = [](void* p) { static_cast<D*>(p)->~D(); };
+            } else {
+                target = new D(std::forward<F>(f));
+                destroy = [](void* p) { delete static_cast<D*>(p); };
+            }
+            invoke = [](void* p) { (*static_cast<D*>(p))(); };
+        }
+        Task(const Task&) = delete;
+        Task& operator=(const Task&) = delete;
+        ~Task() { destroy(target); }
+
+        void operator()() { invoke(target); }
+
+        Latch* latch = nullptr; // counted down once it has run
+
+    private:
+        static constexpr size_t INLINE_SIZE = 48;
+        alignas(std::max_align_t) unsigned char storage[INLINE_SIZE];
+        void* target;
+        void (*invoke)(void*);
+        void (*destroy)(void*);
+    };
+
+    // latch null: the running task's latch, else the current phase
+    void push(Task* task, Latch* latch = nullptr);
+    template<class F>
+    void spread(Latch* latch, size_t begin, size_t end, size_t grain, F&& fn);
+    Task* find_task(size_t self, uint64_t& seed);
+    void run(Task* task);
+    void worker_loop(size_t self);
+    void help_until(Latch& latch);
+
     std::vector<std::thread> workers;
-    std::queue<std::function<void()>> tasks;
+    std::vector<int> cpus;
+    std::vector<std::unique_ptr<WorkDeque<Task>>> deques;
+
+    std::mutex queue_mutex; // injection queue
+    std::deque<Task*> injected;
 
-    std::mutex queue_mutex;
+    std::mutex sleep_mutex;
     std::condition_variable condition;
+    std::atomic<int> sleepers;
+    std::atomic<int64_t> pending; // enqueued, not yet taken
 
-    std::mutex done_mutex;
-    std::condition_variable cv_done;
+    Latch phase; // tasks enqueued since the last wait(), from outside any task
 
     std::atomic<bool> stop;
-    std::atomic<int> active_tasks;
 };
 
 template<class F>
 void ThreadPool::enqueue(F&& f) {
-    active_tasks++; // Increment active_tasks here, before adding to queue
-    {
-        std::unique_lock<std::mutex> lock(queue_mutex);
-        tasks.emplace(std::forward<F>(f));
-        // debug
-        // std::cout << "[enqueue] Task added. Queue size: " << tasks.size() << ", active_tasks: " << active_tasks.load() << std::endl;
+    push(new Task(std::forward<F>(f)));
+}
+
+// A submitted task's result, which get() waits for while running pool tasks, rethrowing
+// what the task threw. Move-only, like std::future.
+template<class T>
+class ThreadPool::Future {
+public:
+    Future() = default;
+    Future(Future&&) = default;
+    Future& operator=(Future&&) = default;
+
+    bool valid() const { return state != nullptr; }
+    bool ready() const { return state->latch.done(); }
+    T get();
+
+private:
+    friend class ThreadPool;
+    struct State {
+        Latch latch;
+        std::optional<std::conditional_t<std::is_void_v<T>, char, T>> value;
+    };
+    Future(ThreadPool* pool, std::shared_ptr<State> state) : pool(pool), state(std::move(state)) {}
+
+    ThreadPool* pool = nullptr;
+    std::shared_ptr<State> state;
+};
+
+// Structured fork-join: wait() covers the tasks run in the group and the tasks they
+// enqueue, not the rest of the pool, so independent callers can share one pool. It may be
+// used from inside a task, for a group that task does not itself belong to. The
+// destructor waits too, but drops the exception.
+class ThreadPool::TaskGroup {
+public:
+    explicit TaskGroup(ThreadPool& pool) : pool(pool) {}
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+    ~TaskGroup() { pool.help_until(latch); }
+
+    template<class F>
+    void run(F&& f) { pool.push(new Task(std::forward<F>(f)), &latch); }
+
+    // As ThreadPool::parallel_for, within the group.
+    template<class F>
+    void parallel_for(size_t begin, size_t end, size_t grain, F&& fn) {
+        pool.spread(&latch, begin, end, grain, std::forward<F>(fn));
+    }
+
+    void wait() {
+        pool.help_until(latch);
+        latch.rethrow();
+    }
+
+private:
+    ThreadPool& pool;
+    Latch latch;
+};
+
+template<class T>
+T ThreadPool::Future<T>::get() {
+    pool->help_until(state->latch);
+    state->latch.rethrow();
+    if constexpr (!std::is_void_v<T>) return std::move(*state->value);
+}
+
+template<class F>
+auto ThreadPool::submit(F&& f) -> Future<std::invoke_result_t<std::decay_t<F>&>> {
+    using R = std::invoke_result_t<std::decay_t<F>&>;
+    auto state = std::make_shared<typename Future<R>::State>();
+    Latch* latch = &state->latch;
+    push(new Task([state, fn = std::decay_t<F>(std::forward<F>(f))]() mutable {
+        if constexpr (std::is_void_v<R>) {
+            fn();
+        } else {
+            state->value.emplace(fn());
+        }
+    }), latch);
+    return Future<R>(this, std::move(state));
+}
+
+template<class F>
+void ThreadPool::parallel_for(size_t begin, size_t end, size_t grain, F&& fn) {
+    spread(nullptr, begin, end, grain, std::forward<F>(fn));
+}
+
+template<class F>
+void ThreadPool::spread(Latch* latch, size_t begin, size_t end, size_t grain, F&& fn) {
+    if (begin >= end) return;
+    struct Range {
+        Range(size_t begin, size_t end, size_t grain, F&& fn) : next(begin), end(end), grain(grain), fn(std::forward<F>(fn)) {}
+        std::atomic<size_t> next;
+        const size_t end, grain;
+        std::decay_t<F> fn;
+    };
+    grain = std::max<size_t>(grain, 1);
+    auto range = std::make_shared<Range>(begin, end, grain, std::forward<F>(fn));
+    const size_t chunks = (end - begin + grain - 1) / grain;
+    const size_t tasks = std::min(chunks, std::max<size_t>(workers.size(), 1));
+    for (size_t t = 0; t < tasks; ++t) {
+        push(new Task([range]() {
+            for (size_t lo; (lo = range->next.fetch_add(range->grain)) < range->end;) {
+                range->fn(lo, std::min(lo + range->grain, range->end));
+            }
+        }), latch);
     }
-    condition.notify_one();
 }
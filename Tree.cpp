@@ -3,8 +3,8 @@
 #include <cstdlib>
 #include <iostream>
 #include <cmath>
+#include "EvalCore.h"
 
-constexpr int LARGE_PRIME = 6101;
 // double evaluate_parallel(Node* node);
 
 Tree::Tree(Node* root) : root(root) {}
@@ -15,41 +15,41 @@ Tree::~Tree() {
 
 Node* Tree::getRoot() const { return root; }
 
+// A node shared by several parents (see hash_cons) goes with its last reference.
 void Tree::delete_subtree(Node* node) {
-    if (!node) return;
+    if (!node || node->release() > 0) return;
     if (node->getLeftChild()) delete_subtree(node->getLeftChild());
     if (node->getRightChild()) delete_subtree(node->getRightChild());
     delete node;
 }
 
+Node* Tree::copy_subtree(Node* node) const {
+    if (!node) return nullptr;
+    if (node->is_leaf()) return new Node(node->getString());
+    return new Node(node->getString(), copy_subtree(node->getLeftChild()), copy_subtree(node->getRightChild()));
+}
 
-double Tree::evaluate(Node* node) const {
-    if (!node) node = root;
 
+// Walks the tree with one core, so the modulus is read once per evaluation.
+static double evaluate_with(const EvalCore<DoubleDomain>& core, Node* node) {
     if (node->is_leaf() && node->is_op()) {
         throw std::runtime_error("Invalid tree: a leaf node cannot be an operator.");
     }
 
-    if (node->is_leaf()) return std::stod(node->getString());
-
-    double left = evaluate(node->getLeftChild());
-    double right = evaluate(node->getRightChild());
-
-    //int l = static_cast<int>(left);
-    //int r = static_cast<int>(right);
-
-    std::string op = node->getString();
-  
-    /*
-    if (op == "+") return std::fmod(l + r, static_cast<double>(LARGE_PRIME));
-    if (op == "-") return std::fmod(l - r, static_cast<double>(LARGE_PRIME));
-    if (op == "*") return std::fmod(l * r, static_cast<double>(LARGE_PRIME));
-    if (op == "/") return r != 0 ? std::fmod(l / r, static_cast<double>(LARGE_PRIME)) : std::numeric_limits<double>::infinity();
-    */
-   if (op == "+") return std::fmod(left + right, static_cast<double>(LARGE_PRIME));
-   if (op == "-") return std::fmod(left - right, static_cast<double>(LARGE_PRIME));
-   if (op == "*") return std::fmod(left * right, static_cast<double>(LARGE_PRIME));
-   if (op == "/") return right != 0 ? std::fmod(left / right, static_cast<double>(LARGE_PRIME)) : std::numeric_limits<double>::infinity();
-
-    return 0;
-}
\ No newline at end of file
+    if (node->is_leaf()) return core.leaf(node);
+
+    double left = evaluate_with(core, node->getLeftChild());
+    double right = evaluate_with(core, node->getRightChild());
+    return core.apply(node, left, right);
+}
+
+double Tree::evaluate(Node* node) const {
+    if (!node) node = root;
+    return evaluate_with(EvalCore<DoubleDomain>(), node);
+}
+
+void Tree::updateLeaf(Node* leaf, const std::string& value) {
+    if (!leaf || !leaf->is_leaf()) throw std::invalid_argument("updateLeaf expects a leaf node");
+    leaf->setString(value);
+    leaf->clearEval();
+}
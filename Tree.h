@@ -12,8 +12,12 @@ public:
 
     Node* getRoot() const;
     void delete_subtree(Node* node);
+    Node* copy_subtree(Node* node) const; // deep copy of the strings and shape
     double evaluate(Node* node = nullptr) const;
 
+    // Sets the string of a leaf and drops the cached values that depended on it.
+    void updateLeaf(Node* leaf, const std::string& value);
+
     
 };
 
@@ -1,10 +1,14 @@
 #include "TreeContrParallel.h"
+#include "AffineKernels.h"
+
+#include <algorithm>
 
 // -- THREAD AUX ---------------------------------------
 // -----------------------------------------------------
 
 // version 1
-constexpr int MAX_THREADS = 8;
+// one thread per hardware thread; the autotuner sweeps thread counts up to it
+const int MAX_THREADS = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
 std::atomic<int> thread_count(0);
 
 template <typename Func>
@@ -23,6 +27,7 @@ void limited_thread(std::vector<std::thread>& threads, Func task) {
 }
 
 // version 2
+// defaults; parallelmain replaces them with the autotuned setting for the tree's shape
 
 size_t THREAD_POOL_SIZE = 1;
 size_t BATCH_SIZE = 15;
@@ -145,124 +150,129 @@ size_t BATCH_SIZE = 15;
 
 // version 2 - thread pool
 
-void process_eval_nodes(const std::vector<Node*>& nodes, ThreadPool& pool) {
-    const size_t BATCH = BATCH_SIZE;
-    for (size_t i = 0; i < nodes.size(); i += BATCH) {
-        size_t end = std::min(i + BATCH, nodes.size());
-        pool.enqueue([=]() {
-            for (size_t j = i; j < end; ++j) {
-                Node* node = nodes[j];
-                Node* left = node->getLeftChild();
-                Node* right = node->getRightChild();
-                std::string op = node->getString();
-                double l = std::stod(left->getString());
-                double r = std::stod(right->getString());
-
-                int il = static_cast<int>(l);
-                int ir = static_cast<int>(r);
-                double res = (op == "+") ? (il + ir) % 6101 :
-                (op == "-") ? ((il - ir) % 6101 + 6101) % 6101 :
-                (il * ir) % 6101;
-
-                node->setString(std::to_string(res));
-                node->setEval(res);
-                left->markDeleted();
-                right->markDeleted();
-                node->setLeftChild(nullptr);
-                node->setRightChild(nullptr);
+void process_eval_nodes(const std::vector<Node*>& nodes, ThreadPool::TaskGroup& group) {
+    group.parallel_for(0, nodes.size(), BATCH_SIZE, [&nodes](size_t i, size_t end) {
+        const Modulus& mod = eval_modulus();
+        const EvalCore<ResidueDomain<Modulus>> core(ResidueDomain<Modulus>{mod});
+        const size_t n = end - i;
+        std::vector<uint64_t> l(n), r(n), res(n);
+
+        // the divisors of the batch are inverted together (Montgomery's trick)
+        std::vector<size_t> divisions;
+        std::vector<uint64_t> divisors;
+        for (size_t k = 0; k < n; ++k) {
+            Node* node = nodes[i + k];
+            l[k] = core.leaf(node->getLeftChild());
+            r[k] = core.leaf(node->getRightChild());
+            if (op_code(node) == '/') {
+                divisions.push_back(k);
+                divisors.push_back(r[k]);
             }
-        });
-    }
+        }
+        batch_inverse(divisors.data(), divisors.size(), mod);
+        for (size_t q = 0; q < divisions.size(); ++q) res[divisions[q]] = mod.mul(l[divisions[q]], divisors[q]);
+
+        for (size_t k = 0; k < n; ++k) {
+            Node* node = nodes[i + k];
+            Node* left = node->getLeftChild();
+            Node* right = node->getRightChild();
+            if (op_code(node) != '/') res[k] = core.apply(node, l[k], r[k]);
+
+            node->setString(std::to_string(res[k]));
+            node->setEval(res[k]);
+            left->markDeleted();
+            right->markDeleted();
+            node->setLeftChild(nullptr);
+            node->setRightChild(nullptr);
+        }
+    });
 }
 
-void process_function_nodes(const std::vector<Node*>& nodes, ThreadPool& pool) {
-    const size_t BATCH = BATCH_SIZE;
-    for (size_t i = 0; i < nodes.size(); i += BATCH) {
-        size_t end = std::min(i + BATCH, nodes.size());
-        pool.enqueue([=]() {
-            for (size_t j = i; j < end; ++j) {
-                Node* node = nodes[j];
-                if (!node || node->isDeleted()) continue;
-
-                Node* left = node->getLeftChild();
-                Node* right = node->getRightChild();
-                std::string op = node->getString();
-                bool left_leaf = left && left->is_leaf();
-                bool right_leaf = right && right->is_leaf();
-                std::string func;
-
-                if (left_leaf && !right_leaf) {
-                    int val = static_cast<int>(std::stod(left->getString()));
-                    if (op == "+") {
-                        func = "1," + std::to_string((val % 6101 + 6101) % 6101);
-                    } else if (op == "-") {
-                        int mod_val = ((-val % 6101) + 6101) % 6101;
-                        func = "1," + std::to_string(mod_val);
-                    } else if (op == "*") {
-                        int coeff = (val % 6101 + 6101) % 6101;
-                        func = std::to_string(coeff) + ",0";
-                    }
-                    node->setString(func);
-                    node->setEval(0.0);
-                    left->markDeleted();
-                    node->setLeftChild(nullptr);
-                }
-
-                else if (!left_leaf && right_leaf) {
-                    int val = static_cast<int>(std::stod(right->getString()));
-                    if (op == "+") {
-                        func = "1," + std::to_string((val % 6101 + 6101) % 6101);
-                    } else if (op == "-") {
-                        int mod_val = ((-val % 6101) + 6101) % 6101;
-                        func = "1," + std::to_string(mod_val);
-                    } else if (op == "*") {
-                        int coeff = (val % 6101 + 6101) % 6101;
-                        func = std::to_string(coeff) + ",0";
-                    }
-                    node->setString(func);
-                    node->setEval(0.0);
-                    right->markDeleted();
-                    node->setRightChild(nullptr);
-                }
-            }
-        });
-    }
+void process_function_nodes(const std::vector<Node*>& nodes, ThreadPool::TaskGroup& group) {
+    group.parallel_for(0, nodes.size(), BATCH_SIZE, [&nodes](size_t i, size_t end) {
+        const Modulus& mod = eval_modulus();
+        for (size_t j = i; j < end; ++j) {
+            Node* node = nodes[j];
+            if (!node || node->isDeleted()) continue;
+
+            Node* left = node->getLeftChild();
+            Node* right = node->getRightChild();
+            std::string op = node->getString();
+            bool left_leaf = left && left->is_leaf();
+            bool right_leaf = right && right->is_leaf();
+            if (left_leaf == right_leaf) continue;
+
+            Node* leaf = left_leaf ? left : right;
+            Mobius f = operator_function(op, left_leaf, parse_residue(leaf->getString(), mod), 1, mod);
+
+            node->setString(functionString(f));
+            node->setEval(0.0);
+            leaf->markDeleted();
+            if (left_leaf) node->setLeftChild(nullptr);
+            else node->setRightChild(nullptr);
+        }
+    });
 }
 
 
-void process_function_eval_nodes(const std::vector<Node*>& nodes, ThreadPool& pool) {
-    const size_t BATCH = BATCH_SIZE;
-    for (size_t i = 0; i < nodes.size(); i += BATCH) {
-        size_t end = std::min(i + BATCH, nodes.size());
-        pool.enqueue([=]() {
-            for (size_t j = i; j < end; ++j) {
-                Node* node = nodes[j];
-                if (!node || node->isDeleted()) continue;
-
-                Node* left = node->getLeftChild();
-                Node* right = node->getRightChild();
-                Node* child = (left && left->is_leaf()) ? left : (right && right->is_leaf()) ? right : nullptr;
-                if (!child) continue;
-
-                double x = std::stod(child->getString());
-                double val = evaluateFunctionNode(node->getString(), x);
-
-                // Apply modulo and set result
-                int ival = static_cast<int>(val) % 6101;
-                if (ival < 0) ival += 6101;
-
-                node->setString(std::to_string(ival));
-                node->setEval(ival);
-                child->markDeleted();
-
-                if (child == left) {
-                    node->setLeftChild(nullptr);
-                } else {
-                    node->setRightChild(nullptr);
-                }
+void process_function_eval_nodes(const std::vector<Node*>& nodes, ThreadPool::TaskGroup& group) {
+    group.parallel_for(0, nodes.size(), BATCH_SIZE, [&nodes](size_t i, size_t end) {
+        // gather the batch into packed arrays, evaluate the affine functions in one kernel
+        // call and the fractional ones with one batched inversion, scatter back
+        const Modulus& mod = eval_modulus();
+        std::vector<Node*> batch, children;
+        std::vector<uint64_t> a, b, x, val;
+        std::vector<Node*> frac_batch, frac_children;
+        std::vector<uint64_t> frac_num, frac_den;
+        for (size_t j = i; j < end; ++j) {
+            Node* node = nodes[j];
+            if (!node || node->isDeleted()) continue;
+
+            Node* left = node->getLeftChild();
+            Node* right = node->getRightChild();
+            Node* child = (left && left->is_leaf()) ? left : (right && right->is_leaf()) ? right : nullptr;
+            Mobius f;
+            if (!child || !parseFunction(node->getString(), f)) continue;
+            uint64_t cx = parse_residue(child->getString(), mod);
+
+            if (f.is_affine()) {
+                batch.push_back(node);
+                children.push_back(child);
+                a.push_back(f.a);
+                b.push_back(f.b);
+                x.push_back(cx);
+            } else {
+                frac_batch.push_back(node);
+                frac_children.push_back(child);
+                frac_num.push_back(mod.add(mod.mul(f.a, cx), f.b));
+                frac_den.push_back(mod.add(mod.mul(f.c, cx), f.d));
             }
-        });
-    }
+        }
+
+        val.resize(batch.size());
+        apply_affine_batch(a.data(), b.data(), x.data(), val.data(), batch.size(), mod);
+
+        batch_inverse(frac_den.data(), frac_den.size(), mod);
+        for (size_t k = 0; k < frac_batch.size(); ++k) {
+            batch.push_back(frac_batch[k]);
+            children.push_back(frac_children[k]);
+            val.push_back(mod.mul(frac_num[k], frac_den[k]));
+        }
+
+        for (size_t k = 0; k < batch.size(); ++k) {
+            Node* node = batch[k];
+            Node* child = children[k];
+            node->setString(std::to_string(val[k]));
+            node->setEval(val[k]);
+            child->markDeleted();
+
+            if (child == node->getLeftChild()) {
+                node->setLeftChild(nullptr);
+            } else {
+                node->setRightChild(nullptr);
+            }
+        }
+    });
 }
 
 
@@ -273,11 +283,16 @@ void parallelRake(ThreadPool& pool, Node* root) {
     collect_rakeable_nodes(root, eval_nodes, function_nodes, function_eval_nodes);
 
     // ThreadPool pool(THREAD_POOL_SIZE);
-    process_function_eval_nodes(function_eval_nodes, pool);
-    process_function_nodes(function_nodes, pool);
-    process_eval_nodes(eval_nodes, pool);
-
-    pool.wait();
+    // a group, so contractions of different trees can share the pool
+    ThreadPool::TaskGroup group(pool);
+    // function nodes first: they check whether their children are leaves, which the
+    // other two kinds change as they run
+    process_function_nodes(function_nodes, group);
+    group.wait();
+    process_function_eval_nodes(function_eval_nodes, group);
+    process_eval_nodes(eval_nodes, group);
+
+    group.wait();
     //std::cout << "[parallelRake] End" << std::endl;
 }
 
@@ -362,31 +377,65 @@ void collectUnaryFuncChains(Node* root, std::vector<std::vector<Node*>>& chains)
 // }
 
 // verison 2: thread pool
+// All chains advance together: each round composes every pair of every chain. The affine
+// pairs of a batch are packed into arrays and composed in one kernel call; pairs involving a
+// fractional function are composed as 2x2 matrices.
+
+void composePairs(const std::vector<std::pair<Node*, Node*>>& pairs, ThreadPool& pool) {
+    ThreadPool::TaskGroup group(pool);
+    group.parallel_for(0, pairs.size(), BATCH_SIZE, [&pairs](size_t i, size_t end) {
+        const Modulus& mod = eval_modulus();
+        std::vector<size_t> affine;
+        std::vector<uint64_t> a1, b1, a2, b2;
+        for (size_t k = i; k < end; ++k) {
+            Mobius f, g;
+            if (!parseFunction(pairs[k].first->getString(), f)) continue;
+            if (!parseFunction(pairs[k].second->getString(), g)) continue;
+            if (!f.is_affine() || !g.is_affine()) {
+                setComposedFunction(pairs[k].first, pairs[k].second, mobius_compose(f, g, mod));
+                continue;
+            }
+            affine.push_back(k);
+            a1.push_back(f.a);
+            b1.push_back(f.b);
+            a2.push_back(g.a);
+            b2.push_back(g.b);
+        }
 
-void parallelComposeChain(std::vector<Node*>& chain, ThreadPool& pool) {
-    int round = 0;
-    while (chain.size() > 1) {
-        std::vector<Node*> next_round;
+        const size_t n = affine.size();
+        std::vector<uint64_t> a(n), b(n);
+        compose_affine_batch(a1.data(), b1.data(), a2.data(), b2.data(), a.data(), b.data(), n, mod);
 
-        for (size_t i = 0; i < chain.size() - 1; i += 2) {
-            Node* f1 = chain[i];
-            Node* f2 = chain[i + 1];
+        for (size_t k = 0; k < n; ++k) {
+            setComposedFunction(pairs[affine[k]].first, pairs[affine[k]].second, Mobius{a[k], b[k], 0, 1});
+        }
+    });
+    group.wait();
+}
 
-            // std::cout << "[Compose] " << f1->getString() << " ° " << f2->getString() << "\n";
+void parallelComposeChains(std::vector<std::vector<Node*>>& chains, ThreadPool& pool) {
+    bool remaining = true;
+    while (remaining) {
+        std::vector<std::pair<Node*, Node*>> pairs;
+        remaining = false;
 
-            pool.enqueue([f1, f2]() {
-                composeFunctions(f1, f2);
-            });
+        for (auto& chain : chains) {
+            if (chain.size() <= 1) continue;
+            std::vector<Node*> next_round;
 
-            next_round.push_back(f1);
-        }
+            for (size_t i = 0; i + 1 < chain.size(); i += 2) {
+                pairs.emplace_back(chain[i], chain[i + 1]);
+                next_round.push_back(chain[i]);
+            }
+            if (chain.size() % 2 == 1) {
+                next_round.push_back(chain.back());
+            }
 
-        if (chain.size() % 2 == 1) {
-            next_round.push_back(chain.back());
+            chain = std::move(next_round);
+            remaining = remaining || chain.size() > 1;
         }
 
-        pool.wait(); // Ensure this round finishes before next
-        chain = std::move(next_round);
+        composePairs(pairs, pool); // ensure this round finishes before next
     }
 }
 
@@ -397,12 +446,6 @@ void parallelCompress(ThreadPool& pool, Node* root) {
     std::vector<std::vector<Node*>> chains;
     collectUnaryFuncChains(root, chains);
 
-    // ThreadPool pool(8);
-    for (auto& chain : chains) {
-        parallelComposeChain(chain, pool);
-    }
-    pool.wait();
+    parallelComposeChains(chains, pool);
     //std::cout << "[parallelCompress] End" << std::endl;
-}
-
-
+}
\ No newline at end of file
@@ -24,7 +24,8 @@ void parallelRake(ThreadPool& pool, Node* root);
 // COMPRESS
 bool isFunctionChainRoot(Node*);
 void collectUnaryFuncChains(Node*, std::vector<std::vector<Node*>>&);
-void parallelComposeChain(std::vector<Node*>&);
+void composePairs(const std::vector<std::pair<Node*, Node*>>&, ThreadPool&);
+void parallelComposeChains(std::vector<std::vector<Node*>>&, ThreadPool&);
 void parallelCompress(ThreadPool&, Node*);
 
 
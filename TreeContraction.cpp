@@ -12,8 +12,9 @@ bool safeParseDouble(const std::string& s, double& val) {
     }
 }
 
+// A function string is "a,b" for a*x + b or "a,b,c,d" for (a*x + b) / (c*x + d)
 bool parseFunctionString(const std::string& s, double& a, double& b) {
-    static std::regex func_pattern(R"(^(-?\d*\.?\d+),(-?\d*\.?\d+)$)");
+    static std::regex func_pattern(R"(^(-?\d*\.?\d+),(-?\d*\.?\d+)(,(-?\d*\.?\d+),(-?\d*\.?\d+))?$)");
     std::smatch matches;
     if (std::regex_match(s, matches, func_pattern)) {
         a = std::stod(matches[1]);
@@ -23,23 +24,43 @@ bool parseFunctionString(const std::string& s, double& a, double& b) {
     return false;
 }
 
-double evaluateFunctionNode(const std::string& func_str, double x) {
-    double da, db;
-    if (parseFunctionString(func_str, da, db)) {
-        int a = static_cast<int>(da);
-        int b = static_cast<int>(db);
-        int ix = static_cast<int>(x);
-        int result = (a * ix + b) % 6101;
-        if (result < 0) result += 6101;
-        return result;
-    }
-    return 0.0;
+// The coefficients of a function string as residues under eval_modulus()
+bool parseFunction(const std::string& s, Mobius& f) {
+    static std::regex func_pattern(R"(^(-?\d*\.?\d+),(-?\d*\.?\d+)(,(-?\d*\.?\d+),(-?\d*\.?\d+))?$)");
+    std::smatch matches;
+    if (!std::regex_match(s, matches, func_pattern)) return false;
+    const Modulus& mod = eval_modulus();
+    f.a = parse_residue(matches[1], mod);
+    f.b = parse_residue(matches[2], mod);
+    f.c = matches[3].matched ? parse_residue(matches[4], mod) : 0;
+    f.d = matches[3].matched ? parse_residue(matches[5], mod) : 1;
+    return true;
+}
+
+// Affine functions keep the short "a,b" form
+std::string functionString(const Mobius& f) {
+    Mobius g = mobius_normalise(f, eval_modulus());
+    std::string s = std::to_string(g.a) + "," + std::to_string(g.b);
+    if (!g.is_affine()) s += "," + std::to_string(g.c) + "," + std::to_string(g.d);
+    return s;
+}
+
+uint64_t evaluateFunctionNode(const std::string& func_str, uint64_t x) {
+    Mobius f;
+    if (parseFunction(func_str, f)) return mobius_apply(f, x, eval_modulus());
+    return 0;
+}
+
+// A leaf that rake may consume; the variable of a partial evaluation is not one.
+static bool rakeable_leaf(Node* node, Node* variable) {
+    return node != variable && node->is_leaf();
 }
 
 void collect_rakeable_nodes(Node* node, 
                            std::vector<Node*>& eval_nodes, 
                            std::vector<Node*>& function_nodes,
-                           std::vector<Node*>& function_eval_nodes) {
+                           std::vector<Node*>& function_eval_nodes,
+                           Node* variable) {
 
     if (!node || node->isDeleted()) return;
 
@@ -52,8 +73,8 @@ void collect_rakeable_nodes(Node* node,
 
     // both children exist/ not deleted
     if (left && right && !left->isDeleted() && !right->isDeleted()) {
-        bool left_leaf = left->is_leaf();
-        bool right_leaf = right->is_leaf();
+        bool left_leaf = rakeable_leaf(left, variable);
+        bool right_leaf = rakeable_leaf(right, variable);
 
         // case 1: two leaf children
         if (left_leaf && right_leaf) {
@@ -64,49 +85,43 @@ void collect_rakeable_nodes(Node* node,
         // case 2: one leaf child
         else if ((left_leaf && !right_leaf) || (!left_leaf && right_leaf)) {
             function_nodes.push_back(node);
-            if (!left_leaf) collect_rakeable_nodes(left, eval_nodes, function_nodes, function_eval_nodes);
-            if (!right_leaf) collect_rakeable_nodes(right, eval_nodes, function_nodes, function_eval_nodes);
+            if (!left_leaf) collect_rakeable_nodes(left, eval_nodes, function_nodes, function_eval_nodes, variable);
+            if (!right_leaf) collect_rakeable_nodes(right, eval_nodes, function_nodes, function_eval_nodes, variable);
             return;
         }
     }
     // case 3
     if (node->is_function()) {
     // Handle left child
-        if (left && !left->isDeleted() && left->is_leaf() &&
+        if (left && !left->isDeleted() && rakeable_leaf(left, variable) &&
             (!right || right->isDeleted())) {
             function_eval_nodes.push_back(node);
             return;
         }
 
         // Handle right child
-        if (right && !right->isDeleted() && right->is_leaf() &&
+        if (right && !right->isDeleted() && rakeable_leaf(right, variable) &&
             (!left || left->isDeleted())) {
             function_eval_nodes.push_back(node);
             return;
         }
     }
 
-    if (left && !left->isDeleted()) collect_rakeable_nodes(left, eval_nodes, function_nodes, function_eval_nodes);
-    if (right && !right->isDeleted()) collect_rakeable_nodes(right, eval_nodes, function_nodes, function_eval_nodes);
+    if (left && !left->isDeleted()) collect_rakeable_nodes(left, eval_nodes, function_nodes, function_eval_nodes, variable);
+    if (right && !right->isDeleted()) collect_rakeable_nodes(right, eval_nodes, function_nodes, function_eval_nodes, variable);
 }
 
 void composeFunctions(Node* first, Node* second) {
-    double a1, b1, a2, b2;
-    if (!parseFunctionString(first->getString(), a1, b1)) return;
-    if (!parseFunctionString(second->getString(), a2, b2)) return;
-
-    int ia1 = static_cast<int>(a1);
-    int ib1 = static_cast<int>(b1);
-    int ia2 = static_cast<int>(a2);
-    int ib2 = static_cast<int>(b2);
+    Mobius f, g;
+    if (!parseFunction(first->getString(), f)) return;
+    if (!parseFunction(second->getString(), g)) return;
 
-    int a = (ia1 * ia2) % 6101;
-    int b = (ia1 * ib2 + ib1) % 6101;
-
-    // Ensure positive modulo if needed
-    if (b < 0) b += 6101;
+    setComposedFunction(first, second, mobius_compose(f, g, eval_modulus()));
+}
 
-    first->setString(std::to_string(a) + "," + std::to_string(b));
+// first becomes f (already composed with second) and second leaves the chain
+void setComposedFunction(Node* first, Node* second, const Mobius& f) {
+    first->setString(functionString(f));
     first->setEval(0.0);
 
     // remove second node from the chain
@@ -126,28 +141,27 @@ void composeFunctions(Node* first, Node* second) {
 // --- RAKE --------------------------------------------------------------------------------------
 //------------------------------------------------------------------------------------------------
 
-void rake(Node* root) {
+void rake(Node* root, Node* variable) {
     if (!root || root->isDeleted()) return;
 
     std::vector<Node*> eval_nodes;
     std::vector<Node*> function_nodes; // make into function
     std::vector<Node*> function_eval_nodes;
 
-    collect_rakeable_nodes(root, eval_nodes, function_nodes, function_eval_nodes); // collect rakeable ops
+    collect_rakeable_nodes(root, eval_nodes, function_nodes, function_eval_nodes, variable); // collect rakeable ops
 
     //case 3: evaluate function at leaf child 
     for (Node* node : function_eval_nodes) {
-        double a, b;
-        if (!parseFunctionString(node->getString(), a, b)) continue;
+        if (!node->is_function()) continue;
 
         Node* left = node->getLeftChild();
         Node* right = node->getRightChild();
 
         Node* child = left ? left : right;
-        if (!child || !child->is_leaf()) continue;
+        if (!child || !rakeable_leaf(child, variable)) continue;
 
-        double x = std::stod(child->getString());
-        double val = evaluateFunctionNode(node->getString(), x);
+        uint64_t x = parse_residue(child->getString(), eval_modulus());
+        uint64_t val = evaluateFunctionNode(node->getString(), x);
 
         node->setString(std::to_string(val));
         node->setEval(val);
@@ -165,33 +179,17 @@ void rake(Node* root) {
         Node* right = node->getRightChild();
         std::string op = node->getString();
 
-        bool left_leaf = left->is_leaf();
-        bool right_leaf = right->is_leaf();
+        bool left_leaf = rakeable_leaf(left, variable);
 
-        std::string func;
+        Node* leaf = left_leaf ? left : right;
+        const Modulus& mod = eval_modulus();
+        Mobius f = operator_function(op, left_leaf, parse_residue(leaf->getString(), mod), 1, mod);
 
-        if (left_leaf && !right_leaf) {
-            if (op == "+") func = "1," + left->getString(); // 5 + x --> 1,5
-            if (op == "-") func = "-1," + left->getString(); // 5 - x --> -1,5
-            if (op == "*") func = left->getString() + ",0"; // 5 * x --> 5,0
-            node->setString(func);
-            node->setEval(0.0);
-            left->markDeleted();
-            node->setLeftChild(nullptr);
-
-        }
-        else if (!left_leaf && right_leaf) {
-            if (op == "+") func = "1," + right->getString(); // x + 5 --> 1,5
-            double val;
-            if (safeParseDouble(right->getString(), val)) {
-                func = "1," + std::to_string(-val);  // avoids --5
-            }
-            if (op == "*") func = right->getString() + ",0"; // x * 5 --> 5,0
-            node->setString(func);
-            node->setEval(0.0);
-            right->markDeleted();
-            node->setRightChild(nullptr);
-        }
+        node->setString(functionString(f));
+        node->setEval(0.0);
+        leaf->markDeleted();
+        if (left_leaf) node->setLeftChild(nullptr);
+        else node->setRightChild(nullptr);
     }
 
     // Case 1: Evaluate both-leaf nodes
@@ -199,15 +197,8 @@ void rake(Node* root) {
         
         Node* left = node->getLeftChild();
         Node* right = node->getRightChild();
-        std::string op = node->getString();
-
-        double l = std::stod(left->getString());
-        double r = std::stod(right->getString());
-        double res = 0.0;
-
-        if (op == "+") res = static_cast<int>(l + r) % 6101;
-        else if (op == "-") res = ((static_cast<int>(l - r) % 6101 + 6101) % 6101);
-        else if (op == "*") res = (static_cast<int>(l * r) % 6101);
+        const EvalCore<ResidueDomain<Modulus>> core(ResidueDomain<Modulus>{eval_modulus()});
+        uint64_t res = core.apply(node, core.leaf(left), core.leaf(right));
 
         node->setString(std::to_string(res));
         node->setEval(res);
@@ -229,9 +220,7 @@ void compress(Node* root) {
     compress(root->getRightChild());
 
     // If root is function node with exactly one child which is also function node, compose
-    double a, b;
-    if (!root->is_leaf() &&
-        parseFunctionString(root->getString(), a, b)) {
+    if (!root->is_leaf() && root->is_function()) {
 
         Node* child = nullptr;
         if (root->getLeftChild() && !root->getRightChild())
@@ -239,7 +228,7 @@ void compress(Node* root) {
         else if (!root->getLeftChild() && root->getRightChild())
             child = root->getRightChild();
 
-        if (child && parseFunctionString(child->getString(), a, b)) {
+        if (child && child->is_function()) {
             // Compose root and child
             composeFunctions(root, child);
 
@@ -249,5 +238,38 @@ void compress(Node* root) {
     }
 }
 
+// --- PARTIAL EVALUATION ------------------------------------------------------------------------
+//------------------------------------------------------------------------------------------------
 
+static size_t live_nodes(Node* node) {
+    if (!node || node->isDeleted()) return 0;
+    return 1 + live_nodes(node->getLeftChild()) + live_nodes(node->getRightChild());
+}
 
+// The path from the root to the variable is all that survives the rakes; each node on it
+// turns into a function of its child on the path once its other child is a value, and
+// compress folds those into one.
+Mobius contract_to_variable(Node* root, Node* variable) {
+    if (!root || !variable || variable->isDeleted() || !variable->is_leaf()) {
+        throw std::invalid_argument("contract_to_variable needs a leaf of the tree as the variable");
+    }
+    size_t previous = live_nodes(root);
+    while (root != variable) {
+        Node* left = root->getLeftChild();
+        Node* right = root->getRightChild();
+        const bool only_variable = (left == variable && !right) || (right == variable && !left);
+        Mobius f;
+        if (only_variable && parseFunction(root->getString(), f)) return f;
+        if (root->is_leaf()) {
+            throw std::invalid_argument("contract_to_variable: the variable is not in the tree");
+        }
+
+        rake(root, variable);
+        compress(root);
+
+        const size_t active = live_nodes(root);
+        if (active >= previous) throw std::runtime_error("contract_to_variable made no progress");
+        previous = active;
+    }
+    return Mobius{};
+}
@@ -1,4 +1,5 @@
 #include "Tree.h"
+#include "EvalCore.h"
 
 #include <vector>
 #include <limits>
@@ -6,17 +7,27 @@
 #include <iostream>
 #include <string>
 
-// rake
-void collect_rakeable_nodes(Node*, std::vector<Node*>&, std::vector<Node*>&, std::vector<Node*>&);
-double evaluateFunctionNode(const std::string&, double);
-void rake(Node*);
+// rake; a variable leaf is never raked, so the nodes above it become functions of it
+void collect_rakeable_nodes(Node*, std::vector<Node*>&, std::vector<Node*>&, std::vector<Node*>&,
+                            Node* variable = nullptr);
+uint64_t evaluateFunctionNode(const std::string&, uint64_t);
+void rake(Node*, Node* variable = nullptr);
 
 // compress
 bool parseFunctionString(const std::string&, double&, double&); 
+bool parseFunction(const std::string&, Mobius&);
+std::string functionString(const Mobius&);
 void composeFunctions(Node*, Node*);
+void setComposedFunction(Node*, Node*, const Mobius&);
 void compress(Node*);
 
 void contractTree(Node*);
 
+// Partial evaluation: rakes and compresses everything but the leaf `variable`, in place,
+// and returns f such that the tree's value is f(x) when that leaf holds x (modulo
+// eval_modulus()). f is affine (c = 0, d = 1) unless a division depends on x. Each value
+// of x then costs one mobius_apply.
+Mobius contract_to_variable(Node* root, Node* variable);
+
 
 
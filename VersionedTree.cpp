@@ -0,0 +1,192 @@
+#include "VersionedTree.h"
+#include "EvalCore.h"
+
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include <thread>
+#include <unordered_set>
+
+static bool live(Node* child) { return child && !child->isDeleted(); }
+
+static void delete_nodes(Node* root) {
+    std::vector<Node*> stack;
+    if (root) stack.push_back(root);
+    while (!stack.empty()) {
+        Node* node = stack.back();
+        stack.pop_back();
+        if (live(node->getLeftChild())) stack.push_back(node->getLeftChild());
+        if (live(node->getRightChild())) stack.push_back(node->getRightChild());
+        delete node;
+    }
+}
+
+VersionedTree::VersionedTree(Node* root) {
+    if (!root) throw std::invalid_argument("VersionedTree needs a root");
+
+    // copy in preorder, numbering the copies as list_nodes would
+    std::vector<Node*> copies;
+    std::vector<std::pair<Node*, Node*>> stack{{root, nullptr}}; // source, parent copy
+    std::vector<bool> is_left{false};
+    while (!stack.empty()) {
+        auto [source, up] = stack.back();
+        const bool left = is_left.back();
+        stack.pop_back();
+        is_left.pop_back();
+
+        Node* copy = new Node(source->getString());
+        copy->setId(static_cast<int>(copies.size()));
+        copies.push_back(copy);
+        if (up) {
+            if (left) up->setLeftChild(copy);
+            else up->setRightChild(copy);
+        }
+        if (live(source->getRightChild())) {
+            stack.push_back({source->getRightChild(), copy});
+            is_left.push_back(false);
+        }
+        if (live(source->getLeftChild())) {
+            stack.push_back({source->getLeftChild(), copy});
+            is_left.push_back(true);
+        }
+    }
+
+    subtree_size.assign(copies.size(), 1);
+    for (size_t v = copies.size(); v-- > 0;) {
+        Node* node = copies[v];
+        if (live(node->getLeftChild())) subtree_size[v] += subtree_size[node->getLeftChild()->getId()];
+        if (live(node->getRightChild())) subtree_size[v] += subtree_size[node->getRightChild()->getId()];
+    }
+
+    current.store(new Version{copies[0], 0});
+}
+
+VersionedTree::~VersionedTree() {
+    Version* v = current.load();
+    delete_nodes(v->root);
+    delete v;
+    for (Retired& r : retired) {
+        for (Node* node : r.nodes) delete node;
+        delete r.version;
+    }
+}
+
+// -- READERS ----------------------------------------------------------------------------
+// A reader stores the epoch it saw into a free slot before loading the version, so any
+// writer that retires this version afterwards sees the slot when it scans.
+// ---------------------------------------------------------------------------------------
+
+VersionedTree::Snapshot VersionedTree::snapshot() const {
+    static thread_local const size_t start = std::hash<std::thread::id>()(std::this_thread::get_id()) % MAX_READERS;
+    while (true) {
+        for (size_t k = 0; k < MAX_READERS; ++k) {
+            const size_t i = (start + k) % MAX_READERS;
+            uint64_t free_slot = 0;
+            if (slots[i].epoch.load(std::memory_order_relaxed) != 0) continue;
+            if (slots[i].epoch.compare_exchange_strong(free_slot, global_epoch.load())) {
+                const Version* v = current.load();
+                return Snapshot(this, i, v->root, v->number);
+            }
+        }
+        std::this_thread::yield(); // every slot taken
+    }
+}
+
+VersionedTree::Snapshot::Snapshot(Snapshot&& other) noexcept
+    : tree(other.tree), slot(other.slot), root(other.root), number(other.number) {
+    other.tree = nullptr;
+}
+
+VersionedTree::Snapshot::~Snapshot() {
+    if (tree) tree->slots[slot].epoch.store(0);
+}
+
+double VersionedTree::Snapshot::evaluate() const {
+    return EvalCore<DoubleDomain>().evaluate(root);
+}
+
+uint64_t VersionedTree::Snapshot::evaluate_residue() const {
+    return with_residue_domain([this](auto domain) {
+        return static_cast<uint64_t>(EvalCore<decltype(domain)>(domain).evaluate(root));
+    });
+}
+
+// -- WRITER -----------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------
+
+void VersionedTree::updateLeaf(int leaf_id, const std::string& value) {
+    updateLeaves({{leaf_id, value}});
+}
+
+void VersionedTree::updateLeaves(const std::vector<std::pair<int, std::string>>& updates) {
+    std::lock_guard<std::mutex> lock(writer_mutex);
+    for (const auto& update : updates) {
+        const int id = update.first;
+        if (id < 0 || id >= static_cast<int>(subtree_size.size()) || subtree_size[id] != 1) {
+            throw std::invalid_argument("VersionedTree::updateLeaf expects the preorder id of a leaf");
+        }
+    }
+    if (updates.empty()) return;
+
+    Version* old = current.load();
+    std::vector<Node*> replaced;
+    std::unordered_set<Node*> fresh; // copies made for this version, still private
+
+    auto own = [&](Node* node) -> Node* {
+        if (fresh.count(node)) return node;
+        // the children stay the published ones' until the walk below replaces them, and
+        // readers may be on them, so their parent is left alone
+        Node* copy = new Node(node->getString());
+        copy->shareChildren(node->getLeftChild(), node->getRightChild());
+        copy->setId(node->getId());
+        fresh.insert(copy);
+        replaced.push_back(node);
+        return copy;
+    };
+
+    Node* root = own(old->root);
+    for (const auto& [id, value] : updates) {
+        Node* node = root;
+        while (node->getId() != id) {
+            Node* left = node->getLeftChild();
+            const bool go_left = id < left->getId() + subtree_size[left->getId()];
+            if (go_left) {
+                Node* child = own(left);
+                node->setLeftChild(child);
+                node = child;
+            } else {
+                Node* child = own(node->getRightChild());
+                node->setRightChild(child);
+                node = child;
+            }
+        }
+        node->setString(value);
+    }
+
+    current.store(new Version{root, old->number + 1});
+    published.store(old->number + 1);
+    retired.push_back({global_epoch.fetch_add(1), std::move(replaced), old});
+    reclaim();
+}
+
+// Frees what was retired before the oldest epoch a reader still announces.
+void VersionedTree::reclaim() {
+    uint64_t oldest = UINT64_MAX;
+    for (const ReaderSlot& s : slots) {
+        const uint64_t e = s.epoch.load();
+        if (e != 0) oldest = std::min(oldest, e);
+    }
+    auto keep = std::partition(retired.begin(), retired.end(), [oldest](const Retired& r) { return r.epoch >= oldest; });
+    for (auto it = keep; it != retired.end(); ++it) {
+        for (Node* node : it->nodes) delete node;
+        delete it->version;
+    }
+    retired.erase(keep, retired.end());
+}
+
+size_t VersionedTree::retired_count() const {
+    std::lock_guard<std::mutex> lock(writer_mutex);
+    size_t count = 0;
+    for (const Retired& r : retired) count += r.nodes.size();
+    return count;
+}
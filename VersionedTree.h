@@ -0,0 +1,95 @@
+#ifndef VERSIONED_TREE_H
+#define VERSIONED_TREE_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include "Node.h"
+
+// A tree that readers evaluate through consistent snapshots while a writer edits leaves.
+//
+// Published nodes are never modified. An edit copies the path from the root to each
+// updated leaf (path copying); everything else is shared with the previous version, and
+// the new root is published with one atomic store. The replaced nodes are retired and
+// freed by epoch-based reclamation: a reader announces the epoch it entered in, and a
+// node retired at epoch r is freed once no reader announced an epoch <= r.
+//
+// Nodes are addressed by their preorder id, as assigned by list_nodes; copies keep it.
+// Parent pointers and eval caches are not meaningful in a versioned tree: readers never
+// write to nodes, so snapshots evaluate without setEval.
+class VersionedTree {
+public:
+    // Takes a deep copy of the tree under root.
+    explicit VersionedTree(Node* root);
+    ~VersionedTree(); // no snapshot may outlive the tree
+
+    VersionedTree(const VersionedTree&) = delete;
+    VersionedTree& operator=(const VersionedTree&) = delete;
+
+    class Snapshot {
+    public:
+        ~Snapshot();
+        Snapshot(Snapshot&& other) noexcept;
+        Snapshot(const Snapshot&) = delete;
+        Snapshot& operator=(const Snapshot&) = delete;
+        Snapshot& operator=(Snapshot&&) = delete;
+
+        Node* getRoot() const { return root; }
+        uint64_t version() const { return number; }
+        double evaluate() const;           // as Tree::evaluate
+        uint64_t evaluate_residue() const; // under eval_modulus(), as the residue engines
+
+    private:
+        friend class VersionedTree;
+        Snapshot(const VersionedTree* tree, size_t slot, Node* root, uint64_t number)
+            : tree(tree), slot(slot), root(root), number(number) {}
+
+        const VersionedTree* tree;
+        size_t slot;
+        Node* root;
+        uint64_t number;
+    };
+
+    // The current version, safe to read until the snapshot is destroyed. Thread safe.
+    Snapshot snapshot() const;
+
+    // Writer side, serialised by a mutex. Applies every (preorder id, value) update to one
+    // new version, copying each affected path once, and publishes it.
+    void updateLeaf(int leaf_id, const std::string& value);
+    void updateLeaves(const std::vector<std::pair<int, std::string>>& updates);
+
+    uint64_t version() const { return published.load(); }
+    size_t retired_count() const; // nodes waiting for readers to leave, freed by the next edit after they do
+
+private:
+    struct Version {
+        Node* root;
+        uint64_t number;
+    };
+    struct alignas(64) ReaderSlot {
+        std::atomic<uint64_t> epoch{0}; // 0 when free
+    };
+    struct Retired {
+        uint64_t epoch;
+        std::vector<Node*> nodes;
+        Version* version;
+    };
+
+    static constexpr size_t MAX_READERS = 128;
+
+    void reclaim();
+
+    std::atomic<Version*> current;
+    std::atomic<uint64_t> published{0};
+    mutable std::atomic<uint64_t> global_epoch{1};
+    mutable ReaderSlot slots[MAX_READERS];
+
+    mutable std::mutex writer_mutex;
+    std::vector<int> subtree_size; // by preorder id; the shape never changes
+    std::vector<Retired> retired;
+};
+
+#endif // VERSIONED_TREE_H
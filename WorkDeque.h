@@ -0,0 +1,96 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Ring size a deque starts with.
+constexpr size_t INITIAL_DEQUE_CAPACITY = 256;
+
+// Chase–Lev deque of T*: the owner pushes and takes at the bottom, thieves take at the top.
+// Rings only grow; replaced ones are kept until the deque goes, as a thief may still be
+// reading one. This is Lê, Pop, Cohen and Zappa Nardelli's C11 version. ThreadPool keeps
+// one per worker.
+template <class T>
+class WorkDeque {
+public:
+    WorkDeque() : top(0), bottom(0) {
+        rings.emplace_back(new Ring(INITIAL_DEQUE_CAPACITY));
+        ring.store(rings.back().get(), std::memory_order_relaxed);
+    }
+    WorkDeque(const WorkDeque&) = delete;
+    WorkDeque& operator=(const WorkDeque&) = delete;
+
+    void push(T* item); // owner only
+    T* take();          // owner only
+    T* steal();         // any thread; null when empty or lost to another taker
+
+    size_t capacity() const { return ring.load(std::memory_order_acquire)->mask + 1; }
+
+private:
+    struct Ring {
+        explicit Ring(size_t capacity) : mask(capacity - 1), slots(capacity) {}
+        size_t mask;
+        std::vector<std::atomic<T*>> slots;
+        T* get(int64_t i) const { return slots[i & mask].load(std::memory_order_acquire); }
+        void put(int64_t i, T* item) { slots[i & mask].store(item, std::memory_order_release); }
+    };
+
+    alignas(64) std::atomic<int64_t> top;
+    alignas(64) std::atomic<int64_t> bottom;
+    std::atomic<Ring*> ring;
+    std::vector<std::unique_ptr<Ring>> rings;
+};
+
+template <class T>
+void WorkDeque<T>::push(T* item) {
+    const int64_t b = bottom.load(std::memory_order_relaxed);
+    const int64_t t = top.load(std::memory_order_acquire);
+    Ring* r = ring.load(std::memory_order_relaxed);
+    if (b - t > static_cast<int64_t>(r->mask)) {
+        Ring* bigger = new Ring(2 * (r->mask + 1));
+        for (int64_t i = t; i < b; ++i) bigger->put(i, r->get(i));
+        rings.emplace_back(bigger);
+        ring.store(bigger, std::memory_order_release);
+        r = bigger;
+    }
+    r->put(b, item);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom.store(b + 1, std::memory_order_relaxed);
+}
+
+template <class T>
+T* WorkDeque<T>::take() {
+    const int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+    Ring* r = ring.load(std::memory_order_relaxed);
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top.load(std::memory_order_relaxed);
+    if (t > b) { // empty
+        bottom.store(b + 1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    T* item = r->get(b);
+    if (t == b) { // the last one: race the thieves for it
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            item = nullptr;
+        }
+        bottom.store(b + 1, std::memory_order_relaxed);
+    }
+    return item;
+}
+
+template <class T>
+T* WorkDeque<T>::steal() {
+    int64_t t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const int64_t b = bottom.load(std::memory_order_acquire);
+    if (t >= b) return nullptr;
+    T* item = ring.load(std::memory_order_acquire)->get(t);
+    if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+        return nullptr; // lost to the owner or another thief
+    }
+    return item;
+}
@@ -0,0 +1,81 @@
+#include "WorkerTeam.h"
+
+// Spins before yielding or parking; rounds are short, so most waits end while spinning.
+constexpr int SPIN_LIMIT = 4096;
+
+WorkerTeam::WorkerTeam(size_t num_threads, Affinity affinity)
+    : num_threads(std::max<size_t>(1, num_threads)), cpus(worker_cpus(affinity, this->num_threads)),
+      local_sense(this->num_threads) {
+    cpus[0] = -1;
+    for (size_t tid = 1; tid < this->num_threads; ++tid) {
+        workers.emplace_back([this, tid]() { worker_loop(tid); });
+    }
+}
+
+WorkerTeam::~WorkerTeam() {
+    {
+        std::lock_guard<std::mutex> lock(park_mutex);
+        stop = true;
+    }
+    park_cv.notify_all();
+    for (std::thread& worker : workers) worker.join();
+}
+
+void WorkerTeam::dispatch(Trampoline fn, void* ctx) {
+    std::lock_guard<std::mutex> run_lock(run_mutex);
+    body_fn = fn;
+    body_ctx = ctx;
+    running.store(num_threads - 1, std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> lock(park_mutex);
+        generation.fetch_add(1, std::memory_order_release);
+    }
+    park_cv.notify_all();
+
+    fn(ctx, 0);
+
+    for (int spins = 0; running.load(std::memory_order_acquire) != 0; ++spins) {
+        if (spins > SPIN_LIMIT) std::this_thread::yield();
+    }
+}
+
+void WorkerTeam::worker_loop(size_t tid) {
+    pin_current_thread(cpus[tid]);
+    uint64_t seen = 0;
+    while (true) {
+        // spin for the next run, then park
+        int spins = 0;
+        while (generation.load(std::memory_order_acquire) == seen && !stop && spins < SPIN_LIMIT) ++spins;
+        if (generation.load(std::memory_order_acquire) == seen) {
+            std::unique_lock<std::mutex> lock(park_mutex);
+            park_cv.wait(lock, [&]() { return stop || generation.load(std::memory_order_acquire) != seen; });
+            if (stop) return;
+        }
+        seen = generation.load(std::memory_order_acquire);
+
+        body_fn(body_ctx, tid);
+        running.fetch_sub(1, std::memory_order_release);
+    }
+}
+
+void WorkerTeam::barrier(size_t tid) {
+    const bool my_sense = !local_sense[tid].value;
+    local_sense[tid].value = my_sense;
+
+    if (arrived.fetch_add(1, std::memory_order_acq_rel) == num_threads - 1) {
+        arrived.store(0, std::memory_order_relaxed);
+        sense.store(my_sense, std::memory_order_release);
+        return;
+    }
+    for (int spins = 0; sense.load(std::memory_order_acquire) != my_sense; ++spins) {
+        if (spins > SPIN_LIMIT) std::this_thread::yield();
+    }
+}
+
+WorkerTeam* DEFAULT_TEAM_OVERRIDE = nullptr;
+
+WorkerTeam& default_team() {
+    if (DEFAULT_TEAM_OVERRIDE) return *DEFAULT_TEAM_OVERRIDE;
+    static WorkerTeam team;
+    return team;
+}
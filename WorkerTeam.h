@@ -0,0 +1,98 @@
+#ifndef WORKER_TEAM_H
+#define WORKER_TEAM_H
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include "CpuTopology.h"
+
+// A fixed team of threads that lives across many parallel phases.
+// run(body) executes body(tid) on every member, the calling thread being member 0, and
+// members synchronise inside a body with barrier(tid). Between runs the workers spin
+// briefly and then park, so a round costs a wake-up and a barrier, not thread creation.
+// Runs from different threads are serialised by run_mutex, so default_team() can be
+// reached from several requests at once; each waits for the team. Bodies must not call
+// run() on the same team again.
+//
+// Members 1.. are pinned following affinity (see CpuTopology.h); member 0, the caller,
+// stays where it is. parallel_for gives member tid the same block every time, so arrays
+// first touched through the team sit on the node of the member that uses them.
+class WorkerTeam {
+public:
+    explicit WorkerTeam(size_t num_threads = std::max(1u, std::thread::hardware_concurrency()),
+                        Affinity affinity = WORKER_AFFINITY);
+    ~WorkerTeam();
+    WorkerTeam(const WorkerTeam&) = delete;
+    WorkerTeam& operator=(const WorkerTeam&) = delete;
+
+    size_t size() const { return num_threads; }
+    // The CPU each member is pinned to, -1 where unpinned (always member 0).
+    const std::vector<int>& placement() const { return cpus; }
+
+    template <typename Body>
+    void run(Body&& body);
+
+    // Sense-reversing barrier for the members of a run.
+    void barrier(size_t tid);
+
+    // Calls worker(tid, start, end) over [0, n), one contiguous block per member.
+    // tid identifies the calling member, e.g. to pick a ShardedCounter shard.
+    template <typename Worker>
+    void parallel_for(size_t n, Worker&& worker);
+
+private:
+    using Trampoline = void (*)(void*, size_t);
+
+    void dispatch(Trampoline fn, void* ctx);
+    void worker_loop(size_t tid);
+
+    size_t num_threads;
+    std::vector<std::thread> workers;
+    std::vector<int> cpus;
+
+    // current run, written by the caller holding run_mutex
+    std::mutex run_mutex;
+    Trampoline body_fn = nullptr;
+    void* body_ctx = nullptr;
+    std::atomic<uint64_t> generation{0};
+    std::atomic<size_t> running{0};
+    std::atomic<bool> stop{false};
+    std::mutex park_mutex;
+    std::condition_variable park_cv;
+
+    // barrier
+    struct alignas(64) LocalSense { bool value = false; };
+    std::vector<LocalSense> local_sense;
+    alignas(64) std::atomic<size_t> arrived{0};
+    alignas(64) std::atomic<bool> sense{false};
+};
+
+// Team shared by the round-based algorithms; created on first use and kept for the process.
+// While DEFAULT_TEAM_OVERRIDE is set, default_team() returns that team instead, e.g. to
+// run the same rounds on teams of other sizes. Change it only between rounds.
+extern WorkerTeam* DEFAULT_TEAM_OVERRIDE;
+WorkerTeam& default_team();
+
+template <typename Body>
+void WorkerTeam::run(Body&& body) {
+    using B = std::remove_reference_t<Body>;
+    dispatch([](void* ctx, size_t tid) { (*static_cast<B*>(ctx))(tid); }, &body);
+}
+
+template <typename Worker>
+void WorkerTeam::parallel_for(size_t n, Worker&& worker) {
+    if (n == 0) return;
+    const size_t block = (n + num_threads - 1) / num_threads;
+    run([&](size_t tid) {
+        const size_t start = std::min(n, tid * block);
+        const size_t end = std::min(n, start + block);
+        if (start < end) worker(tid, start, end);
+    });
+}
+
+#endif // WORKER_TEAM_H
@@ -1,40 +1,26 @@
 #include <iostream>
 #include <chrono>
 #include <atomic>
+#include <algorithm>
+#include <vector>
+#include <stdexcept>
 #include "Tree.h"
-
-constexpr int LARGE_PRIME = 6101; 
+#include "randomised.h"
+#include "EvalCore.h"
+#include "HashCons.h"
+#include "SubtreeCache.h"
+#include "PreparedExpression.h"
 
 Tree full_tree_constructor(int n);
 Tree random_tree_constructor(int n);
 Tree most_unbalanced_tree_constructor(int height);
 std::vector<Node*> list_nodes(Tree& tree);
 double evaluate_parallel(Node* node, int MAX_THREADS);
-void randomized_contract(std::vector<Node*>& nodes, Node* root, std::atomic<int>& active_node_count); //randomized_tree_evaluation(std::vector<Node*>& nodes, Node* root);
-void optimal_randomised_tree_evaluation_algorithm(std::vector<Node*>& nodes, Tree* tree);
-int count_active_nodes(const std::vector<Node*>& nodes);
+double evaluate_parallel_cached(Node* root, int MAX_THREADS, SubtreeCache& cache);
 
 double evaluate_serial(Node* node) {
     if (!node) return 0;
-    if (node->hasValue()) return node->getEval();
-    if (node->is_leaf() && !node->is_op()) {
-        double val = std::stod(node->getString());
-        node->setEval(val);
-        return val;
-    }
-
-    double left = evaluate_serial(node->getLeftChild());
-    double right = evaluate_serial(node->getRightChild());
-    double result = 0;
-
-    std::string op = node->getString();
-    if (op == "+") result = std::fmod(left + right, static_cast<double>(LARGE_PRIME));
-    else if (op == "-") result = std::fmod(left - right, static_cast<double>(LARGE_PRIME));
-    else if (op == "*") result = std::fmod(left * right, static_cast<double>(LARGE_PRIME));
-    else if (op == "/") result = (right != 0 ? std::fmod(left / right, static_cast<double>(LARGE_PRIME)) : std::numeric_limits<double>::infinity());
-
-    node->setEval(result);
-    return result;
+    return EvalCore<DoubleDomain>().evaluate_cached(node);
 }
 
 int main() {
@@ -66,21 +52,79 @@ int main() {
             std::cout << "Parallel Time: " << elapsed_parallel.count() << " seconds\n";
         }
 
+        // --- Subtree Cache Timer ---
+        // The first pass fills the cache; a repeated request is answered from it.
+        for (int pass = 0; pass < 2; pass++) {
+            auto start_cached = std::chrono::high_resolution_clock::now();
+            double result_cached = evaluate_through_cache(tree.root);
+            auto end_cached = std::chrono::high_resolution_clock::now();
+            std::chrono::duration<double> elapsed_cached = end_cached - start_cached;
+            std::cout << "Cached Result (pass " << pass + 1 << "): " << result_cached << "\n";
+            std::cout << "Cached Time (pass " << pass + 1 << "): " << elapsed_cached.count() << " seconds\n";
+        }
+        std::cout << "Cached Parallel Result: " << evaluate_parallel_cached(tree.root, 2, subtree_cache()) << "\n";
+        SubtreeCache::Stats cache_stats = subtree_cache().stats();
+        std::cout << "Subtree Cache: " << cache_stats.hits << " hits, " << cache_stats.misses << " misses, "
+                  << cache_stats.entries << " entries\n";
+
+        // --- Hash-Consing Timer ---
+        // Identical subexpressions of a copy are merged, so the cached evaluation visits
+        // each distinct one once.
+        {
+            Tree shared(tree.copy_subtree(tree.root));
+            auto start_consed = std::chrono::high_resolution_clock::now();
+            HashConsStats cons_stats = hash_cons(shared);
+            double result_consed = evaluate_serial(shared.root);
+            auto end_consed = std::chrono::high_resolution_clock::now();
+            std::chrono::duration<double> elapsed_consed = end_consed - start_consed;
+            std::cout << "Hash-Consed Result: " << result_consed << " (" << cons_stats.nodes_before << " -> "
+                      << cons_stats.nodes_after << " nodes)\n";
+            std::cout << "Hash-Consed Time: " << elapsed_consed.count() << " seconds\n";
+        }
+
+        // --- Prepared Batch Timer ---
+        // One compiled program evaluated over many leaf assignments, here copies of the
+        // tree's own leaves stored column-major, instead of rebuilding and re-evaluating.
+        {
+            const size_t instances = 10000;
+            auto start_prepared = std::chrono::high_resolution_clock::now();
+            PreparedExpression prepared(tree.root);
+            std::vector<double> params(prepared.parameter_count() * instances);
+            for (size_t k = 0; k < prepared.parameter_count(); k++) {
+                std::fill_n(params.begin() + k * instances, instances, prepared.tree_parameters()[k]);
+            }
+            std::vector<double> values(instances);
+            prepared.evaluate_batch(params.data(), instances, values.data());
+            auto end_prepared = std::chrono::high_resolution_clock::now();
+            std::chrono::duration<double> elapsed_prepared = end_prepared - start_prepared;
+            std::cout << "Prepared Batch Result: " << values.back() << " (" << instances << " instances)\n";
+            std::cout << "Prepared Batch Time: " << elapsed_prepared.count() << " seconds\n";
+        }
+
+        // --- Worker Placement (set WORKER_AFFINITY before the team is first used to pin) ---
+        std::cout << "CPUs: " << cpu_topology().size() << " on " << numa_node_count() << " NUMA node(s), team: "
+                  << describe_placement(default_team().placement()) << "\n";
+        FirstTouchArray<uint64_t> probe;
+        probe.first_touch(nodes.size(), 0);
+        std::cout << "First-touch pages per node:";
+        for (size_t pages : page_nodes(probe.data(), nodes.size() * sizeof(uint64_t))) std::cout << " " << pages;
+        std::cout << "\n";
+
         // --- Randomised Parallel Evaluation Timer ---
+        // Contraction consumes the tree it runs on, so it gets a copy and the optimal
+        // algorithm below starts from the whole tree.
+        Tree contracted(tree.copy_subtree(tree.root));
+        std::vector<Node*> contracted_nodes = list_nodes(contracted);
 
         auto start = std::chrono::high_resolution_clock::now();
 
-        // 1. Call randomized contraction
-        std::atomic<int> active_node_count(count_active_nodes(nodes));
-        randomized_contract(nodes, tree.root, active_node_count);
-
-        // 2. Find the final surviving node and evaluate
-        for (Node* node : nodes) {
-            if (node && !node->isDeleted()) {
-                evaluate_serial(node);  // This must be called here
-                std::cout << "Randomised Parallel Result: " << node->getEval() << std::endl;
-                break;
-            }
+        // Contraction carries the values itself, as residues modulo eval_modulus(), so a
+        // divisor that is a multiple of the modulus leaves the result undefined
+        std::cout << "Randomised Parallel Result (mod " << eval_modulus().value() << "): ";
+        try {
+            std::cout << randomized_tree_evaluation(contracted_nodes, contracted.root) << std::endl;
+        } catch (const std::domain_error&) {
+            std::cout << "undefined (division by zero)" << std::endl;
         }
         auto end = std::chrono::high_resolution_clock::now();
         std::chrono::duration<double> time_taken = end - start;
@@ -91,12 +135,18 @@ int main() {
         // Make a fresh copy of the nodes vector (since nodes may be modified in-place)
         std::vector<Node*> nodes_opt = list_nodes(tree);  // or however you get the full node list
         // Call the optimal randomized tree evaluation algorithm
-        optimal_randomised_tree_evaluation_algorithm(nodes_opt, &tree);
+        optimal_randomised_tree_evaluation_algorithm(nodes_opt);
         // Find and evaluate the final surviving node
         for (Node* node : nodes_opt) {
             if (node && !node->isDeleted()) {
-                evaluate_serial(node);
-                std::cout << "Optimal Randomised Result: " << node->getEval() << std::endl;
+                // the sampled rounds carry no values, so an operator may be left with its
+                // operands raked away
+                std::cout << "Optimal Randomised Result: ";
+                try {
+                    std::cout << evaluate_serial(node) << std::endl;
+                } catch (const std::invalid_argument&) {
+                    std::cout << "none (operands contracted away)" << std::endl;
+                }
                 break;
             }
         }
@@ -115,5 +165,5 @@ int main() {
     return 0;
 }
 
-// clang++ -std=c++17 -Xpreprocessor -fopenmp -I/opt/homebrew/include -L/opt/homebrew/lib -lomp main.cpp Tree.cpp Node.cpp tree_constructor.cpp divide_and_conquer.cpp randomised.cpp -std=c++17 -pthread -o main
+// clang++ -std=c++17 -Xpreprocessor -fopenmp -I/opt/homebrew/include -L/opt/homebrew/lib -lomp main.cpp Tree.cpp Node.cpp tree_constructor.cpp divide_and_conquer.cpp randomised.cpp WorkerTeam.cpp HashCons.cpp SubtreeCache.cpp PreparedExpression.cpp CpuTopology.cpp ThreadPool.cpp -std=c++17 -pthread -o main
 // ./main
\ No newline at end of file
@@ -1,5 +1,8 @@
 #include "TreeContrParallel.h"
 #include "tree_constructor2.h"
+#include "CrtLanes.h"
+#include "ContractionSchedule.h"
+#include "Autotune.h"
 
 #include <chrono>
 
@@ -10,30 +13,13 @@ void print_tree(Node* node, int indent = 0) {
     print_tree(node->getLeftChild(), indent + 4);
 }
 
+// Reference evaluation on residues. The domain is fixed once per call by with_residue_domain,
+// so the default prime gets 16-bit constant-folded arithmetic.
 double evaluate_serial(Node* node) {
     if (!node) return 0;
-    if (node->hasValue()) return node->getEval();
-    if (node->is_leaf() && !node->is_op()) {
-        double val = std::stod(node->getString());
-        node->setEval(val);
-        return val;
-    }
-
-    double left = evaluate_serial(node->getLeftChild());
-    double right = evaluate_serial(node->getRightChild());
-    double result = 0;
-    std::string op = node->getString();
-
-    int l = static_cast<int>(left);
-    int r = static_cast<int>(right);
-
-    if (op == "+") result = (l + r) % 6101 ;
-    else if (op == "-") result = ((l - r) % 6101  + 6101 ) % 6101 ;
-    else if (op == "*") result = (l * r) % 6101 ;
-    else if (op == "/") result = (r != 0 ? (l / r) % 6101  : std::numeric_limits<double>::infinity());
-
-    node->setEval(result);
-    return result;
+    return with_residue_domain([node](auto domain) {
+        return static_cast<double>(EvalCore<decltype(domain), RING_OPS>(domain).evaluate_cached(node));
+    });
 }
 
 int main() {
@@ -44,7 +30,7 @@ int main() {
     std::cout << "Tree created :) \n";
 
     
-    Tree tree2 = tree1;
+    Tree tree2(tree1.copy_subtree(tree1.getRoot()));
     Node* root = tree1.getRoot();
 
    // print_tree(root);
@@ -56,14 +42,77 @@ int main() {
     std::cout << "[Serial Recursion] Result: " << result_serial << "\n";
     std::cout << "[Serial Recursion] Time: " << elapsed_serial.count() << " seconds\n";
 
+    // --- Autotune: thread count and grain per engine for this shape, swept once and then
+    // read from the profile file ---
+    Autotuner tuner;
+    const TreeShape shape = measure_shape(root);
+    const bool swept = !tuner.calibrated(TunedEngine::CONTRACTION, shape) || !tuner.calibrated(TunedEngine::REPLAY, shape);
+    const TuneSetting contraction_setting = tuned_setting(tuner, TunedEngine::CONTRACTION, root);
+    const TuneSetting replay_setting = tuned_setting(tuner, TunedEngine::REPLAY, root);
+    apply_setting(TunedEngine::CONTRACTION, contraction_setting);
+    apply_setting(TunedEngine::REPLAY, replay_setting);
+    std::cout << "[Autotune] " << shape_name(shape.shape) << " tree, " << shape.size << " nodes, depth " << shape.depth
+              << (swept ? ", calibrated into " : ", read from ") << AUTOTUNE_PROFILE << "\n";
+    std::cout << "[Autotune] Contraction: " << contraction_setting.threads << " threads, batch " << contraction_setting.grain
+              << "; replay: " << replay_setting.threads << " threads, grain " << replay_setting.grain << "\n";
+
+    // --- CRT lanes: exact value, and the contraction checked modulo each lane prime ---
+    auto start_crt = std::chrono::high_resolution_clock::now();
+    CrtLanes lanes = evaluate_crt(root);
+    auto end_crt = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> elapsed_crt = end_crt - start_crt;
+    std::cout << "[CRT Lanes] Integer value (exact within 2^123): " << crt_to_string(crt_value(lanes)) << "\n";
+    std::cout << "[CRT Lanes] Time: " << elapsed_crt.count() << " seconds\n";
+
+    ThreadPool lane_pool(THREAD_POOL_SIZE);
+    CrtLanes contracted = crt_evaluate_per_lane([&]() {
+        Tree copy(tree1.copy_subtree(root));
+        Node* r = copy.getRoot();
+        while (!r->is_leaf()) {
+            parallelRake(lane_pool, r);
+            parallelCompress(lane_pool, r);
+        }
+        return r->is_function() ? evaluateFunctionNode(r->getString(), 0) : parse_residue(r->getString(), eval_modulus());
+    });
+    std::cout << "[CRT Lanes] Contraction " << (contracted == lanes ? "agrees" : "DISAGREES") << " in every lane\n";
+
+    ThreadPool pool(replay_setting.threads);
+    std::cout << "[Pool] " << pool.size() << " workers: " << describe_placement(pool.placement()) << "\n";
+
+    // --- Recorded schedule: discovery once per shape, then replays for any leaf values ---
+    auto start_record = std::chrono::high_resolution_clock::now();
+    ContractionSchedule schedule(root);
+    auto end_record = std::chrono::high_resolution_clock::now();
+    uint64_t result_replay = schedule.replay(root, pool);
+    auto end_replay = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> elapsed_record = end_record - start_record;
+    std::chrono::duration<double> elapsed_replay = end_replay - end_record;
+    std::cout << "[Schedule] " << schedule.round_count() << " rounds, " << schedule.step_count() << " steps\n";
+    std::cout << "[Schedule] Replay result: " << result_replay << "\n";
+    std::cout << "[Schedule] Record time: " << elapsed_record.count() << " seconds, replay time: "
+              << elapsed_replay.count() << " seconds\n";
+
+    // --- Expand phase: the value of every subtree from the same schedule ---
+    auto start_expand = std::chrono::high_resolution_clock::now();
+    std::vector<uint64_t> subtree_values = schedule.replay_all(root, pool);
+    auto end_expand = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> elapsed_expand = end_expand - start_expand;
+    std::cout << "[Expand] " << subtree_values.size() << " subtree values, root " << subtree_values.front()
+              << ", time: " << elapsed_expand.count() << " seconds\n";
+
+    // --- Two replays submitted to the same pool: each waits on its own tasks only ---
+    ThreadPool::Future<uint64_t> first = pool.submit([&]() { return schedule.replay(root, pool); });
+    ThreadPool::Future<uint64_t> second = pool.submit([&]() { return schedule.replay(root, pool); });
+    std::cout << "[Futures] Replays: " << first.get() << ", " << second.get() << "\n";
+
     auto start_time = std::chrono::high_resolution_clock::now();
-    ThreadPool pool(THREAD_POOL_SIZE);
     std::cout << "No. threads used: " << THREAD_POOL_SIZE;
     std::cout << "\n Size of batch: " << BATCH_SIZE;
 
+    ThreadPool contraction_pool(THREAD_POOL_SIZE);
     while (root && !root->is_leaf()) {
-        parallelRake(pool, root);
-        parallelCompress(pool, root);
+        parallelRake(contraction_pool, root);
+        parallelCompress(contraction_pool, root);
     }
     std::cout << "\n[Final Contracted Tree]\n";
 
@@ -7,6 +7,10 @@
 #include <atomic>
 #include <cmath>
 #include "Tree.h"
+#include "randomised.h"
+#include "CounterRNG.h"
+#include "ParallelPrimitives.h"
+#include "HashCons.h"
 #include <random>
 #include <algorithm>
 #include <iterator>
@@ -14,6 +18,12 @@
 
 std::vector<Node*> list_nodes(Tree& tree);
 
+uint64_t RANDOM_SEED = 0x5EED305;
+
+// streams of the counter-based RNG, so coin flips and samples of one round are independent
+constexpr uint32_t COIN_STREAM = 0;
+constexpr uint32_t SAMPLE_STREAM = 1;
+
 // Arg(v) gives the number of children of v according to resource 2
 int Arg(Node* v) {
     int arg = 0;
@@ -33,136 +43,346 @@ int count_active_nodes(const std::vector<Node*>& nodes) {
     return count;
 }
 
-void dynamic_tree_contraction(std::vector<Node*>& nodes, Node* root, std::atomic<int>& active_node_count) {
-    const int num_threads = std::thread::hardware_concurrency(); // Number of concurrent threads supported
-    // Found at link: https://en.cppreference.com/w/cpp/thread/thread/hardware_concurrency.html
-    std::vector<std::thread> threads;
+static size_t id_bound(const std::vector<Node*>& nodes) {
+    size_t bound = 0;
+    for (Node* v : nodes) {
+        if (v) bound = std::max(bound, static_cast<size_t>(v->getId()) + 1);
+    }
+    return bound;
+}
 
-    auto worker = [&](int start, int end) { // https://www.geeksforgeeks.org/lambda-expression-in-c/
-        for (int i = start; i < end; ++i) {
-            Node* v = nodes[i];
-            if (!v || v->isDeleted()) continue;
+static bool is_live(Node* v) { return v && !v->isDeleted(); }
 
-            int num_children = 0;
-            Node* l = v->getLeftChild();
-            Node* r = v->getRightChild();
-            if (l && !l->isDeleted()) ++num_children;
-            if (r && !r->isDeleted()) ++num_children;
+static int live_children(Node* v) {
+    return is_live(v->getLeftChild()) + is_live(v->getRightChild());
+}
 
-            Node* parent = v->getParent();
-            if (!parent || parent->isDeleted()) continue;
+static Node* only_child(Node* v) {
+    return is_live(v->getLeftChild()) ? v->getLeftChild() : v->getRightChild();
+}
 
-            int num_siblings = 0;
-            if (parent->getLeftChild() && !parent->getLeftChild()->isDeleted()) ++num_siblings;
-            if (parent->getRightChild() && !parent->getRightChild()->isDeleted()) ++num_siblings;
+static bool has_leaf_child(Node* v) {
+    return (is_live(v->getLeftChild()) && live_children(v->getLeftChild()) == 0) ||
+           (is_live(v->getRightChild()) && live_children(v->getRightChild()) == 0);
+}
 
-            if (num_children == 0) {
-                if (parent) parent->mark();
+// What the decide phase of a round wants done to a node.
+// RAKE deletes a leaf, SPLICE removes a unary node by linking its child to its parent.
+enum class Action : uint8_t { KEEP, RAKE, SPLICE };
 
-                if (active_node_count > 1) {
-                    v->markDeleted();
-                    --active_node_count;
-                }
-            } else if (num_children == 1 && num_siblings == 1) {
-                Node* grandparent = parent->getParent();
-                if (!grandparent || grandparent->isDeleted()) continue;
+// Per-node intentions written by the decide phase, indexed by node id.
+// Each node only writes its own slots, so the decide phase never races.
+struct RoundPlan {
+    std::vector<Action> action;
+    std::vector<uint8_t> loses_leaf;  // a child of the node is raked this round
+    std::vector<uint8_t> is_left;     // a spliced node is its parent's left child
+    std::vector<Node*> splice_child;  // the child that takes a spliced node's place
 
-                if (grandparent->getLeftChild() == parent)
-                    grandparent->setLeftChild(v);
-                else if (grandparent->getRightChild() == parent)
-                    grandparent->setRightChild(v);
+    explicit RoundPlan(size_t n) : action(n, Action::KEEP), loses_leaf(n, 0), is_left(n, 0), splice_child(n, nullptr) {}
 
-                v->setParent(grandparent);
-            }
-        }
-    };
+    void decide_rake(Node* v) {
+        loses_leaf[v->getId()] = has_leaf_child(v);
+        if (v->getParent() && live_children(v) == 0) action[v->getId()] = Action::RAKE;
+    }
 
-    int chunk_size = nodes.size() / num_threads;
-    for (int t = 0; t < num_threads; ++t) {
-        int start = t * chunk_size;
-        int end = (t == num_threads - 1) ? nodes.size() : (t + 1) * chunk_size;
-        threads.emplace_back(worker, start, end);
+    void decide_splice(Node* v) {
+        action[v->getId()] = Action::SPLICE;
+        is_left[v->getId()] = v->getParent()->getLeftChild() == v;
+        splice_child[v->getId()] = only_child(v);
     }
+};
+
+ContractionValues::ContractionValues(const std::vector<Node*>& nodes) {
+    const size_t bound = id_bound(nodes);
+    num.first_touch(bound, 0);
+    den.first_touch(bound, 1);
+    fn.first_touch(bound, Mobius{});
+    const Modulus& mod = eval_modulus();
+    parallel_chunks(nodes.size(), [&](size_t, size_t start, size_t end) {
+        for (size_t i = start; i < end; ++i) {
+            Node* v = nodes[i];
+            if (is_live(v) && live_children(v) == 0) num[v->getId()] = parse_residue(v->getString(), mod);
+        }
+    });
+}
 
-    for (auto& thread : threads) thread.join();
+uint64_t ContractionValues::value(Node* v) const {
+    const Modulus& mod = eval_modulus();
+    return mod.mul(num[v->getId()], mod_inv(den[v->getId()], mod));
 }
 
-void randomized_contract(std::vector<Node*>& nodes, Node* root, std::atomic<int>& active_node_count) {
-    const int num_threads = std::thread::hardware_concurrency();
-    std::vector<std::thread> threads;
+// Folds the round into the values of the nodes that survive it, before apply_plan moves
+// any pointer. A survivor writes only its own slots and reads only nodes removed this
+// round (its raked children, its spliced parent), which write nothing, so no two
+// threads touch the same slot.
+static void apply_values(const std::vector<Node*>& nodes, const RoundPlan& plan, ContractionValues& values) {
+    const Modulus& mod = eval_modulus();
+    auto raked = [&](Node* u) { return is_live(u) && plan.action[u->getId()] == Action::RAKE; };
 
-    auto worker = [&](int start, int end) {
-        std::mt19937 rng(std::random_device{}());
-        for (int i = start; i < end; ++i) {
+    parallel_chunks(nodes.size(), [&](size_t, size_t start, size_t end) {
+        for (size_t i = start; i < end; ++i) {
             Node* v = nodes[i];
-            if (!v || v->isDeleted()) continue;
+            if (!is_live(v) || plan.action[v->getId()] != Action::KEEP) continue;
+            const int id = v->getId();
+            Node* left = v->getLeftChild();
+            Node* right = v->getRightChild();
+            const int children = live_children(v);
+            const int raked_children = raked(left) + raked(right);
+
+            if (children == 2 && raked_children == 2) {
+                // both operands are known: v becomes a leaf
+                uint64_t n = values.num[right->getId()], d = values.den[right->getId()];
+                Mobius op = operator_function(v->getString(), true, values.num[left->getId()], values.den[left->getId()], mod);
+                mobius_apply_fraction(op, n, d, mod);
+                mobius_apply_fraction(values.fn[id], n, d, mod);
+                values.num[id] = n;
+                values.den[id] = d;
+            } else if (children == 2 && raked_children == 1) {
+                // one operand is known: v becomes a function of the other
+                Node* leaf = raked(left) ? left : right;
+                Mobius op = operator_function(v->getString(), leaf == left, values.num[leaf->getId()], values.den[leaf->getId()], mod);
+                values.fn[id] = mobius_compose(values.fn[id], op, mod);
+            } else if (children == 1 && raked_children == 1) {
+                // the single child is known: v becomes a leaf
+                Node* leaf = raked(left) ? left : right;
+                uint64_t n = values.num[leaf->getId()], d = values.den[leaf->getId()];
+                mobius_apply_fraction(values.fn[id], n, d, mod);
+                values.num[id] = n;
+                values.den[id] = d;
+            }
 
-            int num_children = 0;
-            Node* l = v->getLeftChild();
-            Node* r = v->getRightChild();
-            if (l && !l->isDeleted()) ++num_children;
-            if (r && !r->isDeleted()) ++num_children;
+            // v takes the place of a spliced parent, so it takes over the parent's function
+            Node* parent = v->getParent();
+            if (parent && plan.action[parent->getId()] == Action::SPLICE) {
+                const Mobius& outer = values.fn[parent->getId()];
+                if (children == raked_children) {
+                    mobius_apply_fraction(outer, values.num[id], values.den[id], mod);
+                } else {
+                    values.fn[id] = mobius_compose(outer, values.fn[id], mod);
+                }
+            }
+        }
+    });
+}
 
-            if (num_children == 0) {
-                Node* parent = v->getParent();
-                if (parent) parent->mark();
+// Apply phase shared by every contraction round. The decide phase guarantees that no two
+// spliced nodes are adjacent and that the root is never removed, so the splices do not
+// conflict and each removed node is counted exactly once.
+static void apply_plan(std::vector<Node*>& nodes, const RoundPlan& plan, std::atomic<int>& active_node_count,
+                       ContractionValues* values) {
+    if (values) apply_values(nodes, plan, *values);
 
-                if (active_node_count > 1) {
-                    v->markDeleted();
-                    --active_node_count;
-                }
-            } else if (num_children == 1) {
-                v->setSex((rng() % 2 == 0) ? Sex::F : Sex::M);
+    ShardedCounter removed;
+    parallel_chunks(nodes.size(), [&](size_t chunk, size_t start, size_t end) {
+        for (size_t i = start; i < end; ++i) {
+            Node* v = nodes[i];
+            if (!is_live(v)) continue;
+            Action action = plan.action[v->getId()];
 
+            if (plan.loses_leaf[v->getId()]) v->mark();
+
+            if (action == Action::RAKE) {
+                v->markDeleted();
+                removed.add(chunk, 1);
+            } else if (action == Action::SPLICE) {
                 Node* parent = v->getParent();
-                if (!parent || parent->isDeleted()) continue;
+                Node* child = plan.splice_child[v->getId()];
+                if (plan.is_left[v->getId()])
+                    parent->setLeftChild(child);
+                else
+                    parent->setRightChild(child);
+                v->markDeleted();
+                removed.add(chunk, 1);
+            }
+        }
+    });
+    active_node_count -= removed.sum();
+}
 
-                if (parent->getSex() == Sex::M && v->getSex() == Sex::F) {
-                    Node* grandparent = parent->getParent();
-                    if (!grandparent || grandparent->isDeleted()) continue;
+void dynamic_tree_contraction(std::vector<Node*>& nodes, std::atomic<int>& active_node_count,
+                              ContractionValues* values) {
+    RoundPlan plan(id_bound(nodes));
 
-                    if (grandparent->getLeftChild() == parent)
-                        grandparent->setLeftChild(v);
-                    else if (grandparent->getRightChild() == parent)
-                        grandparent->setRightChild(v);
+    // decide: rake leaves, splice unary nodes whose child is unary
+    parallel_chunks(nodes.size(), [&](size_t, size_t start, size_t end) {
+        for (size_t i = start; i < end; ++i) {
+            Node* v = nodes[i];
+            if (!is_live(v)) continue;
+            plan.decide_rake(v);
 
-                    v->setParent(grandparent);
+            Node* parent = v->getParent();
+            if (!parent) continue;
+            if (live_children(v) == 1 && live_children(only_child(v)) == 1) {
+                // only if the parent cannot be spliced as well, so splices are never adjacent
+                Node* grandparent = parent->getParent();
+                if (!grandparent || live_children(parent) != 1) {
+                    plan.decide_splice(v);
+                }
+            }
+        }
+    });
+
+    apply_plan(nodes, plan, active_node_count, values);
+}
+
+void randomized_contract(std::vector<Node*>& nodes, std::atomic<int>& active_node_count, int round,
+                         ContractionValues* values) {
+    RoundPlan plan(id_bound(nodes));
 
-                    if (active_node_count > 1) {
-                        parent->markDeleted();
-                        --active_node_count;
-                    }
+    // The coin of any node is a pure function of (seed, round, id), so a node can read
+    // its child's coin without waiting for the child to flip it.
+    auto coin = [&](Node* u) {
+        return counter_coin(RANDOM_SEED, round, u->getId(), COIN_STREAM) ? Sex::M : Sex::F;
+    };
+
+    // decide: a unary M node whose unary child is F is spliced out. Its parent cannot be
+    // spliced too, since that would need this node to be F.
+    parallel_chunks(nodes.size(), [&](size_t, size_t start, size_t end) {
+        for (size_t i = start; i < end; ++i) {
+            Node* v = nodes[i];
+            if (!is_live(v)) continue;
+            plan.decide_rake(v);
+
+            if (live_children(v) == 1) {
+                v->setSex(coin(v));
+                Node* child = only_child(v);
+                if (v->getParent() && v->getSex() == Sex::M &&
+                    live_children(child) == 1 && coin(child) == Sex::F) {
+                    plan.decide_splice(v);
                 }
             }
         }
+    });
+
+    apply_plan(nodes, plan, active_node_count, values);
+}
+
+// Deterministic alternative to the M/F mating of randomized_contract.
+// Unary nodes are 6-coloured by Cole–Vishkin deterministic coin tossing over their ids,
+// and the local colour maxima of every unary chain are spliced out. Local maxima are
+// never adjacent, and at most 10 chain nodes separate two of them, so a constant
+// fraction of each chain is removed every round.
+void deterministic_contract(std::vector<Node*>& nodes, std::atomic<int>& active_node_count,
+                            ContractionValues* values) {
+    const size_t bound = id_bound(nodes);
+    std::vector<uint8_t> unary(bound, 0);
+    std::vector<uint32_t> colour(bound), next_colour(bound);
+    RoundPlan plan(bound);
+
+    auto in_chain = [&](Node* u) {
+        return u && u->getId() >= 0 && static_cast<size_t>(u->getId()) < bound && unary[u->getId()];
     };
 
-    int chunk_size = nodes.size() / num_threads;
-    for (int t = 0; t < num_threads; ++t) {
-        int start = t * chunk_size;
-        int end = (t == num_threads - 1) ? nodes.size() : (t + 1) * chunk_size;
-        threads.emplace_back(worker, start, end);
-    }
+    // 1. snapshot which nodes are unary this round
+    parallel_chunks(nodes.size(), [&](size_t, size_t start, size_t end) {
+        for (size_t i = start; i < end; ++i) {
+            Node* v = nodes[i];
+            if (!is_live(v)) continue;
+            unary[v->getId()] = live_children(v) == 1;
+            colour[v->getId()] = v->getId();
+        }
+    });
+
+    // 2. Cole–Vishkin: recolour with the index and value of the lowest bit that differs
+    // from the parent's colour. Five iterations take 31-bit ids down to 6 colours.
+    // The iterations run in a single dispatch of the team, a barrier apart.
+    constexpr int CV_ITERATIONS = 5;
+    std::vector<uint32_t>* buffer[2] = {&colour, &next_colour};
+    WorkerTeam& team = default_team();
+    const size_t block = (nodes.size() + team.size() - 1) / team.size();
+    team.run([&](size_t tid) {
+        const size_t start = std::min(nodes.size(), tid * block);
+        const size_t end = std::min(nodes.size(), start + block);
+        for (int iter = 0; iter < CV_ITERATIONS; ++iter) {
+            const std::vector<uint32_t>& cur = *buffer[iter % 2];
+            std::vector<uint32_t>& next = *buffer[(iter + 1) % 2];
+            for (size_t i = start; i < end; ++i) {
+                Node* v = nodes[i];
+                if (!in_chain(v)) continue;
+                uint32_t c = cur[v->getId()];
+                Node* p = v->getParent();
+                uint32_t k = 0;
+                if (in_chain(p)) {
+                    k = __builtin_ctz(c ^ cur[p->getId()]);
+                }
+                next[v->getId()] = 2 * k + ((c >> k) & 1);
+            }
+            team.barrier(tid);
+        }
+    });
+    if (CV_ITERATIONS % 2) std::swap(colour, next_colour);
 
-    for (auto& thread : threads) thread.join();
+    // 3. decide: rake leaves, splice the local maxima among unary neighbours
+    parallel_chunks(nodes.size(), [&](size_t, size_t start, size_t end) {
+        for (size_t i = start; i < end; ++i) {
+            Node* v = nodes[i];
+            if (!is_live(v)) continue;
+            plan.decide_rake(v);
+
+            if (!in_chain(v) || !v->getParent()) continue;
+            uint32_t c = colour[v->getId()];
+            Node* p = v->getParent();
+            Node* child = only_child(v);
+            if (live_children(child) == 0) continue; // the child is raked this round
+            if (in_chain(p) && colour[p->getId()] > c) continue;
+            if (in_chain(child) && colour[child->getId()] > c) continue;
+            plan.decide_splice(v);
+        }
+    });
+
+    apply_plan(nodes, plan, active_node_count, values);
 }
 
+CompressMode COMPRESS_MODE = CompressMode::RANDOMIZED;
+
+void contract_round(std::vector<Node*>& nodes, std::atomic<int>& active_node_count, int round,
+                    ContractionValues* values) {
+    if (COMPRESS_MODE == CompressMode::DETERMINISTIC)
+        deterministic_contract(nodes, active_node_count, values);
+    else
+        randomized_contract(nodes, active_node_count, round, values);
+}
 
 
-void randomized_tree_evaluation(std::vector<Node*>& nodes, Node* root) {
+
+uint64_t randomized_tree_evaluation(std::vector<Node*>& nodes, Node* root, int* rounds) {
     int n = nodes.size();
-    int p = n * std::log(std::log(n)) / std::log(n);
     int k = 1;
     const int c = 2;
-    std::atomic<int> active_node_count(count_active_nodes(nodes));
+    ContractionValues values(nodes);
+    std::atomic<int> active_node_count(parallel_compact(nodes, is_live));
     while (k <= c * std::log(std::log(n))) {
         if (active_node_count <= 1) break;
-        dynamic_tree_contraction(nodes, root, active_node_count);
+        dynamic_tree_contraction(nodes, active_node_count, &values);
+        parallel_compact(nodes, is_live);
         k++;
     }
+    int round = 0;
     while (active_node_count > 1) {
-        randomized_contract(nodes, root, active_node_count);
+        contract_round(nodes, active_node_count, round++, &values);
+        parallel_compact(nodes, is_live);
     }
+    if (rounds) *rounds = k - 1 + round;
+    return values.value(root);
+}
+
+uint64_t randomized_tree_evaluation_cached(Tree& tree, SubtreeCache& cache) {
+    if (!tree.getRoot()) return 0;
+    std::vector<Node*> nodes = preorder_nodes(tree.getRoot());
+    const std::vector<SubtreeKey> keys = subtree_keys(nodes, CachedDomain::RESIDUE);
+    for (const auto& [id, value] : cached_subtrees<uint64_t>(keys, cache)) {
+        Node* node = nodes[id];
+        tree.delete_subtree(node->getLeftChild());
+        tree.delete_subtree(node->getRightChild());
+        node->setLeftChild(nullptr);
+        node->setRightChild(nullptr);
+        node->setString(std::to_string(value));
+    }
+
+    nodes = preorder_nodes(tree.getRoot());
+    const uint64_t result = randomized_tree_evaluation(nodes, tree.getRoot());
+    cache.insert(keys[0], result);
+    return result;
 }
 
 std::vector<int> generate_random_permutation(int n) {
@@ -185,47 +405,42 @@ void discard_zeros(std::vector<Node*>& pointers, int x_max) {
     pointers = filtered;
 }
 
-void optimal_randomised_tree_evaluation_algorithm(std::vector<Node*>& nodes, Tree* tree) {
+void optimal_randomised_tree_evaluation_algorithm(std::vector<Node*>& nodes) {
     std::vector<int> x;
     x.push_back(nodes.size());
 
     double alpha = 31.0 / 32.0;
     int k = 0, i = 0;
+    if (nodes.empty()) return;
+    // at least one less each step: below 32 the ceiling alone would stay put
     while (x[i] >= nodes.size() / std::log(nodes.size())) {
-        x.push_back(std::ceil(alpha * x[i]));
+        x.push_back(std::min<int>(x[i] - 1, std::ceil(alpha * x[i])));
         ++i;
     }
-    std::random_device rd;
-    std::mt19937 gen(rd());
+    // after each compaction nodes only holds live nodes, so its size is the active count
+    parallel_compact(nodes, is_live);
     while (k < i) {
-        std::atomic<int> active_node_count(count_active_nodes(nodes));
-        randomized_contract(nodes, tree->root, active_node_count);
-
-        nodes.erase(std::remove_if(nodes.begin(), nodes.end(),
-                    [](Node* n) { return !n || n->isDeleted(); }),
-                    nodes.end());
-
-        std::vector<Node*> sampled;
-        sampled.reserve(x[k + 1]);
-
-        std::vector<int> indices(nodes.size());
-        std::iota(indices.begin(), indices.end(), 0);
-        std::shuffle(indices.begin(), indices.end(), gen);
-
-        for (int j = 0; j < x[k + 1] && j < (int)nodes.size(); ++j) {
-            sampled.push_back(nodes[indices[j]]);
-        }
-
-        nodes = std::move(sampled);
+        std::atomic<int> active_node_count(nodes.size());
+        contract_round(nodes, active_node_count, k);
+
+        // Drop the removed nodes and sample the survivors in the same compaction pass.
+        // Each survivor is kept with probability x[k+1] / active, decided by its
+        // counter-based key, so about x[k+1] nodes remain, the same for any thread count.
+        const double keep_ratio = static_cast<double>(x[k + 1]) / std::max(1, active_node_count.load());
+        const uint64_t threshold = keep_ratio >= 1.0 ? UINT64_MAX
+                                                     : static_cast<uint64_t>(std::ldexp(keep_ratio, 64));
+        parallel_compact(nodes, [&](Node* v) {
+            return is_live(v) && counter_random(RANDOM_SEED, k, v->getId(), SAMPLE_STREAM) <= threshold;
+        });
         ++k;
     }
-    std::atomic<int> active_node_count(count_active_nodes(nodes));
+    std::atomic<int> active_node_count(nodes.size());
     while (active_node_count > 1) {
-        dynamic_tree_contraction(nodes, tree->root, active_node_count);
-        nodes.erase(std::remove_if(nodes.begin(), nodes.end(),
-                    [](Node* n) { return !n || n->isDeleted(); }),
-                    nodes.end());
+        int before = active_node_count;
+        dynamic_tree_contraction(nodes, active_node_count);
+        parallel_compact(nodes, is_live);
+        if (active_node_count == before) break; // nothing left that the sample can contract
     }
 }
 
-// clang++ -std=c++17 -Xpreprocessor -fopenmp -I/opt/homebrew/include -L/opt/homebrew/lib -lomp main.cpp Tree.cpp Node.cpp tree_constructor.cpp divide_and_conquer.cpp randomised.cpp -std=c++17 -pthread -o main
\ No newline at end of file
+// clang++ -std=c++17 -Xpreprocessor -fopenmp -I/opt/homebrew/include -L/opt/homebrew/lib -lomp main.cpp Tree.cpp Node.cpp tree_constructor.cpp divide_and_conquer.cpp randomised.cpp WorkerTeam.cpp -std=c++17 -pthread -o main
\ No newline at end of file
@@ -0,0 +1,60 @@
+#ifndef RANDOMISED_H
+#define RANDOMISED_H
+
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include "Tree.h"
+#include "ModArith.h"
+#include "SubtreeCache.h"
+#include "ParallelPrimitives.h"
+
+// Seed for every random choice made by the randomised algorithms. Coin flips and
+// samples are drawn from CounterRNG.h keyed by (RANDOM_SEED, round, node id), so a
+// run is reproducible bit for bit regardless of the number of threads.
+// Node ids come from list_nodes.
+extern uint64_t RANDOM_SEED;
+
+// How unary chains are compressed: random M/F mating (randomized_contract) or
+// Cole–Vishkin deterministic coin tossing (deterministic_contract), which gives a
+// fixed round count for a given tree.
+enum class CompressMode { RANDOMIZED, DETERMINISTIC };
+extern CompressMode COMPRESS_MODE;
+
+// Values carried through the contraction rounds, indexed by node id, as residues under
+// eval_modulus(). A leaf holds the fraction num / den. Any other node holds a Möbius
+// function fn of what it computes from its live children: op(left, right) while it has
+// two, the value of the remaining child once one is raked. Rounds therefore only multiply
+// matrices, whatever the operators, and the one division happens when a value is read.
+struct ContractionValues {
+    // indexed by node id, first touched by the team members whose blocks hold the ids
+    FirstTouchArray<uint64_t> num, den;
+    FirstTouchArray<Mobius> fn;
+
+    explicit ContractionValues(const std::vector<Node*>& nodes);
+
+    // value of a node contracted to a leaf; throws std::domain_error on division by zero
+    uint64_t value(Node* v) const;
+};
+
+// The round functions update `values` as they contract when it is given. Every live node
+// must be in `nodes`, so the sampled rounds of the optimal algorithm run without values.
+int count_active_nodes(const std::vector<Node*>& nodes);
+void dynamic_tree_contraction(std::vector<Node*>& nodes, std::atomic<int>& active_node_count,
+                              ContractionValues* values = nullptr);
+void randomized_contract(std::vector<Node*>& nodes, std::atomic<int>& active_node_count, int round,
+                         ContractionValues* values = nullptr);
+void deterministic_contract(std::vector<Node*>& nodes, std::atomic<int>& active_node_count,
+                            ContractionValues* values = nullptr);
+void contract_round(std::vector<Node*>& nodes, std::atomic<int>& active_node_count, int round,
+                    ContractionValues* values = nullptr);
+// Contracts the tree to its root and returns the root's value modulo eval_modulus().
+// rounds, when given, receives the number of contraction rounds run.
+uint64_t randomized_tree_evaluation(std::vector<Node*>& nodes, Node* root, int* rounds = nullptr);
+// The same behind the subtree cache: the largest cached subtrees are cut down to leaves
+// holding their residues before contracting, and the root's value is stored. Consumes
+// the tree as randomized_tree_evaluation does, and renumbers it with preorder_nodes.
+uint64_t randomized_tree_evaluation_cached(Tree& tree, SubtreeCache& cache = subtree_cache());
+void optimal_randomised_tree_evaluation_algorithm(std::vector<Node*>& nodes);
+
+#endif // RANDOMISED_H
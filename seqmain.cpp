@@ -1,33 +1,17 @@
 #include "TreeContraction.h"
+#include "IncrementalTree.h"
 #include "tree_constructor2.cpp"
 
 #include <chrono>
+#include <random>
 
+// Reference evaluation on residues. The domain is fixed once per call by with_residue_domain,
+// so the default prime gets 16-bit constant-folded arithmetic.
 double evaluate_serial(Node* node) {
     if (!node) return 0;
-    if (node->hasValue()) return node->getEval();
-    if (node->is_leaf() && !node->is_op()) {
-        double val = std::stod(node->getString());
-        node->setEval(val);
-        return val;
-    }
-
-    double left = evaluate_serial(node->getLeftChild());
-    double right = evaluate_serial(node->getRightChild());
-    double result = 0;
-    std::string op = node->getString();
-
-    int l = static_cast<int>(left);
-    int r = static_cast<int>(right);
-
-
-    if (op == "+") result = (l + r) % 6101;
-    else if (op == "-") result = ((l - r) % 6101 + 6101) % 6101;
-    else if (op == "*") result = (l * r) % 6101;
-    else if (op == "/") result = (r != 0 ? (l / r) % 6101 : std::numeric_limits<double>::infinity());
-
-    node->setEval(result);
-    return result;
+    return with_residue_domain([node](auto domain) {
+        return static_cast<double>(EvalCore<decltype(domain), RING_OPS>(domain).evaluate_cached(node));
+    });
 }
 
 void print_tree(Node* node, int indent = 0) {
@@ -45,7 +29,7 @@ int count_nodes(Node* root) {
 int main() {
     int i = 10000;
     Tree tree1 = full_tree_constructor(i);
-    Tree tree2 = tree1; // clone for fair comparison
+    Tree tree2(tree1.copy_subtree(tree1.getRoot())); // clone for fair comparison
 
     std::cout << "Tree constructed! It has " << i <<" nodes \n";
 
@@ -84,5 +68,54 @@ int main() {
     std::cout << "[Serial Recursion] Result: " << result_serial << "\n";
     std::cout << "[Serial Recursion] Time: " << elapsed_serial.count() << " seconds\n";
 
+    // --- Partial Evaluation (leftmost leaf as the variable) ---
+    Tree tree3 = full_tree_constructor(i);
+    Node* variable = tree3.getRoot();
+    while (variable->getLeftChild()) variable = variable->getLeftChild();
+    const Modulus& mod = eval_modulus();
+    const uint64_t x0 = parse_residue(variable->getString(), mod);
+    const double reference = evaluate_serial(tree3.getRoot());
+
+    auto start_partial = std::chrono::high_resolution_clock::now();
+    Mobius f = contract_to_variable(tree3.getRoot(), variable);
+    auto end_partial = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> elapsed_partial = end_partial - start_partial;
+
+    auto start_queries = std::chrono::high_resolution_clock::now();
+    uint64_t checksum = 0;
+    for (uint64_t x = 0; x < 1000; ++x) {
+        try {
+            checksum = mod.add(checksum, mobius_apply(f, x, mod));
+        } catch (const std::domain_error&) {} // x is a pole of f
+    }
+    auto end_queries = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> elapsed_queries = end_queries - start_queries;
+
+    std::cout << "[Partial] f(x) = " << (f.is_affine() ? "affine" : "linear-fractional")
+              << ", f(" << x0 << ") = " << mobius_apply(f, x0, mod) << " (full evaluation " << reference << ")\n";
+    std::cout << "[Partial] Contraction time: " << elapsed_partial.count() << " seconds\n";
+    std::cout << "[Partial] 1000 queries: " << elapsed_queries.count() << " seconds (checksum " << checksum << ")\n";
+
+    // --- Incremental Updates (1000 random leaf edits) ---
+    Tree tree4 = full_tree_constructor(i);
+    std::vector<Node*> leaves;
+    for (Node* node : list_nodes(tree4)) {
+        if (!node->getLeftChild() && !node->getRightChild()) leaves.push_back(node);
+    }
+    IncrementalTree incremental(tree4.getRoot());
+    std::mt19937 rng(42);
+
+    auto start_updates = std::chrono::high_resolution_clock::now();
+    for (int u = 0; u < 1000; ++u) {
+        incremental.updateLeaf(leaves[rng() % leaves.size()], std::to_string(1 + rng() % 100));
+    }
+    const uint64_t updated = incremental.value();
+    auto end_updates = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> elapsed_updates = end_updates - start_updates;
+
+    std::cout << "[Incremental] Result after 1000 updates: " << updated
+              << " (full evaluation " << evaluate_serial(tree4.getRoot()) << ")\n";
+    std::cout << "[Incremental] 1000 updates: " << elapsed_updates.count() << " seconds\n";
+
     return 0;
 }
\ No newline at end of file
@@ -116,6 +116,7 @@ std::vector<Node*> list_nodes(Tree& tree) {
         Node* current = stack.top();
         stack.pop();
 
+        current->setId(result.size());
         result.push_back(current);
 
         // Push right first so left is processed first
@@ -0,0 +1,1442 @@
+// Checks for the parallel building blocks and the engines built on them. Each section
+// compares against a plain serial computation; main() reports the failed checks and
+// exits non-zero if there are any. Build line in README.md.
+#include "WorkerTeam.h"
+#include "WorkDeque.h"
+#include "ParallelPrimitives.h"
+#include "ModArith.h"
+#include "AffineKernels.h"
+#include "CrtLanes.h"
+#include "EvalCore.h"
+#include "TreeContrParallel.h"
+#include "IncrementalTree.h"
+#include "VersionedTree.h"
+#include "HashCons.h"
+#include "SubtreeCache.h"
+#include "PreparedExpression.h"
+#include "ContractionSchedule.h"
+#include "Autotune.h"
+#include "randomised.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <numeric>
+#include <stdexcept>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+double evaluate_parallel(Node* node, int MAX_THREADS); // divide_and_conquer.cpp
+
+static int failures = 0;
+
+#define CHECK(cond)                                                                           \
+    do {                                                                                      \
+        if (!(cond)) {                                                                        \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond << std::endl; \
+            ++failures;                                                                       \
+        }                                                                                     \
+    } while (0)
+
+// -- TREES ----------------------------------------------------------------------------------
+// Seeded, so a failure can be replayed.
+// -------------------------------------------------------------------------------------------
+
+// leaves + (leaves - 1) nodes, built by merging random pairs as full_tree_constructor does,
+// with integer leaves in [1, max_leaf] and operators drawn from ops.
+static Node* random_tree(size_t leaves, uint64_t seed, const std::string& ops = "+-*", int max_leaf = 1000) {
+    std::mt19937_64 rng(seed);
+    std::vector<Node*> nodes;
+    for (size_t i = 0; i < leaves; ++i) nodes.push_back(new Node(std::to_string(1 + rng() % max_leaf)));
+    while (nodes.size() > 1) {
+        size_t i = rng() % nodes.size();
+        Node* left = nodes[i];
+        nodes[i] = nodes.back();
+        nodes.pop_back();
+        size_t j = rng() % nodes.size();
+        Node* right = nodes[j];
+        nodes[j] = new Node(std::string(1, ops[rng() % ops.size()]), left, right);
+    }
+    return nodes[0];
+}
+
+// A spine of length internal nodes, each with a leaf on a random side.
+static Node* caterpillar(size_t length, uint64_t seed, const std::string& ops, int max_leaf) {
+    std::mt19937_64 rng(seed);
+    Node* node = new Node(std::to_string(1 + rng() % max_leaf));
+    for (size_t i = 0; i < length; ++i) {
+        Node* leaf = new Node(std::to_string(1 + rng() % max_leaf));
+        const std::string op(1, ops[rng() % ops.size()]);
+        node = rng() % 2 ? new Node(op, node, leaf) : new Node(op, leaf, node);
+    }
+    return node;
+}
+
+// Root value modulo eval_modulus(), recursively; throws std::domain_error on a zero divisor.
+static uint64_t serial_residue(Node* root) {
+    return EvalCore<ResidueDomain<Modulus>>(ResidueDomain<Modulus>{eval_modulus()}).evaluate(root);
+}
+
+// parallelRake / parallelCompress to the root, as parallelmain runs them, on a copy.
+static uint64_t contract_residue(Node* root, ThreadPool& pool) {
+    Tree copy(Tree().copy_subtree(root));
+    Node* r = copy.getRoot();
+    while (!r->is_leaf()) {
+        parallelRake(pool, r);
+        parallelCompress(pool, r);
+    }
+    return r->is_function() ? evaluateFunctionNode(r->getString(), 0) : parse_residue(r->getString(), eval_modulus());
+}
+
+// -- WORKER TEAM ----------------------------------------------------------------------------
+// Several threads driving one team at once, as concurrent requests do with default_team().
+// -------------------------------------------------------------------------------------------
+
+static void check_shared_team(WorkerTeam& team) {
+    constexpr size_t N = 10000;
+    std::vector<std::thread> callers;
+    std::atomic<int> bad{0};
+    for (int c = 0; c < 4; ++c) {
+        callers.emplace_back([&, c]() {
+            for (int round = 0; round < 200; ++round) {
+                std::vector<uint64_t> out(N, 0);
+                team.parallel_for(N, [&](size_t, size_t start, size_t end) {
+                    for (size_t i = start; i < end; ++i) out[i] = i * c + round;
+                });
+                // a run with barriers: every member sees the others' first phase
+                std::vector<int> phase(team.size(), 0);
+                std::atomic<int> seen{0};
+                team.run([&](size_t tid) {
+                    phase[tid] = 1;
+                    team.barrier(tid);
+                    for (int p : phase) seen += p;
+                });
+                if (seen.load() != static_cast<int>(team.size() * team.size())) ++bad;
+                for (size_t i = 0; i < N; ++i) {
+                    if (out[i] != i * c + round) {
+                        ++bad;
+                        break;
+                    }
+                }
+            }
+        });
+    }
+    for (std::thread& caller : callers) caller.join();
+    CHECK(bad.load() == 0);
+}
+
+static void test_worker_team() {
+    check_shared_team(default_team());
+    WorkerTeam four(4, Affinity::NONE);
+    check_shared_team(four);
+}
+
+// -- CPU TOPOLOGY ---------------------------------------------------------------------------
+// parse_cpu_list on sysfs-style lists, and worker_cpus over a fixture sysfs tree of two NUMA
+// nodes with two cores each, two SMT threads per core, numbered as Linux does (siblings
+// last): COMPACT fills node 0's cores, then their siblings, then node 1; SCATTER alternates
+// the nodes; more workers than CPUs wrap around.
+// -------------------------------------------------------------------------------------------
+
+static void write_file(const std::filesystem::path& path, const std::string& text) {
+    std::filesystem::create_directories(path.parent_path());
+    std::ofstream(path) << text << "\n";
+}
+
+static void test_cpu_topology() {
+    CHECK(parse_cpu_list("0-3,8,10-11\n") == std::vector<int>({0, 1, 2, 3, 8, 10, 11}));
+    CHECK(parse_cpu_list("5") == std::vector<int>({5}));
+    CHECK(parse_cpu_list("").empty());
+    CHECK(parse_cpu_list("x,2,,4-5") == std::vector<int>({2, 4, 5}));
+
+    // cpu c: node c / 2 % 2, core c % 2, thread c / 4 of its core
+    const std::filesystem::path root = std::filesystem::temp_directory_path() / "unittests-sysfs";
+    std::filesystem::remove_all(root);
+    write_file(root / "cpu" / "online", "0-7");
+    write_file(root / "node" / "node0" / "cpulist", "0-1,4-5");
+    write_file(root / "node" / "node1" / "cpulist", "2-3,6-7");
+    for (int c = 0; c < 8; ++c) {
+        const std::filesystem::path topology = root / "cpu" / ("cpu" + std::to_string(c)) / "topology";
+        write_file(topology / "physical_package_id", std::to_string(c / 2 % 2));
+        write_file(topology / "core_id", std::to_string(c % 2));
+    }
+
+    const std::string saved_root = SYSFS_ROOT;
+    SYSFS_ROOT = root.string();
+    reload_cpu_topology(false); // the fixture's CPUs are not this process's
+    CHECK(cpu_topology().size() == 8);
+    CHECK(numa_node_count() == 2);
+    CHECK(numa_node_of_cpu(6) == 1);
+    CHECK(numa_node_of_cpu(5) == 0);
+    CHECK(worker_cpus(Affinity::COMPACT, 8) == std::vector<int>({0, 1, 4, 5, 2, 3, 6, 7}));
+    CHECK(worker_cpus(Affinity::SCATTER, 8) == std::vector<int>({0, 2, 1, 3, 4, 6, 5, 7}));
+    CHECK(worker_cpus(Affinity::COMPACT, 3) == std::vector<int>({0, 1, 4}));
+    CHECK(worker_cpus(Affinity::COMPACT, 11) == std::vector<int>({0, 1, 4, 5, 2, 3, 6, 7, 0, 1, 4}));
+    CHECK(worker_cpus(Affinity::SCATTER, 10) == std::vector<int>({0, 2, 1, 3, 4, 6, 5, 7, 0, 2}));
+    CHECK(worker_cpus(Affinity::NONE, 3) == std::vector<int>(3, -1));
+    CHECK(describe_placement({0, -1, 7}) == "cpu 0 (node 0), unpinned, cpu 7 (node 1)");
+
+    SYSFS_ROOT = saved_root;
+    reload_cpu_topology();
+    std::filesystem::remove_all(root);
+    CHECK(!cpu_topology().empty());
+}
+
+// -- PARALLEL PRIMITIVES --------------------------------------------------------------------
+// parallel_compact against std::remove_if on teams of 1, 2 and 7 members, for sizes from
+// empty through fewer items than members (empty blocks) to uneven blocks.
+// -------------------------------------------------------------------------------------------
+
+static void test_parallel_compact() {
+    WorkerTeam one(1, Affinity::NONE), two(2, Affinity::NONE), seven(7, Affinity::NONE);
+    std::mt19937_64 rng(29);
+    int bad = 0;
+    for (WorkerTeam* team : {&one, &two, &seven}) {
+        DEFAULT_TEAM_OVERRIDE = team;
+        for (size_t n : {0, 1, 2, 3, 6, 7, 8, 13, 100, 1001}) {
+            for (int keep_one_in : {1, 2, 5, 1000}) {
+                std::vector<uint64_t> items(n);
+                for (uint64_t& item : items) item = rng();
+                auto keep = [&](uint64_t item) { return item % keep_one_in == 0; };
+                std::vector<uint64_t> expected = items;
+                expected.erase(std::remove_if(expected.begin(), expected.end(),
+                                              [&](uint64_t item) { return !keep(item); }),
+                               expected.end());
+                if (parallel_compact(items, keep) != expected.size() || items != expected) ++bad;
+            }
+        }
+    }
+    DEFAULT_TEAM_OVERRIDE = nullptr;
+    CHECK(bad == 0);
+}
+
+// FirstTouchArray filled through teams of 1 and 7; every page of it must be placed.
+static void test_first_touch() {
+    WorkerTeam one(1, Affinity::NONE), seven(7, Affinity::NONE);
+    int bad = 0;
+    for (WorkerTeam* team : {&one, &seven}) {
+        DEFAULT_TEAM_OVERRIDE = team;
+        for (size_t n : {0, 3, 100000}) {
+            FirstTouchArray<uint64_t> array;
+            array.first_touch(n, 42);
+            if (array.size() != n) ++bad;
+            for (size_t i = 0; i < n; ++i) bad += array[i] != 42;
+            const std::vector<size_t> pages = page_nodes(array.data(), n * sizeof(uint64_t));
+            const long page = sysconf(_SC_PAGESIZE);
+            const uintptr_t first = reinterpret_cast<uintptr_t>(array.data()) / page;
+            const uintptr_t last = (reinterpret_cast<uintptr_t>(array.data()) + n * sizeof(uint64_t) + page - 1) / page;
+            // empty where move_pages is not available
+            if (!pages.empty() && std::accumulate(pages.begin(), pages.end(), size_t(0)) != last - first) ++bad;
+        }
+    }
+    DEFAULT_TEAM_OVERRIDE = nullptr;
+    CHECK(bad == 0);
+}
+
+// -- MODULAR ARITHMETIC ---------------------------------------------------------------------
+// Every path of Modulus::mul (Barrett below 2^32, Montgomery for larger odd moduli, 128-bit
+// division for larger even ones), mod_inv and batch_inverse against __int128 arithmetic.
+// -------------------------------------------------------------------------------------------
+
+static uint64_t mul_ref(uint64_t a, uint64_t b, uint64_t p) { return static_cast<uint64_t>(static_cast<u128>(a) * b % p); }
+
+static void check_modulus(uint64_t p) {
+    const Modulus mod(p);
+    std::mt19937_64 rng(p);
+    std::vector<uint64_t> samples = {0, 1, 2, p - 1, p - 2, p / 2, p / 2 + 1};
+    for (int i = 0; i < 2000; ++i) samples.push_back(rng() % p);
+
+    int bad_mul = 0, bad_add = 0, bad_inv = 0;
+    for (size_t i = 0; i < samples.size(); ++i) {
+        const uint64_t a = samples[i], b = samples[(i * 7 + 3) % samples.size()];
+        if (mod.mul(a, b) != mul_ref(a, b, p)) ++bad_mul;
+        if (mod.add(a, b) != static_cast<uint64_t>((static_cast<u128>(a) + b) % p)) ++bad_add;
+        if (mod.sub(a, b) != static_cast<uint64_t>((static_cast<u128>(a) + p - b) % p)) ++bad_add;
+        if (a != 0 && std::gcd(a, p) == 1 && mul_ref(a, mod_inv(a, mod), p) != 1) ++bad_inv;
+    }
+    CHECK(bad_mul == 0);
+    CHECK(bad_add == 0);
+    CHECK(bad_inv == 0);
+    CHECK(mod.reduce(-1) == p - 1);
+    CHECK(mod.reduce(-static_cast<int64_t>(p) - 5) == p - 5);
+
+    bool threw = false;
+    try {
+        mod_inv(0, mod);
+    } catch (const std::domain_error&) {
+        threw = true;
+    }
+    CHECK(threw);
+
+    std::vector<uint64_t> values;
+    for (uint64_t v : samples) {
+        if (v != 0 && std::gcd(v, p) == 1) values.push_back(v);
+    }
+    std::vector<uint64_t> inverses = values;
+    batch_inverse(inverses.data(), inverses.size(), mod);
+    int bad_batch = 0;
+    for (size_t i = 0; i < values.size(); ++i) {
+        if (mul_ref(values[i], inverses[i], p) != 1) ++bad_batch;
+    }
+    CHECK(bad_batch == 0);
+}
+
+static void test_mod_arith() {
+    const uint64_t moduli[] = {
+        LARGE_PRIME,
+        1000000,                        // composite, Barrett
+        (uint64_t(1) << 32) - 5,        // largest Barrett prime
+        (uint64_t(1) << 32) + 15,       // smallest Montgomery prime
+        (uint64_t(1) << 40),            // even, 128-bit division
+        (uint64_t(1) << 62) - 57,
+        (uint64_t(1) << 63) - 25,       // largest prime allowed
+    };
+    for (uint64_t p : moduli) check_modulus(p);
+
+    // the compile-time modulus agrees with the runtime one
+    constexpr uint64_t P = (uint64_t(1) << 62) - 57;
+    const Modulus runtime(P);
+    std::mt19937_64 rng(1);
+    int bad = 0;
+    for (int i = 0; i < 1000; ++i) {
+        const uint64_t a = rng() % P, b = rng() % P;
+        if (StaticModulus<P>::mul(a, b) != runtime.mul(a, b)) ++bad;
+    }
+    CHECK(bad == 0);
+
+    const Modulus small(LARGE_PRIME);
+    for (double x : {0.0, 1.5, -7.25, 6101.0, -6101.0, 123456789.0, -98765432.5, 4.5e15}) {
+        CHECK(small.fmod(x) == std::fmod(x, 6101.0));
+    }
+}
+
+// -- AFFINE KERNELS -------------------------------------------------------------------------
+// compose_affine_batch and apply_affine_batch against scalar Modulus arithmetic. Batches of
+// 0 to 17 maps cover the four-lane AVX2 body, the scalar tail and the step between them for
+// Montgomery moduli (odd, below 2^31), and the generic path for the others.
+// -------------------------------------------------------------------------------------------
+
+static void check_affine_batch(uint64_t p, size_t n, std::mt19937_64& rng, int& bad) {
+    const Modulus mod(p);
+    // one extra slot in front, so the batch does not start on an aligned address
+    auto draw = [&]() {
+        std::vector<uint64_t> v(n + 1);
+        for (uint64_t& c : v) c = rng() % 4 == 0 ? p - 1 - rng() % 2 : rng() % p;
+        return v;
+    };
+    const std::vector<uint64_t> a1 = draw(), b1 = draw(), a2 = draw(), b2 = draw(), x = draw();
+    std::vector<uint64_t> a_out(n + 1), b_out(n + 1), out(n + 1);
+    compose_affine_batch(a1.data() + 1, b1.data() + 1, a2.data() + 1, b2.data() + 1,
+                         a_out.data() + 1, b_out.data() + 1, n, mod);
+    apply_affine_batch(a1.data() + 1, b1.data() + 1, x.data() + 1, out.data() + 1, n, mod);
+    for (size_t i = 1; i <= n; ++i) {
+        if (a_out[i] != mod.mul(a1[i], a2[i])) ++bad;
+        if (b_out[i] != mod.add(mod.mul(a1[i], b2[i]), b1[i])) ++bad;
+        if (out[i] != mod.add(mod.mul(a1[i], x[i]), b1[i])) ++bad;
+    }
+}
+
+static void test_affine_kernels() {
+    const uint64_t moduli[] = {
+        LARGE_PRIME,
+        1000000007,                     // Montgomery
+        (uint64_t(1) << 31) - 1,        // largest Montgomery prime
+        1000000,                        // even: generic
+        (uint64_t(1) << 32) + 15,       // at least 2^31: generic
+    };
+    std::mt19937_64 rng(31);
+    int bad = 0;
+    for (uint64_t p : moduli) {
+        for (size_t n : {0, 1, 3, 4, 5, 17}) check_affine_batch(p, n, rng, bad);
+    }
+    CHECK(bad == 0);
+}
+
+// -- CRT LANES ------------------------------------------------------------------------------
+// evaluate_crt, crt_value and crt_to_string against __int128 evaluation of + - * trees, with
+// negative results and values at the ends of (-M/2, M/2]; crt_evaluate_per_lane puts the
+// modulus back when the engine throws.
+// -------------------------------------------------------------------------------------------
+
+// false when an intermediate value overflows __int128
+static bool int128_value(Node* node, __int128& out) {
+    if (node->is_leaf()) {
+        out = std::stoll(node->getString());
+        return true;
+    }
+    __int128 x, y;
+    if (!int128_value(node->getLeftChild(), x) || !int128_value(node->getRightChild(), y)) return false;
+    switch (node->getString()[0]) {
+    case '+': return !__builtin_add_overflow(x, y, &out);
+    case '-': return !__builtin_sub_overflow(x, y, &out);
+    default: return !__builtin_mul_overflow(x, y, &out);
+    }
+}
+
+// decimal digits back to __int128, to round-trip crt_to_string
+static __int128 parse_int128(const std::string& s) {
+    __int128 v = 0;
+    for (size_t i = s[0] == '-'; i < s.size(); ++i) v = v * 10 + (s[i] - '0');
+    return s[0] == '-' ? -v : v;
+}
+
+static bool crt_matches(Node* root, __int128 expected) {
+    const __int128 got = crt_value(evaluate_crt(root));
+    const std::string text = crt_to_string(got);
+    return got == expected && parse_int128(text) == expected && (text[0] == '-') == (expected < 0);
+}
+
+static void test_crt_lanes() {
+    __int128 m = 1;
+    for (uint64_t p : CRT_PRIMES) m *= p;
+    const __int128 half = m / 2; // M is odd: the range is [-half, half]
+
+    int compared = 0, negative = 0, bad = 0;
+    for (uint64_t seed = 0; seed < 300; ++seed) {
+        Tree tree(random_tree(1 + seed % 40, seed, "+-*", seed % 2 ? 9 : 100000));
+        __int128 expected;
+        if (!int128_value(tree.getRoot(), expected) || expected > half || expected < -half) continue;
+        ++compared;
+        negative += expected < 0;
+        if (!crt_matches(tree.getRoot(), expected)) ++bad;
+    }
+    CHECK(bad == 0);
+    CHECK(compared > 200);
+    CHECK(negative > 20);
+
+    // half = hi * 2^62 + lo, then the values around both ends of the range
+    const __int128 two62 = __int128(1) << 62;
+    auto leaf = [](__int128 v) { return new Node(crt_to_string(v)); };
+    auto near_half = [&](__int128 offset) {
+        return new Node("+", new Node("*", leaf(half / two62), leaf(two62)), leaf(half % two62 + offset));
+    };
+    Tree top(near_half(0));
+    CHECK(crt_matches(top.getRoot(), half));
+    Tree below(near_half(-1));
+    CHECK(crt_matches(below.getRoot(), half - 1));
+    Tree wrapped(near_half(1)); // (M + 1) / 2 is -half modulo M
+    CHECK(crt_matches(wrapped.getRoot(), -half));
+    Tree bottom(new Node("-", new Node("0"), near_half(0)));
+    CHECK(crt_matches(bottom.getRoot(), -half));
+    CHECK(crt_to_string(0) == "0");
+    CHECK(crt_to_string(-1) == "-1");
+
+    // the engine throws on the third lane: the caller's modulus comes back
+    const uint64_t saved = eval_modulus().value();
+    set_eval_modulus(1000003);
+    size_t lanes = 0;
+    bool threw = false;
+    try {
+        crt_evaluate_per_lane([&]() -> uint64_t {
+            if (++lanes == 3) throw std::domain_error("lane 3");
+            return eval_modulus().value() % 7;
+        });
+    } catch (const std::domain_error&) {
+        threw = true;
+    }
+    CHECK(threw);
+    CHECK(eval_modulus().value() == 1000003);
+    const CrtLanes lanes_seen = crt_evaluate_per_lane([]() { return eval_modulus().value(); });
+    for (size_t i = 0; i < CRT_LANES; ++i) CHECK(lanes_seen.v[i] == CRT_PRIMES[i]);
+    CHECK(eval_modulus().value() == 1000003);
+    set_eval_modulus(saved);
+}
+
+// -- PARALLEL CONTRACTION WITH DIVISION -----------------------------------------------------
+// A zero divisor found inside a pool task reaches the caller as std::domain_error.
+// -------------------------------------------------------------------------------------------
+
+static void test_contraction_division() {
+    ThreadPool pool(4);
+    int agree = 0, both_threw = 0, mismatched = 0;
+    for (uint64_t seed = 0; seed < 200; ++seed) {
+        Tree tree(random_tree(1 + seed % 300, seed, "+-*/", 20));
+        bool serial_threw = false, contract_threw = false;
+        uint64_t expected = 0, got = 0;
+        try {
+            expected = serial_residue(tree.getRoot());
+        } catch (const std::domain_error&) {
+            serial_threw = true;
+        }
+        try {
+            got = contract_residue(tree.getRoot(), pool);
+        } catch (const std::domain_error&) {
+            contract_threw = true;
+        }
+        if (serial_threw && contract_threw) ++both_threw;
+        else if (!serial_threw && !contract_threw && got == expected) ++agree;
+        else if (!serial_threw) ++mismatched; // the contraction may only report a zero divisor the serial one hits
+    }
+    CHECK(mismatched == 0);
+    CHECK(agree > 100);
+    CHECK(both_threw > 0);
+
+    // (7 * 3) / (4 - 4): the divisor is raked to 0 inside a task
+    Tree zero(new Node("/", new Node("*", new Node("7"), new Node("3")), new Node("-", new Node("4"), new Node("4"))));
+    bool threw = false;
+    try {
+        contract_residue(zero.getRoot(), pool);
+    } catch (const std::domain_error&) {
+        threw = true;
+    }
+    CHECK(threw);
+    // and the pool still works afterwards
+    Tree after(random_tree(100, 7));
+    CHECK(contract_residue(after.getRoot(), pool) == serial_residue(after.getRoot()));
+}
+
+// -- INCREMENTAL TREE -----------------------------------------------------------------------
+// value() after each edit against a full evaluation of the edited tree.
+// -------------------------------------------------------------------------------------------
+
+static std::vector<Node*> leaves_of(Node* root) {
+    std::vector<Node*> leaves, stack{root};
+    while (!stack.empty()) {
+        Node* node = stack.back();
+        stack.pop_back();
+        if (node->is_leaf()) leaves.push_back(node);
+        if (node->getLeftChild()) stack.push_back(node->getLeftChild());
+        if (node->getRightChild()) stack.push_back(node->getRightChild());
+    }
+    return leaves;
+}
+
+static void test_incremental_tree() {
+    for (uint64_t seed = 0; seed < 20; ++seed) {
+        Tree tree(random_tree(1 + seed * 50, seed));
+        std::vector<Node*> leaves = leaves_of(tree.getRoot());
+        IncrementalTree incremental(tree.getRoot());
+        CHECK(incremental.value() == serial_residue(tree.getRoot()));
+
+        std::mt19937_64 rng(seed);
+        int bad = 0;
+        for (int u = 0; u < 200; ++u) {
+            incremental.updateLeaf(leaves[rng() % leaves.size()], std::to_string(rng() % 1000));
+            if (incremental.value() != serial_residue(tree.getRoot())) ++bad;
+        }
+        CHECK(bad == 0);
+    }
+
+    // a root that divides by a leaf set to 0 throws, and recovers with the next edit
+    Node* divisor = new Node("4");
+    Tree quotient(new Node("/", new Node("*", new Node("7"), new Node("3")), divisor));
+    IncrementalTree incremental(quotient.getRoot());
+    incremental.updateLeaf(divisor, "0");
+    bool threw = false;
+    try {
+        incremental.value();
+    } catch (const std::domain_error&) {
+        threw = true;
+    }
+    CHECK(threw);
+    incremental.updateLeaf(divisor, "5");
+    CHECK(incremental.value() == serial_residue(quotient.getRoot()));
+}
+
+// Batches large enough to split across the pool, each naming some leaves twice, against the
+// same edits applied one at a time to a second copy.
+static void test_incremental_batches() {
+    ThreadPool pool(4);
+    for (uint64_t seed = 0; seed < 10; ++seed) {
+        Tree batched(random_tree(2000 + seed * 500, seed));
+        Tree single(Tree().copy_subtree(batched.getRoot()));
+        std::vector<Node*> batched_leaves = leaves_of(batched.getRoot()), single_leaves = leaves_of(single.getRoot());
+        IncrementalTree by_batch(batched.getRoot()), by_leaf(single.getRoot());
+
+        std::mt19937_64 rng(seed);
+        int bad = 0;
+        for (int round = 0; round < 5; ++round) {
+            std::vector<std::pair<Node*, std::string>> updates;
+            for (size_t u = 0; u < 3000; ++u) {
+                const size_t leaf = rng() % batched_leaves.size();
+                const std::string value = std::to_string(rng() % 1000);
+                updates.emplace_back(batched_leaves[leaf], value);
+                by_leaf.updateLeaf(single_leaves[leaf], value);
+                if (u % 10 == 0) { // the same leaf again, later in the batch: its last value wins
+                    const std::string again = std::to_string(rng() % 1000);
+                    updates.emplace_back(batched_leaves[leaf], again);
+                    by_leaf.updateLeaf(single_leaves[leaf], again);
+                }
+            }
+            by_batch.updateLeaves(updates, pool);
+            if (by_batch.value() != by_leaf.value()) ++bad;
+            if (by_batch.value() != serial_residue(batched.getRoot())) ++bad;
+        }
+        CHECK(bad == 0);
+
+        // a batch with an operator or an unparsable value at its end changes nothing
+        const uint64_t before = by_batch.value();
+        for (const std::pair<Node*, std::string>& last : {std::make_pair(batched.getRoot(), std::string("5")),
+                                                          std::make_pair(batched_leaves[0], std::string("five"))}) {
+            std::vector<std::pair<Node*, std::string>> updates;
+            for (size_t u = 0; u < 100; ++u) updates.emplace_back(batched_leaves[rng() % batched_leaves.size()], "7");
+            updates.push_back(last);
+            bool threw = false;
+            try {
+                by_batch.updateLeaves(updates, pool);
+            } catch (const std::invalid_argument&) {
+                threw = true;
+            }
+            CHECK(threw);
+            CHECK(by_batch.value() == before);
+            CHECK(serial_residue(batched.getRoot()) == before);
+        }
+    }
+}
+
+// -- PARTIAL EVALUATION ---------------------------------------------------------------------
+// contract_to_variable's f(x) against a full evaluation with the leaf set to x, including
+// leaves under a '/', where x = 0 may be a pole.
+// -------------------------------------------------------------------------------------------
+
+// Contracts a copy of root down to its leaf-th leaf and checks f at several x on root itself.
+static void check_partial(Node* root, size_t leaf, uint64_t seed, int& agree, int& mismatched) {
+    const Modulus& mod = eval_modulus();
+    Tree copy(Tree().copy_subtree(root));
+    const Mobius f = contract_to_variable(copy.getRoot(), leaves_of(copy.getRoot())[leaf]);
+
+    Node* variable = leaves_of(root)[leaf];
+    const std::string saved = variable->getString();
+    std::mt19937_64 rng(seed);
+    for (uint64_t x : {uint64_t(0), uint64_t(1), uint64_t(2), uint64_t(7), mod.value() - 1, rng() % mod.value()}) {
+        variable->setString(std::to_string(x));
+        bool serial_threw = false, partial_threw = false;
+        uint64_t expected = 0, got = 0;
+        try {
+            expected = serial_residue(root);
+        } catch (const std::domain_error&) {
+            serial_threw = true;
+        }
+        try {
+            got = mobius_apply(f, x, mod);
+        } catch (const std::domain_error&) {
+            partial_threw = true;
+        }
+        if (!serial_threw && !partial_threw && got == expected) ++agree;
+        else if (!serial_threw) ++mismatched; // f may only have a pole where the tree divides by zero
+    }
+    variable->setString(saved);
+}
+
+static void test_partial_evaluation() {
+    int agree = 0, mismatched = 0;
+    for (uint64_t seed = 0; seed < 20; ++seed) {
+        Tree bushy(random_tree(2 + seed * 20, seed));
+        check_partial(bushy.getRoot(), seed % (2 + seed * 20), seed, agree, mismatched);
+        // leaves in [1, 9] and no subtraction: only x can make a divisor vanish
+        Tree divided(random_tree(2 + seed * 20, seed, "+*/", 9));
+        check_partial(divided.getRoot(), (seed * 7) % (2 + seed * 20), seed, agree, mismatched);
+        Tree chain(caterpillar(1 + seed * 20, seed, "+*/", 9));
+        check_partial(chain.getRoot(), 0, seed, agree, mismatched);
+    }
+    // the variable x as divisor and as dividend
+    auto x_of = [](Node* root) {
+        const std::vector<Node*> leaves = leaves_of(root);
+        return static_cast<size_t>(std::find_if(leaves.begin(), leaves.end(), [](Node* leaf) { return leaf->getString() == "x"; }) -
+                                   leaves.begin());
+    };
+    Tree divisor(new Node("/", new Node("+", new Node("3"), new Node("4")), new Node("*", new Node("x"), new Node("2"))));
+    check_partial(divisor.getRoot(), x_of(divisor.getRoot()), 1, agree, mismatched);
+    Tree dividend(new Node("-", new Node("/", new Node("x"), new Node("7")), new Node("5")));
+    check_partial(dividend.getRoot(), x_of(dividend.getRoot()), 2, agree, mismatched);
+    CHECK(mismatched == 0);
+    CHECK(agree > 300);
+
+    // (3 + 4) / (x * 2) has a pole at 0
+    Tree pole(Tree().copy_subtree(divisor.getRoot()));
+    const Mobius f = contract_to_variable(pole.getRoot(), leaves_of(pole.getRoot())[x_of(pole.getRoot())]);
+    CHECK(!f.is_affine());
+    bool threw = false;
+    try {
+        mobius_apply(f, 0, eval_modulus());
+    } catch (const std::domain_error&) {
+        threw = true;
+    }
+    CHECK(threw);
+}
+
+// -- VERSIONED TREE -------------------------------------------------------------------------
+// Readers evaluate snapshots while a writer publishes batches; each snapshot must read as its
+// version did, and retired nodes must all be freed once no reader is left.
+// -------------------------------------------------------------------------------------------
+
+static std::vector<Node*> preorder(Node* root) {
+    std::vector<Node*> nodes, stack{root};
+    while (!stack.empty()) {
+        Node* node = stack.back();
+        stack.pop_back();
+        nodes.push_back(node);
+        if (node->getRightChild()) stack.push_back(node->getRightChild());
+        if (node->getLeftChild()) stack.push_back(node->getLeftChild());
+    }
+    return nodes;
+}
+
+static void test_versioned_tree() {
+    constexpr int VERSIONS = 300;
+    Tree reference(random_tree(1000, 11));
+    VersionedTree versioned(reference.getRoot());
+
+    // the batches and each version's value, worked out up front on the plain tree
+    std::vector<Node*> nodes = preorder(reference.getRoot());
+    std::vector<int> leaf_ids;
+    for (size_t id = 0; id < nodes.size(); ++id) {
+        if (nodes[id]->is_leaf()) leaf_ids.push_back(static_cast<int>(id));
+    }
+    std::mt19937_64 rng(11);
+    std::vector<std::vector<std::pair<int, std::string>>> batches(VERSIONS + 1);
+    std::vector<uint64_t> expected{serial_residue(reference.getRoot())};
+    for (auto& batch : batches) {
+        for (int u = 0; u < 20; ++u) {
+            const int id = leaf_ids[rng() % leaf_ids.size()];
+            batch.emplace_back(id, std::to_string(rng() % 1000));
+            nodes[id]->setString(batch.back().second);
+        }
+        expected.push_back(serial_residue(reference.getRoot()));
+    }
+
+    VersionedTree::Snapshot pinned = versioned.snapshot(); // keeps version 0 alive throughout
+    std::atomic<bool> done{false};
+    std::atomic<int> bad{0}, reads{0};
+    std::vector<std::thread> readers;
+    for (int r = 0; r < 4; ++r) {
+        readers.emplace_back([&]() {
+            while (!done.load()) {
+                VersionedTree::Snapshot snap = versioned.snapshot();
+                if (snap.version() > VERSIONS || snap.evaluate_residue() != expected[snap.version()]) ++bad;
+                ++reads;
+            }
+        });
+    }
+    std::thread writer([&]() {
+        for (int v = 0; v < VERSIONS; ++v) versioned.updateLeaves(batches[v]);
+        done.store(true);
+    });
+    writer.join();
+    for (std::thread& reader : readers) reader.join();
+
+    CHECK(bad.load() == 0);
+    CHECK(reads.load() > 0);
+    CHECK(versioned.version() == static_cast<uint64_t>(VERSIONS));
+    CHECK(pinned.evaluate_residue() == expected[0]);
+    CHECK(versioned.retired_count() > 0);
+
+    // with every reader gone, the next edit frees all that was retired, its own copies included
+    { VersionedTree::Snapshot released = std::move(pinned); }
+    versioned.updateLeaves(batches[VERSIONS]);
+    CHECK(versioned.retired_count() == 0);
+    CHECK(versioned.snapshot().evaluate_residue() == expected[VERSIONS + 1]);
+
+    // the next version shares the untouched subtrees: a published node keeps its parent
+    VersionedTree::Snapshot before = versioned.snapshot();
+    std::vector<Node*> published = preorder(before.getRoot()), parents;
+    for (Node* node : published) parents.push_back(node->getParent());
+    versioned.updateLeaves({{leaf_ids.front(), "3"}, {leaf_ids[leaf_ids.size() / 2], "4"}, {leaf_ids.back(), "5"}});
+    int moved = 0;
+    for (size_t i = 0; i < published.size(); ++i) moved += published[i]->getParent() != parents[i];
+    CHECK(moved == 0);
+    CHECK(before.evaluate_residue() == expected[VERSIONS + 1]);
+}
+
+// -- HASH-CONSING ---------------------------------------------------------------------------
+// The shared DAG evaluates as the tree did and frees every node once (run under ASan).
+// -------------------------------------------------------------------------------------------
+
+// 2^(height+1) - 1 nodes, both children of each node equal copies, so it conses to a chain.
+static Node* doubling_tree(int height, uint64_t seed) {
+    if (height == 0) return new Node(std::to_string(1 + seed % 9));
+    Node* half = doubling_tree(height - 1, seed * 31 + 7);
+    return new Node(std::string(1, "+-*"[seed % 3]), half, Tree().copy_subtree(half));
+}
+
+static void check_hash_cons(Node* root, size_t at_most_after) {
+    Tree original(root);
+    Tree shared(original.copy_subtree(root));
+    const double expected = original.evaluate();
+
+    HashConsStats stats = hash_cons(shared);
+    CHECK(stats.nodes_before == preorder_nodes(original.getRoot()).size());
+    CHECK(stats.nodes_after <= at_most_after);
+    CHECK(EvalCore<DoubleDomain>().evaluate_cached(shared.getRoot()) == expected);
+    CHECK(shared.evaluate() == expected);
+}
+
+static void test_hash_cons() {
+    check_hash_cons(doubling_tree(12, 3), 13);
+    // small leaves and one operator repeat many small subtrees, but not whole halves
+    for (uint64_t seed = 0; seed < 10; ++seed) {
+        Node* root = random_tree(2000, seed, "+", 3);
+        const size_t before = preorder_nodes(root).size();
+        check_hash_cons(root, before - 1);
+    }
+}
+
+// -- SUBTREE CACHE --------------------------------------------------------------------------
+// Values answered from the cache against the same trees evaluated without it, including
+// after edits and with a cache small enough to evict.
+// -------------------------------------------------------------------------------------------
+
+static void check_cached(Node* root, SubtreeCache& cache, int& bad) {
+    if (evaluate_through_cache(root, cache) != Tree().evaluate(root)) ++bad;
+    if (evaluate_residue_through_cache(root, cache) != serial_residue(root)) ++bad;
+}
+
+static void test_subtree_cache() {
+    SubtreeCache cache(1 << 12, 8);
+    int bad = 0;
+    std::vector<std::unique_ptr<Tree>> trees; // Tree copies are shallow
+    for (uint64_t seed = 0; seed < 10; ++seed) trees.emplace_back(new Tree(random_tree(3000, seed)));
+    for (auto& tree : trees) check_cached(tree->getRoot(), cache, bad); // fills
+    const uint64_t misses = cache.stats().misses;
+    for (auto& tree : trees) check_cached(tree->getRoot(), cache, bad); // the whole tree hits
+    CHECK(cache.stats().misses == misses);
+
+    // new trees made of cached subtrees under fresh operators: the old parts hit
+    for (size_t i = 0; i + 1 < trees.size(); ++i) {
+        Tree joined(new Node("-", Tree().copy_subtree(trees[i]->getRoot()), Tree().copy_subtree(trees[i + 1]->getRoot())));
+        const uint64_t hits = cache.stats().hits;
+        check_cached(joined.getRoot(), cache, bad);
+        CHECK(cache.stats().hits > hits);
+    }
+
+    // an edited leaf changes the keys above it, so no stale value is read
+    std::mt19937_64 rng(5);
+    for (auto& tree : trees) {
+        std::vector<Node*> leaves = leaves_of(tree->getRoot());
+        for (int u = 0; u < 20; ++u) {
+            tree->updateLeaf(leaves[rng() % leaves.size()], std::to_string(rng() % 1000));
+            check_cached(tree->getRoot(), cache, bad);
+        }
+    }
+
+    // a cache of 64 entries evicts constantly and still answers correctly
+    SubtreeCache tiny(64, 1);
+    for (int round = 0; round < 3; ++round) {
+        for (auto& tree : trees) check_cached(tree->getRoot(), tiny, bad);
+    }
+    CHECK(tiny.stats().evictions > 0);
+    CHECK(tiny.stats().entries <= 64);
+    CHECK(bad == 0);
+}
+
+// -- PREPARED EXPRESSION --------------------------------------------------------------------
+// evaluate_batch bit for bit against Tree::evaluate with each instance's leaves written back
+// into the tree. Counts that are not multiples of 8 or 4 leave remainder lanes for the scalar
+// kernel, zero leaves reach the division-by-zero blend, and huge ones the fmod fallback.
+// -------------------------------------------------------------------------------------------
+
+static bool same_bits(double a, double b) {
+    uint64_t x, y;
+    std::memcpy(&x, &a, sizeof x);
+    std::memcpy(&y, &b, sizeof y);
+    return x == y;
+}
+
+static std::string exact(double v) {
+    char text[32];
+    std::snprintf(text, sizeof text, "%.17g", v);
+    return text;
+}
+
+static void check_prepared(uint64_t seed) {
+    const size_t counts[] = {1, 3, 7, 9, 13, 63, 64, 65, 130, 1021};
+    Tree tree(random_tree(40 + seed * 30, seed, "+-*/", 9));
+    std::vector<Node*> leaves;
+    for (Node* node : preorder(tree.getRoot())) {
+        if (node->is_leaf()) leaves.push_back(node); // left to right, as the parameters
+    }
+    PreparedExpression prepared(tree.getRoot());
+    CHECK(prepared.parameter_count() == leaves.size());
+    CHECK(same_bits(prepared.evaluate(prepared.tree_parameters().data()), tree.evaluate()));
+
+    std::mt19937_64 rng(seed);
+    int bad = 0;
+    for (size_t count : counts) {
+        std::vector<double> params(leaves.size() * count);
+        for (double& v : params) {
+            switch (rng() % 8) {
+                case 0: v = 0; break; // division by zero
+                case 1: v = -static_cast<double>(rng() % 20); break;
+                case 2: v = static_cast<double>(rng() % 1000000) * 1e12; break; // past 2^52
+                case 3: v = static_cast<double>(rng() % 1000) / 8; break;
+                default: v = static_cast<double>(1 + rng() % 20); break;
+            }
+        }
+        std::vector<double> out(count);
+        prepared.evaluate_batch(params.data(), count, out.data());
+        std::vector<double> one(leaves.size());
+        for (size_t i = 0; i < count; ++i) {
+            for (size_t k = 0; k < leaves.size(); ++k) {
+                one[k] = params[k * count + i];
+                leaves[k]->setString(exact(one[k]));
+            }
+            const double expected = tree.evaluate();
+            if (!same_bits(out[i], expected)) ++bad;
+            if (!same_bits(prepared.evaluate(one.data()), expected)) ++bad;
+        }
+    }
+    CHECK(bad == 0);
+}
+
+// Every kernel this CPU can run, widest first.
+static void test_prepared_expression() {
+    for (LaneIsa isa : {LaneIsa::AVX512, LaneIsa::AVX2, LaneIsa::SCALAR}) {
+        PREPARED_MAX_ISA = isa;
+        for (uint64_t seed = 0; seed < 6; ++seed) check_prepared(seed);
+    }
+    PREPARED_MAX_ISA = LaneIsa::AVX512;
+}
+
+// -- CONTRACTION SCHEDULE -------------------------------------------------------------------
+// replay_all's value for every subtree against evaluating that subtree on its own, on bushy
+// trees and on caterpillars (long chains for the compress and expand levels), with a grain
+// small enough that the levels are split into tasks; and one schedule replayed for new leaf
+// values against the serial evaluation of the rewritten tree.
+// -------------------------------------------------------------------------------------------
+
+static void check_replay_all(Node* root, ThreadPool& pool, int& bad) {
+    ContractionSchedule schedule(root);
+    std::vector<Node*> nodes = preorder(root);
+    std::vector<uint64_t> values = schedule.replay_all(root, pool);
+    if (values.size() != nodes.size()) {
+        ++bad;
+        return;
+    }
+    for (size_t id = 0; id < nodes.size(); ++id) {
+        const uint64_t expected = serial_residue(nodes[id]);
+        if (values[id] != expected) ++bad;
+        if (!nodes[id]->hasValue() || nodes[id]->getEval() != static_cast<double>(expected)) ++bad;
+    }
+    if (schedule.replay(root, pool) != values[0]) ++bad;
+}
+
+static void test_replay_all() {
+    ThreadPool pool(4);
+    const size_t saved_grain = REPLAY_GRAIN;
+    int bad = 0;
+    for (size_t grain : {size_t(16), saved_grain}) {
+        REPLAY_GRAIN = grain;
+        for (uint64_t seed = 0; seed < 10; ++seed) {
+            Tree bushy(random_tree(1 + seed * 400, seed));
+            check_replay_all(bushy.getRoot(), pool, bad);
+            Tree chain(caterpillar(seed * 300, seed, "+-*", 1000));
+            check_replay_all(chain.getRoot(), pool, bad);
+        }
+        // division with leaves in [1, 9] and no subtraction, so no subtree divides by zero
+        for (uint64_t seed = 0; seed < 5; ++seed) {
+            Tree divided(random_tree(500, seed, "+*/", 9));
+            check_replay_all(divided.getRoot(), pool, bad);
+        }
+    }
+    REPLAY_GRAIN = saved_grain;
+    CHECK(bad == 0);
+
+    // 5 / (3 - 3) deep in a chain: the subtree throws although the root could cancel it
+    Tree zero(new Node("*", new Node("0"), new Node("/", new Node("5"), new Node("-", new Node("3"), new Node("3")))));
+    ContractionSchedule schedule(zero.getRoot());
+    bool threw = false;
+    try {
+        schedule.replay_all(zero.getRoot(), pool);
+    } catch (const std::domain_error&) {
+        threw = true;
+    }
+    CHECK(threw);
+}
+
+// A schedule recorded once, replayed for new leaf values on the same shape.
+static void check_replay_reused(Node* root, ThreadPool& pool, uint64_t seed, int max_leaf, int& bad) {
+    const ContractionSchedule schedule(root);
+    std::vector<Node*> leaves;
+    for (Node* node : preorder(root)) {
+        if (node->is_leaf()) leaves.push_back(node);
+    }
+    std::mt19937_64 rng(seed);
+    for (int trial = 0; trial < 5; ++trial) {
+        std::vector<uint64_t> leaf_values;
+        for (Node* leaf : leaves) {
+            leaf->setString(std::to_string(1 + rng() % max_leaf));
+            leaf->clearEval();
+            leaf_values.push_back(parse_residue(leaf->getString(), eval_modulus()));
+        }
+        const uint64_t expected = serial_residue(root);
+        if (schedule.replay(leaf_values, pool) != expected) ++bad;
+        if (schedule.replay(root, pool) != expected) ++bad;
+        if (schedule.replay_all(leaf_values, pool)[0] != expected) ++bad;
+    }
+}
+
+static void test_replay_reused() {
+    ThreadPool pool(4);
+    const size_t saved_grain = REPLAY_GRAIN;
+    REPLAY_GRAIN = 16;
+    int bad = 0;
+    for (uint64_t seed = 0; seed < 6; ++seed) {
+        Tree bushy(random_tree(1 + seed * 300, seed));
+        check_replay_reused(bushy.getRoot(), pool, seed, 1000, bad);
+        Tree chain(caterpillar(seed * 300, seed, "+-*", 1000));
+        check_replay_reused(chain.getRoot(), pool, seed, 1000, bad);
+        Tree divided(random_tree(300, seed, "+*/", 9));
+        check_replay_reused(divided.getRoot(), pool, seed, 9, bad);
+    }
+    REPLAY_GRAIN = saved_grain;
+    CHECK(bad == 0);
+}
+
+// -- RANDOMISED CONTRACTION -----------------------------------------------------------------
+// randomized_tree_evaluation in both compress modes against the serial residue, with and
+// without division. Coins and samples are keyed by (RANDOM_SEED, round, id), so teams of 1,
+// 2 and 7 members and the default team must run the same rounds to the same value and leave
+// the same sample.
+// -------------------------------------------------------------------------------------------
+
+// Tallies as in test_contraction_division: the contraction may only fail where the serial
+// evaluation divides by zero.
+static void check_randomised(Node* root, int& agree, int& both_threw, int& mismatched) {
+    bool serial_threw = false, contract_threw = false;
+    uint64_t expected = 0, got = 0;
+    try {
+        expected = serial_residue(root);
+    } catch (const std::domain_error&) {
+        serial_threw = true;
+    }
+    Tree copy(Tree().copy_subtree(root));
+    std::vector<Node*> nodes = preorder_nodes(copy.getRoot());
+    try {
+        got = randomized_tree_evaluation(nodes, copy.getRoot());
+    } catch (const std::domain_error&) {
+        contract_threw = true;
+    }
+    if (serial_threw && contract_threw) ++both_threw;
+    else if (!serial_threw && !contract_threw && got == expected) ++agree;
+    else if (!serial_threw) ++mismatched;
+}
+
+static void test_randomised_contraction() {
+    const CompressMode saved_mode = COMPRESS_MODE;
+    for (CompressMode mode : {CompressMode::RANDOMIZED, CompressMode::DETERMINISTIC}) {
+        COMPRESS_MODE = mode;
+        int agree = 0, both_threw = 0, mismatched = 0;
+        for (uint64_t seed = 0; seed < 20; ++seed) {
+            Tree bushy(random_tree(1 + seed * 100, seed));
+            check_randomised(bushy.getRoot(), agree, both_threw, mismatched);
+            Tree chain(caterpillar(seed * 100, seed, "+-*", 1000));
+            check_randomised(chain.getRoot(), agree, both_threw, mismatched);
+        }
+        CHECK(agree == 40);
+        agree = 0;
+        for (uint64_t seed = 0; seed < 100; ++seed) {
+            Tree bushy(random_tree(1 + seed * 3, seed, "+-*/", 20));
+            check_randomised(bushy.getRoot(), agree, both_threw, mismatched);
+            Tree chain(caterpillar(seed * 3, seed, "+-*/", 20));
+            check_randomised(chain.getRoot(), agree, both_threw, mismatched);
+        }
+        CHECK(mismatched == 0);
+        CHECK(agree > 100);
+        CHECK(both_threw > 0);
+    }
+    COMPRESS_MODE = saved_mode;
+}
+
+struct RandomisedRun {
+    int rounds = 0;
+    uint64_t value = 0;
+    std::vector<int> survivors; // ids left by the optimal algorithm
+
+    bool operator==(const RandomisedRun& other) const {
+        return rounds == other.rounds && value == other.value && survivors == other.survivors;
+    }
+};
+
+// Both algorithms on copies of root, with default_team() returning team.
+static RandomisedRun run_randomised(Node* root, WorkerTeam* team) {
+    DEFAULT_TEAM_OVERRIDE = team;
+    RandomisedRun run;
+    Tree evaluated(Tree().copy_subtree(root));
+    std::vector<Node*> nodes = preorder_nodes(evaluated.getRoot());
+    run.value = randomized_tree_evaluation(nodes, evaluated.getRoot(), &run.rounds);
+    Tree sampled(Tree().copy_subtree(root));
+    nodes = preorder_nodes(sampled.getRoot());
+    optimal_randomised_tree_evaluation_algorithm(nodes);
+    for (Node* v : nodes) run.survivors.push_back(v->getId());
+    DEFAULT_TEAM_OVERRIDE = nullptr;
+    return run;
+}
+
+static void test_randomised_determinism() {
+    WorkerTeam one(1, Affinity::NONE), two(2, Affinity::NONE), seven(7, Affinity::NONE);
+    DEFAULT_TEAM_OVERRIDE = &seven;
+    CHECK(default_team().size() == 7);
+    DEFAULT_TEAM_OVERRIDE = nullptr;
+
+    const CompressMode saved_mode = COMPRESS_MODE;
+    const uint64_t saved_seed = RANDOM_SEED;
+    int bad = 0, contracted = 0;
+    for (CompressMode mode : {CompressMode::RANDOMIZED, CompressMode::DETERMINISTIC}) {
+        COMPRESS_MODE = mode;
+        for (uint64_t seed = 0; seed < 4; ++seed) {
+            RANDOM_SEED = saved_seed + seed;
+            Tree bushy(random_tree(1 + seed * 1000, seed));
+            Tree chain(caterpillar(seed * 1000, seed, "+-*", 1000));
+            for (Node* root : {bushy.getRoot(), chain.getRoot()}) {
+                const RandomisedRun base = run_randomised(root, &one);
+                if (base.rounds > 0) ++contracted;
+                for (WorkerTeam* team : {&two, &seven, static_cast<WorkerTeam*>(nullptr)}) {
+                    if (!(run_randomised(root, team) == base)) ++bad;
+                }
+            }
+        }
+    }
+    COMPRESS_MODE = saved_mode;
+    RANDOM_SEED = saved_seed;
+    CHECK(bad == 0);
+    CHECK(contracted >= 12);
+}
+
+// -- WORK DEQUE -----------------------------------------------------------------------------
+// The owner pushes in bursts, taking some back, and then pushes and takes single items while
+// thieves steal; every item must be taken exactly once. The first burst goes in before the
+// thieves start, so the ring has grown past INITIAL_DEQUE_CAPACITY while they steal from it.
+// -------------------------------------------------------------------------------------------
+
+static void test_work_deque() {
+    constexpr size_t ITEMS = 200000, BURST = 3 * INITIAL_DEQUE_CAPACITY;
+    for (int thieves = 1; thieves <= 4; thieves *= 2) {
+        std::vector<size_t> ids(ITEMS);
+        std::iota(ids.begin(), ids.end(), size_t(0));
+        std::vector<std::atomic<int>> taken(ITEMS);
+        for (auto& t : taken) t.store(0);
+
+        WorkDeque<size_t> deque;
+        size_t next = 0;
+        for (; next < BURST; ++next) deque.push(&ids[next]);
+        CHECK(deque.capacity() > INITIAL_DEQUE_CAPACITY);
+
+        std::atomic<bool> done{false};
+        std::vector<std::thread> threads;
+        for (int k = 0; k < thieves; ++k) {
+            threads.emplace_back([&]() {
+                while (!done.load()) {
+                    if (size_t* id = deque.steal()) ++taken[*id];
+                    else std::this_thread::yield();
+                }
+            });
+        }
+        while (next < ITEMS) {
+            const size_t end = std::min(ITEMS, next + BURST);
+            for (; next < end; ++next) {
+                deque.push(&ids[next]);
+                if (next % 3 == 0) { // interleaved takes race the thieves for the bottom
+                    if (size_t* id = deque.take()) ++taken[*id];
+                }
+                if (next % 64 == 0) std::this_thread::yield();
+            }
+            while (size_t* id = deque.take()) ++taken[*id];
+            // then one at a time, so each take races the thieves for the last item
+            for (size_t one = 0; one < BURST && next < ITEMS; ++one, ++next) {
+                deque.push(&ids[next]);
+                if (one % 16 == 0) std::this_thread::yield(); // lets the thieves in on a single core
+                if (size_t* id = deque.take()) ++taken[*id];
+            }
+        }
+        done.store(true);
+        for (std::thread& thread : threads) thread.join();
+
+        int bad = 0;
+        for (auto& t : taken) {
+            if (t.load() != 1) ++bad;
+        }
+        CHECK(bad == 0);
+        CHECK(deque.steal() == nullptr);
+        CHECK(deque.take() == nullptr);
+    }
+}
+
+// -- POOL PHASES ----------------------------------------------------------------------------
+// ThreadPool::wait() on the phase latch, reused round after round: quick rounds that finish
+// while the waiter spins, slow ones that make it park on the futex, tasks that enqueue more,
+// and a task that throws on a worker. A lost wake-up hangs, so a watchdog turns one into a
+// failure.
+// -------------------------------------------------------------------------------------------
+
+static void test_pool_phases() {
+    std::atomic<bool> finished{false};
+    std::thread watchdog([&]() {
+        for (int tenth = 0; tenth < 600 && !finished.load(); ++tenth) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        if (!finished.load()) {
+            std::cerr << "pool phases: wait() did not return within a minute" << std::endl;
+            std::abort();
+        }
+    });
+
+    ThreadPool pool(4);
+    pool.wait(); // nothing enqueued
+    std::atomic<int> ran{0};
+    int bad = 0;
+    for (int round = 0; round < 2000; ++round) {
+        ran.store(0);
+        const int tasks = round % 7; // 0 included: a phase that was never opened
+        for (int t = 0; t < tasks; ++t) pool.enqueue([&]() { ++ran; });
+        pool.wait();
+        if (ran.load() != tasks) ++bad;
+    }
+    CHECK(bad == 0);
+
+    // tasks slower than the spin, so the waiter parks and the last count_down wakes it
+    bad = 0;
+    for (int round = 0; round < 20; ++round) {
+        ran.store(0);
+        for (int t = 0; t < 3; ++t) {
+            pool.enqueue([&, t]() {
+                std::this_thread::sleep_for(std::chrono::milliseconds(2 + t * 3));
+                ++ran;
+            });
+        }
+        pool.wait();
+        if (ran.load() != 3) ++bad;
+    }
+    CHECK(bad == 0);
+
+    // tasks enqueued by tasks join the phase
+    ran.store(0);
+    for (int t = 0; t < 8; ++t) {
+        pool.enqueue([&]() {
+            for (int c = 0; c < 8; ++c) {
+                pool.enqueue([&]() {
+                    std::this_thread::sleep_for(std::chrono::microseconds(200));
+                    ++ran;
+                });
+            }
+        });
+    }
+    pool.wait();
+    CHECK(ran.load() == 64);
+
+    // thrown on a worker (the caller sleeps first, so one takes it), rethrown by wait() once
+    for (int round = 0; round < 3; ++round) {
+        ran.store(0);
+        pool.enqueue([]() { throw std::runtime_error("task failed"); });
+        for (int t = 0; t < 10; ++t) pool.enqueue([&]() { ++ran; });
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        bool threw = false;
+        try {
+            pool.wait();
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        CHECK(threw);
+        CHECK(ran.load() == 10); // the others still ran
+        pool.enqueue([&]() { ++ran; });
+        pool.wait(); // the next phase starts clean
+        CHECK(ran.load() == 11);
+    }
+
+    finished.store(true);
+    watchdog.join();
+}
+
+// -- FUTURES AND GROUPS ---------------------------------------------------------------------
+// submit() results, exceptions through Future::get, TaskGroup::wait and ThreadPool::wait,
+// groups waited from inside pool tasks, and divide and conquer on futures.
+// -------------------------------------------------------------------------------------------
+
+static void test_futures() {
+    ThreadPool pool(4);
+    std::vector<ThreadPool::Future<long>> sums;
+    for (long i = 0; i < 1000; ++i) {
+        sums.push_back(pool.submit([i]() {
+            long sum = 0;
+            for (long k = 0; k <= i; ++k) sum += k;
+            return sum;
+        }));
+    }
+    int bad = 0;
+    for (long i = 0; i < 1000; ++i) {
+        if (sums[i].get() != i * (i + 1) / 2) ++bad;
+    }
+    CHECK(bad == 0);
+    pool.submit([]() {}).get();
+
+    bool threw = false;
+    ThreadPool::Future<int> failing = pool.submit([]() -> int { throw std::runtime_error("boom"); });
+    try {
+        failing.get();
+    } catch (const std::runtime_error& e) {
+        threw = std::string(e.what()) == "boom";
+    }
+    CHECK(threw);
+
+    // one throwing task in a group: wait() rethrows once the rest have run
+    {
+        ThreadPool::TaskGroup group(pool);
+        std::atomic<int> ran{0};
+        for (int i = 0; i < 100; ++i) {
+            group.run([&, i]() {
+                ++ran;
+                if (i == 50) throw std::logic_error("task 50");
+            });
+        }
+        threw = false;
+        try {
+            group.wait();
+        } catch (const std::logic_error&) {
+            threw = true;
+        }
+        CHECK(threw);
+        CHECK(ran.load() == 100);
+        group.run([&]() { ++ran; });
+        group.wait();
+        CHECK(ran.load() == 101);
+    }
+
+    // groups waited from inside pool tasks, an exception crossing both levels
+    {
+        ThreadPool::TaskGroup outer(pool);
+        std::atomic<long> sum{0};
+        for (int i = 0; i < 50; ++i) {
+            outer.run([&, i]() {
+                ThreadPool::TaskGroup inner(pool);
+                inner.parallel_for(0, 1000, 10, [&](size_t lo, size_t hi) {
+                    for (size_t k = lo; k < hi; ++k) sum += static_cast<long>(k);
+                });
+                if (i == 7) inner.run([]() { throw std::runtime_error("inner"); });
+                inner.wait();
+            });
+        }
+        threw = false;
+        try {
+            outer.wait();
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        CHECK(threw);
+        CHECK(sum.load() == 50L * 999 * 1000 / 2);
+    }
+
+    // a phase task throwing reaches ThreadPool::wait, not the futures
+    pool.enqueue([]() { throw std::runtime_error("phase"); });
+    ThreadPool::Future<int> unrelated = pool.submit([]() { return 1; });
+    threw = false;
+    try {
+        pool.wait();
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    CHECK(threw);
+    CHECK(unrelated.get() == 1);
+
+    // divide and conquer hands subtrees to its pool through submit()
+    for (int threads : {1, 2, 4, 8}) {
+        Tree tree(random_tree(5000, threads, "+-*/", 50));
+        const double expected = tree.evaluate();
+        Tree copy(tree.copy_subtree(tree.getRoot()));
+        CHECK(same_bits(evaluate_parallel(copy.getRoot(), threads), expected));
+    }
+    // an operator as a leaf, deep on the left where a pool task finds it
+    Node* bottom = new Node("+");
+    Node* spine = bottom;
+    for (int i = 0; i < 20; ++i) spine = new Node("*", spine, new Node("3"));
+    Tree invalid(spine);
+    threw = false;
+    try {
+        evaluate_parallel(invalid.getRoot(), 4);
+    } catch (const std::exception&) { // runtime_error from a task, invalid_argument (stod) from a serial part
+        threw = true;
+    }
+    CHECK(threw);
+}
+
+// -- AUTOTUNE -------------------------------------------------------------------------------
+// A calibration that throws leaves the grains as they were, and a large tree is calibrated
+// within the budget.
+// -------------------------------------------------------------------------------------------
+
+static void test_autotune() {
+    const std::string profile = "unittests_autotune_profile.txt";
+    std::remove(profile.c_str());
+    Autotuner tuner(profile);
+    const size_t saved_batch = BATCH_SIZE, saved_grain = REPLAY_GRAIN;
+    BATCH_SIZE = 11;
+    REPLAY_GRAIN = 333;
+
+    // (7 * 3) / (4 - 4): every run throws, after the sweep has set its grain
+    Tree zero(new Node("/", new Node("*", new Node("7"), new Node("3")), new Node("-", new Node("4"), new Node("4"))));
+    for (TunedEngine engine : {TunedEngine::CONTRACTION, TunedEngine::REPLAY}) {
+        bool threw = false;
+        try {
+            tuner.calibrate(engine, zero.getRoot());
+        } catch (const std::domain_error&) {
+            threw = true;
+        }
+        CHECK(threw);
+        CHECK(BATCH_SIZE == 11);
+        CHECK(REPLAY_GRAIN == 333);
+    }
+
+    const double saved_budget = AUTOTUNE_BUDGET;
+    AUTOTUNE_BUDGET = 0.25;
+    Tree large(random_tree(300000, 3));
+    for (TunedEngine engine : {TunedEngine::CONTRACTION, TunedEngine::REPLAY}) {
+        const auto start = std::chrono::steady_clock::now();
+        const TuneSetting setting = tuner.calibrate(engine, large.getRoot());
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        CHECK(elapsed.count() < 4 * AUTOTUNE_BUDGET + 1); // the budget, the probe and measuring the tree
+        CHECK(setting.threads >= 1 && setting.threads <= static_cast<size_t>(MAX_THREADS));
+        CHECK(setting.grain > 0);
+        CHECK(tuner.calibrated(engine, measure_shape(large.getRoot())));
+    }
+    CHECK(BATCH_SIZE == 11);
+    CHECK(REPLAY_GRAIN == 333);
+
+    AUTOTUNE_BUDGET = saved_budget;
+    BATCH_SIZE = saved_batch;
+    REPLAY_GRAIN = saved_grain;
+    std::remove(profile.c_str());
+}
+
+int main() {
+    test_worker_team();
+    test_cpu_topology();
+    test_parallel_compact();
+    test_first_touch();
+    test_mod_arith();
+    test_affine_kernels();
+    test_crt_lanes();
+    test_contraction_division();
+    test_incremental_tree();
+    test_incremental_batches();
+    test_partial_evaluation();
+    test_versioned_tree();
+    test_hash_cons();
+    test_subtree_cache();
+    test_prepared_expression();
+    test_replay_all();
+    test_replay_reused();
+    test_randomised_contraction();
+    test_randomised_determinism();
+    test_work_deque();
+    test_pool_phases();
+    test_futures();
+    test_autotune();
+
+    if (failures) {
+        std::cout << failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+    std::cout << "all checks passed" << std::endl;
+    return 0;
+}